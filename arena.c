@@ -0,0 +1,130 @@
+/*-------------------------------------------------------------------------
+ *
+ * arena.c: region allocator for file lists
+ *
+ * A phase of a command that builds large file lists, such as taking a
+ * backup or restoring a chain, runs between file_arena_begin() and
+ * file_arena_end().  In between, pgFile entries and their paths are carved
+ * out of big chunks instead of being allocated one by one: each path is
+ * stored right after its entry, there is no per-allocation overhead, and
+ * all of them are released at once when the phase ends.  pgFileFree() of
+ * an entry in the arena releases only what was allocated on the heap later.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <pthread.h>
+
+#define ARENA_CHUNK_SIZE	(1024 * 1024)
+
+typedef struct ArenaChunk
+{
+	struct ArenaChunk *next;
+	size_t		size;			/* bytes of data */
+	size_t		used;
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+} ArenaChunk;
+
+struct pgArena
+{
+	pthread_mutex_t lock;
+	ArenaChunk *chunks;			/* current chunk first */
+};
+
+/* arena of the current phase, NULL to allocate files on the heap */
+pgArena	   *file_arena = NULL;
+
+static pgArena *
+arena_create(void)
+{
+	pgArena    *arena = pgut_new(pgArena);
+
+	pthread_mutex_init(&arena->lock, NULL);
+	arena->chunks = NULL;
+	return arena;
+}
+
+static void
+arena_free(pgArena *arena)
+{
+	ArenaChunk *chunk = arena->chunks;
+
+	while (chunk)
+	{
+		ArenaChunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+	pthread_mutex_destroy(&arena->lock);
+	free(arena);
+}
+
+/*
+ * Allocate size bytes, MAXALIGNed, from arena.  Safe to call from several
+ * threads.
+ */
+void *
+arena_alloc(pgArena *arena, size_t size)
+{
+	ArenaChunk *chunk;
+	void	   *ptr;
+
+	size = MAXALIGN(size);
+
+	pthread_mutex_lock(&arena->lock);
+	chunk = arena->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < size)
+	{
+		size_t		chunk_size = Max(size, ARENA_CHUNK_SIZE);
+
+		chunk = pgut_malloc(offsetof(ArenaChunk, data) + chunk_size);
+		chunk->size = chunk_size;
+		chunk->used = 0;
+
+		/* a big allocation doesn't waste the rest of the current chunk */
+		if (size > ARENA_CHUNK_SIZE / 2 && arena->chunks != NULL)
+		{
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		}
+		else
+		{
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	pthread_mutex_unlock(&arena->lock);
+
+	return ptr;
+}
+
+/*
+ * Start a phase allocating files in a new arena.  Returns the arena of the
+ * enclosing phase, to be passed to file_arena_end().
+ */
+pgArena *
+file_arena_begin(void)
+{
+	pgArena    *outer = file_arena;
+
+	file_arena = arena_create();
+	return outer;
+}
+
+/*
+ * End the current phase and release all the files allocated in it.  None of
+ * them may be used afterwards.
+ */
+void
+file_arena_end(pgArena *outer)
+{
+	Assert(file_arena != NULL);
+
+	arena_free(file_arena);
+	file_arena = outer;
+}
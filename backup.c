@@ -19,6 +19,7 @@
 #include <time.h>
 #include <pthread.h>
 
+#include "catalog/pg_tablespace.h"
 #include "libpq/pqsignal.h"
 #include "pgut/pgut-port.h"
 #include "storage/bufpage.h"
@@ -29,6 +30,9 @@
 /* wait 10 sec until WAL archive complete */
 #define TIMEOUT_ARCHIVE 10
 
+/* relations whose ptrack maps are fetched by one query */
+#define PTRACK_BATCH_SIZE	1000
+
 /* Server version */
 static int server_version = 0;
 
@@ -48,16 +52,69 @@ typedef struct
 {
 	const char *from_root;
 	const char *to_root;
-	parray *files;
-	parray *prev_files;
+	int ntasks;
+	parray_index *prev_files;	/* previous file list indexed by path */
 	const XLogRecPtr *lsn;
+	parray *deferred;			/* tasks of recently modified files, NULL in
+								   the last pass */
 } backup_files_args;
 
+/* protects backup_files_args.deferred */
+static pthread_mutex_t deferred_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* WAL position last read by lsn_is_inserted(), protected by insert_lsn_mutex */
+static XLogRecPtr insert_lsn = InvalidXLogRecPtr;
+static pthread_mutex_t insert_lsn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A file is copied once the clock is this far past its mtime, so that a
+ * later write can't leave mtime unchanged.  File systems stamp mtime from a
+ * coarse clock which may lag behind by a timer tick.
+ */
+#define MTIME_MARGIN_NSEC	20000000	/* 20ms */
+
+/*
+ * Data files larger than two parts are copied as block ranges of
+ * BACKUP_PART_BLOCKS blocks by several threads when running in parallel.
+ * Parts start at a chunk boundary, each chunk hash covers one part only.
+ */
+#define BACKUP_PART_BLOCKS		(RELSEG_SIZE / 8)
+
+/* state shared by the parts of a split data file */
+typedef struct
+{
+	int				nparts;
+	volatile uint32	remaining;		/* parts not finished yet */
+	volatile bool	skipped;		/* some part was not copied */
+	volatile size_t	read_size;		/* sums over the copied parts */
+	volatile size_t	write_size;
+	size_t		   *write_sizes;	/* size of each part */
+	pg_crc32	   *crcs;			/* CRC of each part */
+	pgChunkHash	  **chunks;			/* chunk hashes of each part */
+	int			   *nchunks;
+} backup_split;
+
+/* unit of work of backup_files(): a whole file or a part of a data file */
+typedef struct
+{
+	pgFile		   *file;
+	size_t			size;			/* amount of data, for ordering */
+	BlockNumber		start_blk;
+	BlockNumber		end_blk;
+	int				part;
+	backup_split   *split;			/* NULL if the file is copied whole */
+} backup_task;
+
 /*
  * Backup routines
  */
 static void backup_cleanup(bool fatal, void *userdata);
-static void backup_files(void *arg);
+static void backup_files(void *task, int index, void *arg);
+static bool datafile_is_unchanged(pgFile *file, pgFile *prev_file);
+static void backup_task_done(backup_task *task, backup_files_args *arguments,
+							 bool copied);
+static parray *make_backup_tasks(parray *files, parray *splits);
+static int backup_task_compare_size_desc(const void *t1, const void *t2);
 static parray *do_backup_database(parray *backup_list, pgBackupOption bkupopt);
 static void confirm_block_size(const char *name, int blcksz);
 static void pg_start_backup(const char *label, bool smooth, pgBackup *backup);
@@ -69,10 +126,6 @@ static void pg_ptrack_clear(void);
 static bool pg_ptrack_support(void);
 static bool pg_ptrack_enable(void);
 static bool pg_is_in_recovery(void);
-static char *pg_ptrack_get_and_clear(Oid tablespace_oid,
-									 Oid db_oid,
-									 Oid rel_oid,
-									 size_t *result_size);
 static void add_files(parray *files, const char *root, bool add_root, bool is_pgdata);
 static void create_file_list(parray *files,
 							 const char *root,
@@ -82,6 +135,8 @@ static void create_file_list(parray *files,
 static void wait_for_archive(PGconn *conn, pgBackup *backup, const char *sql, bool stop_backup);
 static void wait_archive_lsn(XLogRecPtr lsn, bool last_segno);
 static void make_pagemap_from_ptrack(parray *files);
+static void build_datafile_hash(parray *files);
+static void free_datafile_hash(void);
 static void StreamLog(void *arg);
 
 
@@ -100,17 +155,17 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 {
 	int			i;
 	parray	   *prev_files = NULL;	/* file list of previous database backup */
+	parray_index *prev_files_index = NULL;
 	FILE	   *fp;
 	char		path[MAXPGPATH];
 	char		dst_backup_path[MAXPGPATH];
 	char		label[1024];
 	XLogRecPtr *lsn = NULL;
-	char		prev_file_txt[MAXPGPATH];	/* path of the previous backup
-											 * list file */
 	bool		has_backup_label  = true;	/* flag if backup_label is there */
-	pthread_t	backup_threads[num_threads];
 	pthread_t	stream_thread;
-	backup_files_args *backup_threads_args[num_threads];
+	backup_files_args backup_args;
+	parray	   *backup_tasks;
+	parray	   *backup_splits;
 	bool		is_ptrack_support;
 
 
@@ -152,7 +207,8 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 	 * full backup on current timeline.
 	 */
 	if (current.backup_mode == BACKUP_MODE_DIFF_PAGE ||
-		current.backup_mode == BACKUP_MODE_DIFF_PTRACK)
+		current.backup_mode == BACKUP_MODE_DIFF_PTRACK ||
+		current.backup_mode == BACKUP_MODE_DIFF_DELTA)
 	{
 		pgBackup   *prev_backup;
 
@@ -204,13 +260,23 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 
 	/*
 	 * List directories and symbolic links with the physical path to make
-	 * mkdirs.sh, then sort them in order of path. Omit $PGDATA.
+	 * the directory list and mkdirs.sh, then sort them in order of path.
+	 * Omit $PGDATA.  Restore uses the directory list, mkdirs.sh is kept for
+	 * older versions of pg_probackup.
 	 */
 	backup_files_list = parray_new();
-	dir_list_file(backup_files_list, pgdata, NULL, false, false);
+	dir_list_dirs(backup_files_list, pgdata);
 
 	if (!check)
 	{
+		pgBackupGetPath(&current, path, lengthof(path), DATABASE_DIR_LIST);
+		fp = fopen(path, "wt");
+		if (fp == NULL)
+			elog(ERROR, "can't open directory list \"%s\": %s",
+				path, strerror(errno));
+		dir_print_layout(fp, backup_files_list, pgdata);
+		fclose(fp);
+
 		pgBackupGetPath(&current, path, lengthof(path), MKDIRS_SH_FILE);
 		fp = fopen(path, "wt");
 		if (fp == NULL)
@@ -233,13 +299,14 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 	 * backup is needed.
 	 */
 	if (current.backup_mode == BACKUP_MODE_DIFF_PAGE ||
-		current.backup_mode == BACKUP_MODE_DIFF_PTRACK)
+		current.backup_mode == BACKUP_MODE_DIFF_PTRACK ||
+		current.backup_mode == BACKUP_MODE_DIFF_DELTA)
 	{
 		/* find last completed database backup */
 		prev_backup = catalog_get_last_data_backup(backup_list, current.tli);
-		pgBackupGetPath(prev_backup, prev_file_txt, lengthof(prev_file_txt),
-			DATABASE_FILE_LIST);
-		prev_files = dir_read_file_list(pgdata, prev_file_txt);
+		prev_files = read_backup_file_list(prev_backup, pgdata);
+		prev_files_index = parray_index_new(prev_files, pgFileHashPath,
+											pgFileComparePath);
 
 		/*
 		 * Do backup only pages having larger LSN than previous backup.
@@ -276,7 +343,6 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 		wait_for_archive(connection, &current, "SELECT * FROM pg_switch_xlog()", false);
 
 		/* Now build the page map */
-		parray_qsort(backup_files_list, pgFileComparePathDesc);
 		elog(LOG, "extractPageMap");
 		elog(LOG, "current_tli:%X", current.tli);
 		elog(LOG, "prev_backup->start_lsn: %X/%X",
@@ -285,8 +351,10 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 		elog(LOG, "current.start_lsn: %X/%X",
 			 (uint32) (current.start_lsn >> 32),
 			 (uint32) (current.start_lsn));
+		build_datafile_hash(backup_files_list);
 		extractPageMap(arclog_path, prev_backup->start_lsn, current.tli,
 					   current.start_lsn);
+		free_datafile_hash();
 	}
 
 	if (current.backup_mode == BACKUP_MODE_DIFF_PTRACK)
@@ -297,39 +365,22 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 				ptrack_lsn,
 				prev_backup->start_lsn,
 				current.start_lsn);
-		parray_qsort(backup_files_list, pgFileComparePathDesc);
 		make_pagemap_from_ptrack(backup_files_list);
 	}
 
 	/* sort pathname ascending */
 	parray_qsort(backup_files_list, pgFileComparePath);
 
-	/* make dirs before backup */
+	/*
+	 * Make dirs before backup.  The type of each entry comes from the
+	 * listing, files removed since are skipped when they are copied.
+	 */
 	for (i = 0; i < parray_num(backup_files_list); i++)
 	{
-		int ret;
-		struct stat buf;
 		pgFile *file = (pgFile *) parray_get(backup_files_list, i);
 
-		ret = stat(file->path, &buf);
-		if (ret == -1)
-		{
-			if (errno == ENOENT)
-			{
-				/* record as skipped file in file_xxx.txt */
-				file->write_size = BYTES_INVALID;
-				elog(LOG, "skip");
-				continue;
-			}
-			else
-			{
-				elog(ERROR,
-					"can't stat backup mode. \"%s\": %s",
-					file->path, strerror(errno));
-			}
-		}
 		/* if the entry was a directory, create it in the backup */
-		if (S_ISDIR(buf.st_mode))
+		if (S_ISDIR(file->mode))
 		{
 			char dirpath[MAXPGPATH];
 			if (verbose)
@@ -343,42 +394,54 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 			total_files_num++;
 		}
 
-		__sync_lock_release(&file->lock);
 	}
 
 	if (num_threads < 1)
 		num_threads = 1;
 
-	/* sort by size for load balancing */
-	parray_qsort(backup_files_list, pgFileCompareSize);
+	/* split large data files and hand out the largest pieces first */
+	backup_splits = parray_new();
+	backup_tasks = make_backup_tasks(backup_files_list, backup_splits);
 
-	/* init thread args with own file lists */
-	for (i = 0; i < num_threads; i++)
-	{
-		backup_files_args *arg = pg_malloc(sizeof(backup_files_args));
-		arg->from_root = pgdata;
-		arg->to_root = path;
-		arg->files = backup_files_list;
-		arg->prev_files = prev_files;
-		arg->lsn = lsn;
-		backup_threads_args[i] = arg;
-	}
+	backup_args.from_root = pgdata;
+	backup_args.to_root = path;
+	backup_args.ntasks = parray_num(backup_tasks);
+	backup_args.prev_files = prev_files_index;
+	backup_args.lsn = lsn;
+	backup_args.deferred = parray_new();
 
 	total_copy_files_increment = 0;
 
-	/* Run threads */
-	for (i = 0; i < num_threads; i++)
+	if (verbose)
+		elog(LOG, "Start %d threads for %d tasks", num_threads,
+			 backup_args.ntasks);
+	run_tasks(backup_tasks, num_threads, backup_files, &backup_args);
+
+	/* copy the files put aside as modified too recently */
+	if (parray_num(backup_args.deferred) > 0)
 	{
-		if (verbose)
-			elog(WARNING, "Start thread num:%li", parray_num(backup_threads_args[i]->files));
-		pthread_create(&backup_threads[i], NULL, (void *(*)(void *)) backup_files, backup_threads_args[i]);
+		parray	   *deferred = backup_args.deferred;
+
+		elog(LOG, "copy %lu recently modified files",
+			 (unsigned long) parray_num(deferred));
+		parray_qsort(deferred, backup_task_compare_size_desc);
+		backup_args.deferred = NULL;
+		backup_args.ntasks = parray_num(deferred);
+		run_tasks(deferred, num_threads, backup_files, &backup_args);
+		backup_args.deferred = deferred;
 	}
+	parray_free(backup_args.deferred);
+
+	parray_walk(backup_tasks, pg_free);
+	parray_free(backup_tasks);
+	parray_walk(backup_splits, pg_free);
+	parray_free(backup_splits);
 
-	/* Wait theads */
-	for (i = 0; i < num_threads; i++)
+	if (prev_files)
 	{
-		pthread_join(backup_threads[i], NULL);
-		pg_free(backup_threads_args[i]);
+		parray_index_free(prev_files_index);
+		parray_walk(prev_files, pgFileFree);
+		parray_free(prev_files);
 	}
 
 	if (progress)
@@ -408,16 +471,22 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 			calc_file(file);
 			if (strstr(file->path, path) == file->path)
 			{
-				char *ptr = file->path;
-				file->path = pstrdup(JoinPathEnd(ptr, path));
-				free(ptr);
+				pgFileSetPath(file, JoinPathEnd(file->path, path));
 			}
 		}
 		parray_concat(backup_files_list, list_file);
 	}
 
-	/* Create file list */
+	/* Create file list, as text and as the binary manifest */
 	create_file_list(backup_files_list, pgdata, DATABASE_FILE_LIST, NULL, false);
+	if (!check)
+	{
+		char	manifest_path[MAXPGPATH];
+
+		pgBackupGetPath(&current, manifest_path, lengthof(manifest_path),
+						DATABASE_FILE_MANIFEST);
+		manifest_write(manifest_path, backup_files_list, pgdata);
+	}
 
 	/* Print summary of size of backup mode files */
 	for (i = 0; i < parray_num(backup_files_list); i++)
@@ -431,7 +500,8 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 		 * backup only the data read counts.
 		 */
 		if (current.backup_mode == BACKUP_MODE_DIFF_PAGE ||
-			current.backup_mode == BACKUP_MODE_DIFF_PTRACK)
+			current.backup_mode == BACKUP_MODE_DIFF_PTRACK ||
+			current.backup_mode == BACKUP_MODE_DIFF_DELTA)
 			current.data_bytes += file->write_size;
 		else if (current.backup_mode == BACKUP_MODE_FULL)
 			current.data_bytes += file->size;
@@ -450,6 +520,7 @@ do_backup(pgBackupOption bkupopt)
 {
 	parray *backup_list;
 	parray *files_database;
+	pgArena *outer_arena;
 	int		ret;
 
 	/* repack the necessary options */
@@ -502,6 +573,9 @@ do_backup(pgBackupOption bkupopt)
 	current.recovery_time = (time_t) 0;
 	current.checksum_version = get_data_checksum_version(true);
 	current.stream = stream_wal;
+	current.compress_alg = compress_alg;
+	current.compress_level = compress_level;
+	current.read_mode = read_mode;
 
 	/* create backup directory and backup.ini */
 	if (!check)
@@ -520,13 +594,17 @@ do_backup(pgBackupOption bkupopt)
 	/* set the error processing function for the backup process */
 	pgut_atexit_push(backup_cleanup, NULL);
 
-	/* backup data */
+	/* backup data, the file lists live until the end of backup */
+	throttle_start();
+	outer_arena = file_arena_begin();
 	files_database = do_backup_database(backup_list, bkupopt);
 	pgut_atexit_pop(backup_cleanup, NULL);
 
 	/* update backup status to DONE */
 	current.end_time = time(NULL);
 	current.status = BACKUP_STATUS_DONE;
+	current.read_mode = effective_read_mode();
+	throttle_report(&current);
 	if (!check)
 		pgBackupWriteIni(&current);
 
@@ -538,7 +616,8 @@ do_backup(pgBackupOption bkupopt)
 		/* Database data */
 		if (current.backup_mode == BACKUP_MODE_FULL ||
 			current.backup_mode == BACKUP_MODE_DIFF_PAGE ||
-			current.backup_mode == BACKUP_MODE_DIFF_PTRACK)
+			current.backup_mode == BACKUP_MODE_DIFF_PTRACK ||
+			current.backup_mode == BACKUP_MODE_DIFF_DELTA)
 			total_read += current.data_bytes;
 
 		if (total_read == 0)
@@ -558,6 +637,7 @@ do_backup(pgBackupOption bkupopt)
 	if (files_database)
 		parray_walk(files_database, pgFileFree);
 	parray_free(files_database);
+	file_arena_end(outer_arena);
 
 	/* release catalog lock */
 	catalog_unlock();
@@ -740,36 +820,165 @@ pg_ptrack_clear(void)
 	pgut_dbname = old_dbname;
 }
 
-static char *
-pg_ptrack_get_and_clear(Oid tablespace_oid, Oid db_oid, Oid rel_oid, size_t *result_size)
+/*
+ * A segment file whose pages are tracked by ptrack, with the identity of its
+ * relation as given to pg_ptrack_get_and_clear().
+ */
+typedef struct
+{
+	pgFile	   *file;
+	Oid			tablespace_oid;		/* 0 for the default tablespace */
+	Oid			db_oid;
+	Oid			rel_oid;
+} ptrack_segment;
+
+static int
+ptrack_segment_compare(const void *s1, const void *s2)
+{
+	const ptrack_segment *s1p = (const ptrack_segment *) s1;
+	const ptrack_segment *s2p = (const ptrack_segment *) s2;
+
+	if (s1p->db_oid != s2p->db_oid)
+		return s1p->db_oid < s2p->db_oid ? -1 : 1;
+	if (s1p->tablespace_oid != s2p->tablespace_oid)
+		return s1p->tablespace_oid < s2p->tablespace_oid ? -1 : 1;
+	if (s1p->rel_oid != s2p->rel_oid)
+		return s1p->rel_oid < s2p->rel_oid ? -1 : 1;
+	return s1p->file->segno - s2p->file->segno;
+}
+
+/* Get the relation identity of a segment from the path of its ptrack file. */
+static void
+ptrack_segment_identity(ptrack_segment *seg)
 {
-	PGresult	*res_db, *res;
-	const char	*old_dbname = pgut_dbname;
-	char		*params[2];
-	char		*result;
+	char	   *tmp_path = seg->file->ptrack_path;
+	char	   *tablespace;
+	size_t		path_length = strlen(tmp_path);
+	int			sep_iter, sep_count = 0;
 
-	reconnect();
-	params[0] = palloc(64);
-	params[1] = palloc(64);
-	sprintf(params[0], "%i", db_oid);
-	sprintf(params[1], "%i", rel_oid);
-	res_db = execute("SELECT datname FROM pg_database WHERE oid=$1", 1, (const char **)params);
-	disconnect();
-	pgut_dbname = pstrdup(PQgetvalue(res_db, 0, 0));
-	PQclear(res_db);
+	/* Find target path*/
+	for (sep_iter = (int) path_length; sep_iter >= 0; sep_iter--)
+	{
+		if (IS_DIR_SEP(tmp_path[sep_iter]))
+		{
+			sep_count++;
+		}
+		if (sep_count == 2)
+		{
+			tmp_path += sep_iter + 1;
+			break;
+		}
+	}
+	/* For unix only now */
+	seg->tablespace_oid = 0;
+	sscanf(tmp_path, "%u/%u_ptrack", &seg->db_oid, &seg->rel_oid);
+	tablespace = strstr(seg->file->ptrack_path, "pg_tblspc");
+	if (tablespace != NULL)
+		sscanf(tablespace + 10, "%u/", &seg->tablespace_oid);
+}
 
-	reconnect();
-	sprintf(params[0], "%i", tablespace_oid);
-	res = execute("SELECT pg_ptrack_get_and_clear($1, $2)", 2,  (const char **)params);
-	result = (char *)PQunescapeBytea((unsigned char *)PQgetvalue(res, 0, 0), result_size);
-	PQclear(res);
-	pfree(params[0]);
-	pfree(params[1]);
+/*
+ * Give file the part of the ptrack map of its relation which covers its
+ * segment.  A segment beyond the map has no changed pages and gets an empty
+ * page map.
+ */
+static void
+ptrack_set_pagemap(pgFile *file, const char *map, size_t map_size)
+{
+	size_t		start_addr = (RELSEG_SIZE / 8) * file->segno;
 
-	pfree((char *)pgut_dbname);
-	pgut_dbname = old_dbname;
+	if (start_addr >= map_size)
+	{
+		file->pagemap.bitmap = NULL;
+		file->pagemap.bitmapsize = 0;
+		return;
+	}
 
-	return result;
+	file->pagemap.bitmapsize = Min(map_size - start_addr, RELSEG_SIZE / 8);
+	file->pagemap.bitmap = pg_malloc(file->pagemap.bitmapsize);
+	memcpy(file->pagemap.bitmap, map + start_addr, file->pagemap.bitmapsize);
+}
+
+/*
+ * Fetch and clear the ptrack maps of the relations of segs, which belong to
+ * the database of the current connection and are sorted by relation.  The
+ * maps of up to PTRACK_BATCH_SIZE relations are fetched by one query, and
+ * the map of a relation is shared by all its segments.  Returns the number
+ * of queries run.
+ */
+static int
+pg_ptrack_get_and_clear(ptrack_segment *segs, int nsegs)
+{
+	int		   *rel_start;
+	char	   *params[2];
+	size_t		params_size = PTRACK_BATCH_SIZE * 12 + 3;
+	int			nqueries = 0;
+	int			i = 0;
+
+	rel_start = pg_malloc(sizeof(int) * (PTRACK_BATCH_SIZE + 1));
+	params[0] = pg_malloc(params_size);
+	params[1] = pg_malloc(params_size);
+
+	while (i < nsegs)
+	{
+		PGresult   *res;
+		char	   *spc_pos = params[0];
+		char	   *rel_pos = params[1];
+		int			nrels = 0;
+		int			r;
+
+		/* collect the next batch of relations as two oid arrays */
+		while (i < nsegs && nrels < PTRACK_BATCH_SIZE)
+		{
+			rel_start[nrels] = i;
+			spc_pos += sprintf(spc_pos, "%c%u", nrels ? ',' : '{',
+							   segs[i].tablespace_oid);
+			rel_pos += sprintf(rel_pos, "%c%u", nrels ? ',' : '{',
+							   segs[i].rel_oid);
+			nrels++;
+
+			/* skip the other segments of the relation */
+			for (i++; i < nsegs &&
+				 segs[i].rel_oid == segs[i - 1].rel_oid &&
+				 segs[i].tablespace_oid == segs[i - 1].tablespace_oid; i++)
+				;
+		}
+		rel_start[nrels] = i;
+		strcpy(spc_pos, "}");
+		strcpy(rel_pos, "}");
+
+		res = execute("SELECT pg_ptrack_get_and_clear(r.spc, r.rel) "
+					  "FROM unnest($1::oid[], $2::oid[]) WITH ORDINALITY AS r(spc, rel, n) "
+					  "ORDER BY r.n",
+					  2, (const char **) params);
+		nqueries++;
+		if (PQntuples(res) != nrels)
+			elog(ERROR, "ptrack maps of %d relations were returned, %d expected",
+				 PQntuples(res), nrels);
+
+		for (r = 0; r < nrels; r++)
+		{
+			unsigned char *map;
+			size_t		map_size;
+			int			s;
+
+			map = PQunescapeBytea((unsigned char *) PQgetvalue(res, r, 0),
+								  &map_size);
+			if (map == NULL)
+				elog(ERROR, "cannot unescape ptrack map");
+
+			for (s = rel_start[r]; s < rel_start[r + 1]; s++)
+				ptrack_set_pagemap(segs[s].file, (char *) map, map_size);
+			PQfreemem(map);
+		}
+		PQclear(res);
+	}
+
+	pg_free(params[0]);
+	pg_free(params[1]);
+	pg_free(rel_start);
+
+	return nqueries;
 }
 
 static void
@@ -976,6 +1185,42 @@ pg_is_standby(void)
 	return fileExists(path);
 }
 
+/*
+ * Tell whether lsn is at or below the WAL insert position of the server, or
+ * the replay position of a replica, that is whether a page bearing it may
+ * have been written by the server.  The position is asked for over the
+ * connection of pg_start_backup() only when lsn is past the one last read.
+ */
+bool
+lsn_is_inserted(XLogRecPtr lsn)
+{
+	bool		result;
+
+	pthread_mutex_lock(&insert_lsn_mutex);
+	if (lsn > insert_lsn && start_stop_connect != NULL)
+	{
+		PGresult   *res;
+		uint32		xlogid;
+		uint32		xrecoff;
+
+		res = pgut_execute(start_stop_connect,
+						   from_replica ?
+						   "SELECT pg_last_xlog_replay_location()" :
+						   "SELECT pg_current_xlog_insert_location()",
+						   0, NULL, ERROR);
+		if (PQntuples(res) != 1 || PQgetisnull(res, 0, 0))
+			elog(ERROR, "cannot get current WAL position: %s",
+				 PQerrorMessage(start_stop_connect));
+		XLogDataFromLSN(PQgetvalue(res, 0, 0), &xlogid, &xrecoff);
+		insert_lsn = (XLogRecPtr) ((uint64) xlogid << 32) | xrecoff;
+		PQclear(res);
+	}
+	result = (lsn <= insert_lsn);
+	pthread_mutex_unlock(&insert_lsn_mutex);
+
+	return result;
+}
+
 /*
  * Get LSN from result of pg_start_backup() or pg_stop_backup().
  */
@@ -1020,8 +1265,7 @@ get_lsn(PGconn *conn, PGresult *res, XLogRecPtr *lsn, bool stop_backup)
 		fclose(fp);
 		file = pgFileNew(path_backup_label, true);
 		calc_file(file);
-		free(file->path);
-		file->path = strdup("backup_label");
+		pgFileSetPath(file, "backup_label");
 		parray_append(backup_files_list, file);
 		if (strlen(PQgetvalue(res, 0, 2)) == 0)
 			return;
@@ -1035,8 +1279,7 @@ get_lsn(PGconn *conn, PGresult *res, XLogRecPtr *lsn, bool stop_backup)
 		fclose(fp);
 		file = pgFileNew(path_tablespace_map, true);
 		calc_file(file);
-		free(file->path);
-		file->path = strdup("tablespace_map");
+		pgFileSetPath(file, "tablespace_map");
 		parray_append(backup_files_list, file);
 	}
 }
@@ -1113,124 +1356,428 @@ backup_cleanup(bool fatal, void *userdata)
 }
 
 /*
- * Take differential backup at page level.
+ * Build the task list of backup_files() from the file list.  Directories
+ * were created beforehand and get no task.  A data file that is scanned
+ * entirely and is larger than two parts is split into block ranges when
+ * several threads are used, the state shared by its parts is added to
+ * splits.  Tasks are sorted largest first.
  */
-static void
-backup_files(void *arg)
+static parray *
+make_backup_tasks(parray *files, parray *splits)
 {
-	int				i;
-	struct timeval	tv;
-
-	backup_files_args *arguments = (backup_files_args *) arg;
-
-	gettimeofday(&tv, NULL);
+	parray	   *tasks = parray_new();
+	size_t		part_size = (size_t) BACKUP_PART_BLOCKS * BLCKSZ;
+	int			i;
 
-	/* backup a file or create a directory */
-	for (i = 0; i < parray_num(arguments->files); i++)
+	for (i = 0; i < parray_num(files); i++)
 	{
-		int			ret;
-		struct stat	buf;
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		backup_split *split = NULL;
+		int			nparts = 1;
+		int			part;
 
-		pgFile *file = (pgFile *) parray_get(arguments->files, i);
-		if (__sync_lock_test_and_set(&file->lock, 1) != 0)
+		if (S_ISDIR(file->mode))
 			continue;
 
-		/* If current time is rewinded, abort this backup. */
-		if (tv.tv_sec < file->mtime)
-			elog(ERROR,
-				 "current time may be rewound. Please retry with full backup mode.");
-
-		/* check for interrupt */
-		if (interrupted)
-			elog(ERROR, "interrupted during backup");
-
-		/* print progress in verbose mode */
-		if (verbose)
-			elog(LOG, "(%d/%lu) %s", i + 1, (unsigned long) parray_num(arguments->files),
-				file->path + strlen(arguments->from_root) + 1);
+		if (file->is_datafile && !check && num_threads > 1 &&
+			file->pagemap.bitmapsize == 0 && file->size > 2 * part_size)
+		{
+			nparts = (file->size + part_size - 1) / part_size;
+			split = pg_malloc0(sizeof(backup_split));
+			split->nparts = nparts;
+			split->remaining = nparts;
+			split->write_sizes = pg_malloc0(sizeof(size_t) * nparts);
+			split->crcs = pg_malloc0(sizeof(pg_crc32) * nparts);
+			split->chunks = pg_malloc0(sizeof(pgChunkHash *) * nparts);
+			split->nchunks = pg_malloc0(sizeof(int) * nparts);
+			parray_append(splits, split);
+		}
 
-		/* stat file to get file type, size and modify timestamp */
-		ret = stat(file->path, &buf);
-		if (ret == -1)
+		for (part = 0; part < nparts; part++)
 		{
-			if (errno == ENOENT)
+			backup_task *task = pg_malloc0(sizeof(backup_task));
+
+			task->file = file;
+			task->split = split;
+			task->part = part;
+			if (split == NULL)
 			{
-				/* record as skipped file in file_xxx.txt */
-				file->write_size = BYTES_INVALID;
-				elog(LOG, "skip");
-				continue;
+				task->size = file->size;
+				task->start_blk = 0;
+				task->end_blk = InvalidBlockNumber;
 			}
 			else
 			{
-				elog(ERROR,
-					"can't stat backup mode. \"%s\": %s",
-					file->path, strerror(errno));
+				task->start_blk = part * BACKUP_PART_BLOCKS;
+				/* the last part takes whatever was appended meanwhile */
+				if (part == nparts - 1)
+				{
+					task->end_blk = InvalidBlockNumber;
+					task->size = file->size - (size_t) task->start_blk * BLCKSZ;
+				}
+				else
+				{
+					task->end_blk = task->start_blk + BACKUP_PART_BLOCKS;
+					task->size = part_size;
+				}
 			}
+			parray_append(tasks, task);
 		}
+	}
 
-		/* skip dir because make before */
-		if (S_ISDIR(buf.st_mode))
-		{
-			continue;
-		}
-		else if (S_ISREG(buf.st_mode))
+	parray_qsort(tasks, backup_task_compare_size_desc);
+
+	return tasks;
+}
+
+static int
+backup_task_compare_size_desc(const void *t1, const void *t2)
+{
+	backup_task *t1p = *(backup_task **) t1;
+	backup_task *t2p = *(backup_task **) t2;
+
+	if (t1p->size > t2p->size)
+		return -1;
+	else if (t1p->size < t2p->size)
+		return 1;
+	else
+		return 0;
+}
+
+/*
+ * Nanoseconds to wait until the clock is far enough past the mtime of file.
+ * Timer resolution of ext3 file system is one second, a file system without
+ * nanoseconds has to wait for the next second.
+ */
+static int64
+file_mtime_wait(pgFile *file)
+{
+	struct timespec now;
+	int64		age;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	if (file->mtime_nsec == 0)
+	{
+		if (now.tv_sec > file->mtime)
+			return 0;
+		return (int64) (file->mtime + 1 - now.tv_sec) * 1000000000 -
+			now.tv_nsec;
+	}
+
+	age = (int64) (now.tv_sec - file->mtime) * 1000000000 +
+		(now.tv_nsec - file->mtime_nsec);
+	return age >= MTIME_MARGIN_NSEC ? 0 : MTIME_MARGIN_NSEC - age;
+}
+
+/*
+ * Take differential backup at page level.  Called by run_tasks() for each
+ * backup_task.
+ */
+static void
+backup_files(void *task_ptr, int index, void *arg)
+{
+	backup_task	   *task = (backup_task *) task_ptr;
+	backup_files_args *arguments = (backup_files_args *) arg;
+	pgFile		   *file = task->file;
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+
+	/* If current time is rewinded, abort this backup. */
+	if (tv.tv_sec < file->mtime)
+		elog(ERROR,
+			 "current time may be rewound. Please retry with full backup mode.");
+
+	/* check for interrupt */
+	if (interrupted)
+		elog(ERROR, "interrupted during backup");
+
+	/* print progress in verbose mode */
+	if (verbose)
+	{
+		if (task->split)
+			elog(LOG, "(%d/%d) %s part %d", index + 1, arguments->ntasks,
+				 file->path + strlen(arguments->from_root) + 1, task->part);
+		else
+			elog(LOG, "(%d/%d) %s", index + 1, arguments->ntasks,
+				 file->path + strlen(arguments->from_root) + 1);
+	}
+
+	/*
+	 * The type, size and modify timestamp of the file were taken when it was
+	 * listed.  A file removed since then is skipped by the copy.
+	 */
+
+	/* skip dir because make before */
+	if (S_ISDIR(file->mode))
+		return;
+	else if (S_ISREG(file->mode))
+	{
+		const XLogRecPtr *lsn = arguments->lsn;
+		bool		copied;
+
+		/* skip files which have not been modified since last backup */
+		if (arguments->prev_files)
 		{
-			/* skip files which have not been modified since last backup */
-			if (arguments->prev_files)
-			{
-				pgFile *prev_file = NULL;
-				pgFile **p = (pgFile **) parray_bsearch(arguments->prev_files, file, pgFileComparePath);
-				if (p)
-					prev_file = *p;
+			pgFile *prev_file = (pgFile *) parray_index_find(arguments->prev_files, file);
 
-				if (prev_file && prev_file->mtime == file->mtime)
-				{
-					/* record as skipped file in file_xxx.txt */
-					file->write_size = BYTES_INVALID;
-					elog(LOG, "skip");
-					continue;
-				}
+			if (prev_file && prev_file->mtime == file->mtime &&
+				prev_file->mtime_nsec == file->mtime_nsec)
+			{
+				backup_task_done(task, arguments, false);
+				return;
 			}
 
 			/*
-			 * We will wait until the next second of mtime so that backup
-			 * file should contain all modifications at the clock of mtime.
-			 * timer resolution of ext3 file system is one second.
+			 * A file absent from the previous backup may hold pages with
+			 * old LSNs (e.g. copied by CREATE DATABASE), take it whole.
 			 */
-
-			if (tv.tv_sec == file->mtime)
+			if (prev_file == NULL)
+				lsn = NULL;
+			else if (datafile_is_unchanged(file, prev_file))
+			{
+				backup_task_done(task, arguments, false);
+				return;
+			}
+			else if (file->is_datafile && prev_file->size != BYTES_INVALID &&
+					 file->size < prev_file->size)
 			{
-				/* update time and recheck */
-				gettimeofday(&tv, NULL);
-				while (tv.tv_sec <= file->mtime)
+				/* a truncated data file is taken whole, as a new one is */
+				lsn = NULL;
+				if (file->pagemap.bitmapsize != 0)
 				{
-					usleep(1000000 - tv.tv_usec);
-					gettimeofday(&tv, NULL);
+					pg_free(file->pagemap.bitmap);
+					file->pagemap.bitmap = NULL;
+					file->pagemap.bitmapsize = 0;
 				}
 			}
+		}
 
-			/* copy the file into backup */
-			if (!(file->is_datafile
-					? backup_data_file(arguments->from_root, arguments->to_root, file, arguments->lsn)
-					: copy_file(arguments->from_root, arguments->to_root, file)))
+		/*
+		 * Backup file should contain all modifications at the clock of
+		 * mtime, so a file modified too recently is copied only once the
+		 * clock has moved on.  In the first pass it is put aside until the
+		 * other files are copied, the last pass waits for the clock.
+		 */
+		if (file_mtime_wait(file) > 0)
+		{
+			int64		wait;
+
+			if (arguments->deferred)
 			{
-				/* record as skipped file in file_xxx.txt */
-				file->write_size = BYTES_INVALID;
-				elog(LOG, "skip");
-				continue;
+				pthread_mutex_lock(&deferred_mutex);
+				parray_append(arguments->deferred, task);
+				pthread_mutex_unlock(&deferred_mutex);
+				return;
 			}
 
-			elog(LOG, "copied %lu", (unsigned long) file->write_size);
+			while ((wait = file_mtime_wait(file)) > 0)
+				pg_usleep((long) (wait / 1000) + 1);
+		}
+
+		/*
+		 * A data file scanned without an LSN to compare pages with holds
+		 * all of them, restore must not merge it with older backups.
+		 */
+		file->is_whole = file->is_datafile && lsn == NULL &&
+			file->pagemap.bitmapsize == 0;
+
+		/* copy the file or its part into backup */
+		if (task->split)
+		{
+			size_t		read_size;
+			size_t		write_size;
+
+			copied = backup_data_file_part(arguments->from_root,
+										   arguments->to_root, file, lsn,
+										   task->start_blk, task->end_blk,
+										   task->part, &read_size,
+										   &write_size,
+										   &task->split->crcs[task->part],
+										   &task->split->chunks[task->part],
+										   &task->split->nchunks[task->part]);
+			if (copied)
+			{
+				task->split->write_sizes[task->part] = write_size;
+				__sync_fetch_and_add(&task->split->read_size, read_size);
+				__sync_fetch_and_add(&task->split->write_size, write_size);
+			}
 		}
 		else
-			elog(LOG, "unexpected file type %d", buf.st_mode);
+			copied = file->is_datafile
+				? backup_data_file(arguments->from_root, arguments->to_root, file, lsn)
+				: copy_file(arguments->from_root, arguments->to_root, file);
+
+		backup_task_done(task, arguments, copied);
+	}
+	else
+	{
+		elog(LOG, "unexpected file type %d", file->mode);
 		if (progress)
 			fprintf(stderr, "\rProgress %i/%u", total_copy_files_increment, total_files_num-1);
-		 __sync_fetch_and_add(&total_copy_files_increment, 1);
+		__sync_fetch_and_add(&total_copy_files_increment, 1);
+	}
+}
+
+/*
+ * In PAGE and PTRACK modes the page map of the main fork of a relation holds
+ * every page changed since the previous backup.  A file that has none is
+ * unchanged, unless it was truncated since then, which is told by its size
+ * in the previous backup.  A file whose previous size isn't known, as in
+ * backups of older versions, is scanned as before.
+ */
+static bool
+datafile_is_unchanged(pgFile *file, pgFile *prev_file)
+{
+	if (!file->is_datafile || file->pagemap.bitmapsize != 0)
+		return false;
+
+	/*
+	 * The WAL scan and ptrack map the main fork only.  The other forks have
+	 * no map, and the visibility map is cleared without a new page LSN, so
+	 * they are scanned in full.
+	 */
+	if (file->forkNum != MAIN_FORKNUM)
+		return false;
+
+	/* the WAL scan maps only the files whose relation is known */
+	if (current.backup_mode == BACKUP_MODE_DIFF_PAGE &&
+		!OidIsValid(file->relOid))
+		return false;
+
+	/* ptrack tracks only the relations which have a ptrack file */
+	if (current.backup_mode == BACKUP_MODE_DIFF_PTRACK &&
+		file->ptrack_path == NULL)
+		return false;
+
+	if (current.backup_mode != BACKUP_MODE_DIFF_PAGE &&
+		current.backup_mode != BACKUP_MODE_DIFF_PTRACK)
+		return false;
+
+	return prev_file->size != BYTES_INVALID && file->size >= prev_file->size;
+}
+
+/*
+ * Record the result of a backup task.  The parts of a split file are
+ * recorded as its backup copy by whichever thread finishes the last of them;
+ * if any part was not copied the whole file is recorded as skipped.
+ */
+static void
+backup_task_done(backup_task *task, backup_files_args *arguments, bool copied)
+{
+	pgFile		   *file = task->file;
+	backup_split   *split = task->split;
+
+	if (split != NULL)
+	{
+		if (!copied)
+			split->skipped = true;
+		if (__sync_sub_and_fetch(&split->remaining, 1) > 0)
+			return;
+
+		file->read_size = split->read_size;
+		file->write_size = split->write_size;
+		copied = backup_data_file_join(arguments->from_root,
+									   arguments->to_root, file,
+									   split->nparts, split->write_sizes,
+									   split->crcs, split->chunks,
+									   split->nchunks, split->skipped);
+		pg_free(split->write_sizes);
+		pg_free(split->crcs);
+		pg_free(split->chunks);
+		pg_free(split->nchunks);
+	}
+
+	if (!copied)
+	{
+		/* record as skipped file in file_xxx.txt */
+		file->write_size = BYTES_INVALID;
+		elog(LOG, "skip");
+		return;
 	}
+
+	elog(LOG, "copied %lu", (unsigned long) file->write_size);
+	if (progress)
+		fprintf(stderr, "\rProgress %i/%u", total_copy_files_increment, total_files_num-1);
+	__sync_fetch_and_add(&total_copy_files_increment, 1);
 }
 
 
+/*
+ * Extract relation identity of a data file from its path relative to PGDATA:
+ * base/<db>/<rel>, global/<rel> or pg_tblspc/<spc>/<version>/<db>/<rel>,
+ * each optionally followed by _<fork> and .<segno>.  The identity is left
+ * invalid if the path doesn't look like a relation file.
+ */
+static void
+parse_datafile_identity(pgFile *file, const char *relative)
+{
+	const char *p;
+	char	   *end;
+	Oid			tblspcOid;
+	Oid			dbOid = InvalidOid;
+	Oid			relOid;
+	ForkNumber	forkNum = MAIN_FORKNUM;
+
+	if (path_is_prefix_of_path("base", relative))
+	{
+		tblspcOid = DEFAULTTABLESPACE_OID;
+		p = relative + strlen("base") + 1;
+	}
+	else if (path_is_prefix_of_path("global", relative))
+	{
+		tblspcOid = GLOBALTABLESPACE_OID;
+		p = relative + strlen("global") + 1;
+	}
+	else if (path_is_prefix_of_path(PG_TBLSPC_DIR, relative))
+	{
+		p = relative + strlen(PG_TBLSPC_DIR) + 1;
+		tblspcOid = (Oid) strtoul(p, &end, 10);
+		if (end == p || *end != '/')
+			return;
+		p = end + 1;
+
+		/* only the directory of this server version holds its relations */
+		if (strncmp(p, TABLESPACE_VERSION_DIRECTORY,
+					strlen(TABLESPACE_VERSION_DIRECTORY)) != 0 ||
+			p[strlen(TABLESPACE_VERSION_DIRECTORY)] != '/')
+			return;
+		p += strlen(TABLESPACE_VERSION_DIRECTORY) + 1;
+	}
+	else
+		return;
+
+	if (tblspcOid != GLOBALTABLESPACE_OID)
+	{
+		dbOid = (Oid) strtoul(p, &end, 10);
+		if (end == p || *end != '/')
+			return;
+		p = end + 1;
+	}
+
+	relOid = (Oid) strtoul(p, &end, 10);
+	if (end == p)
+		return;
+	p = end;
+
+	if (*p == '_')
+	{
+		int			len = forkname_chars(p + 1, &forkNum);
+
+		if (len == 0)
+			return;
+		p += len + 1;
+	}
+	if (*p != '\0' && *p != '.')
+		return;
+
+	file->tblspcOid = tblspcOid;
+	file->dbOid = dbOid;
+	file->relOid = relOid;
+	file->forkNum = forkNum;
+}
+
 /*
  * Append files to the backup list array.
  */
@@ -1238,12 +1785,14 @@ static void
 add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 {
 	parray	*list_file;
+	parray_index *list_index;
 	int		 i;
 
 	list_file = parray_new();
 
 	/* list files with the logical path. omit $PGDATA */
 	dir_list_file(list_file, root, pgdata_exclude, true, add_root);
+	list_index = parray_index_new(list_file, pgFileHashPath, pgFileComparePath);
 
 	/* mark files that are possible datafile as 'datafile' */
 	for (i = 0; i < (int) parray_num(list_file); i++)
@@ -1271,6 +1820,7 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 		/* Remove temp tables */
 		if (fname[0] == 't' && isdigit(fname[1]))
 		{
+			parray_index_remove(list_index, file);
 			pgFileFree(file);
 			parray_remove(list_file, i);
 			i--;
@@ -1282,7 +1832,6 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 		if (path_len > 6 && strncmp(file->path+(path_len-6), "ptrack", 6) == 0)
 		{
 			pgFile *search_file;
-			pgFile **pre_search_file;
 			int segno = 0;
 			while(true) {
 				pgFile tmp_file;
@@ -1292,10 +1841,9 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 					sprintf(tmp_file.path+path_len-7, ".%d", segno);
 				else
 					tmp_file.path[path_len-7] = '\0';
-				pre_search_file = (pgFile **) parray_bsearch(list_file, &tmp_file, pgFileComparePath);
-				if (pre_search_file != NULL)
+				search_file = (pgFile *) parray_index_find(list_index, &tmp_file);
+				if (search_file != NULL)
 				{
-					search_file = *pre_search_file;
 					search_file->ptrack_path = pg_strdup(file->path);
 					search_file->segno = segno;
 				} else {
@@ -1306,6 +1854,7 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 				segno++;
 			}
 
+			parray_index_remove(list_index, file);
 			pgFileFree(file);
 			parray_remove(list_file, i);
 			i--;
@@ -1316,7 +1865,8 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 		if (path_len > 4 && strncmp(file->path+(path_len-4), ".cfm", 4) == 0)
 		{
 			if (current.backup_mode == BACKUP_MODE_DIFF_PTRACK ||
-				current.backup_mode == BACKUP_MODE_DIFF_PAGE)
+				current.backup_mode == BACKUP_MODE_DIFF_PAGE ||
+				current.backup_mode == BACKUP_MODE_DIFF_DELTA)
 				elog(ERROR, "You can't use incremental backup with compress tablespace");
 			continue;
 		}
@@ -1330,6 +1880,7 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 			continue;
 
 		file->is_datafile = true;
+		parse_datafile_identity(file, relative);
 		{
 			int find_dot;
 			int check_digit;
@@ -1361,18 +1912,19 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 
 		if (path_len > 4 && strncmp(file->path+(path_len-4), ".cfm", 4) == 0)
 		{
-			pgFile **pre_search_file;
+			pgFile *search_file;
 			pgFile tmp_file;
 			tmp_file.path = pg_strdup(file->path);
 			tmp_file.path[path_len-4] = '\0';
-			pre_search_file = (pgFile **) parray_bsearch(list_file, &tmp_file, pgFileComparePath);
-			if (pre_search_file != NULL)
+			search_file = (pgFile *) parray_index_find(list_index, &tmp_file);
+			if (search_file != NULL)
 			{
-				(*pre_search_file)->is_datafile = false;
+				search_file->is_datafile = false;
 			}
 			pg_free(tmp_file.path);
 		}
 	}
+	parray_index_free(list_index);
 	parray_concat(files, list_file);
 }
 
@@ -1403,60 +1955,102 @@ create_file_list(parray *files,
 }
 
 /*
- * A helper function to create the path of a relation file and segment.
- *
- * The returned path is palloc'd
+ * Open addressing hash of the data files in backup_files_list keyed by
+ * relation identity and segment number.  It lets process_block_change()
+ * find the file of a block reference without building its path.  Unlike a
+ * parray_index, slots hold the index of the file in the list plus one, zero
+ * is an empty slot, as the page maps of the WAL scan are parallel arrays.
  */
-static char *
-datasegpath(RelFileNode rnode, ForkNumber forknum, BlockNumber segno)
+static int	   *datafile_hash = NULL;
+static uint32	datafile_hash_mask = 0;
+
+/*
+ * Build the data file hash from files, which must be neither modified nor
+ * reordered until free_datafile_hash() is called.
+ */
+static void
+build_datafile_hash(parray *files)
 {
-	char	   *path;
-	char	   *segpath;
+	size_t		size = 16;
+	int			i;
+
+	while (size < parray_num(files) * 2)
+		size <<= 1;
+
+	datafile_hash = (int *) pg_malloc0(size * sizeof(int));
+	datafile_hash_mask = size - 1;
 
-	path = relpathperm(rnode, forknum);
-	if (segno > 0)
+	for (i = 0; i < parray_num(files); i++)
 	{
-		segpath = psprintf("%s.%u", path, segno);
-		pfree(path);
-		return segpath;
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		uint32		slot;
+
+		if (!file->is_datafile || !OidIsValid(file->relOid))
+			continue;
+
+		slot = pgFileHashRelation(file) & datafile_hash_mask;
+		while (datafile_hash[slot] != 0)
+			slot = (slot + 1) & datafile_hash_mask;
+		datafile_hash[slot] = i + 1;
 	}
-	else
-		return path;
+}
+
+static void
+free_datafile_hash(void)
+{
+	pg_free(datafile_hash);
+	datafile_hash = NULL;
+	datafile_hash_mask = 0;
+}
+
+/*
+ * Returns index of the data file in backup_files_list, or -1 if not found.
+ */
+static int
+datafile_hash_lookup(RelFileNode rnode, ForkNumber forkNum, int segno)
+{
+	pgFile		key;
+	pgFile	   *keyp = &key;
+	uint32		slot;
+
+	key.tblspcOid = rnode.spcNode;
+	key.dbOid = rnode.dbNode;
+	key.relOid = rnode.relNode;
+	key.forkNum = forkNum;
+	key.segno = segno;
+
+	slot = pgFileHashRelation(&key) & datafile_hash_mask;
+	while (datafile_hash[slot] != 0)
+	{
+		int			index = datafile_hash[slot] - 1;
+		pgFile	   *file = (pgFile *) parray_get(backup_files_list, index);
+
+		if (pgFileCompareRelation(&keyp, &file) == 0)
+			return index;
+		slot = (slot + 1) & datafile_hash_mask;
+	}
+
+	return -1;
 }
 
 /*
  * This routine gets called while reading WAL segments from the WAL archive,
  * for every block that have changed in the target system. It makes note of
- * all the changed blocks in the pagemap of the file and adds them in the
- * things to track for the backup.
+ * all the changed blocks in pagemaps, which has an entry for each file of
+ * backup_files_list, to track them for the backup.
  */
 void
-process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno)
+process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno,
+					 datapagemap_t *pagemaps)
 {
-	char		*path;
-	char		*rel_path;
 	BlockNumber blkno_inseg;
 	int			segno;
-	pgFile		*file_item = NULL;
-	int			j;
+	int			file_item;
 
 	segno = blkno / RELSEG_SIZE;
 	blkno_inseg = blkno % RELSEG_SIZE;
 
-	rel_path = datasegpath(rnode, forknum, segno);
-	path = pg_malloc(strlen(rel_path) + strlen(pgdata) + 2);
-	sprintf(path, "%s/%s", pgdata, rel_path);
-
-	for (j = 0; j < parray_num(backup_files_list); j++)
-	{
-		pgFile *p = (pgFile *) parray_get(backup_files_list, j);
-
-		if (strcmp(p->path, path) == 0)
-		{
-			file_item = p;
-			break;
-		}
-	}
+	file_item = datafile_hash_lookup(rnode, forknum, segno);
 
 	/*
 	 * If we don't have any record of this file in the file map, it means
@@ -1464,64 +2058,87 @@ process_block_change(ForkNumber forknum, RelFileNode rnode, BlockNumber blkno)
 	 * backup. We can safely ignore it. If it is a new relation file, the
 	 * backup would simply copy it as-is.
 	 */
-	if (file_item)
-		datapagemap_add(&file_item->pagemap, blkno_inseg);
-
-	pg_free(path);
-	pg_free(rel_path);
+	if (file_item >= 0)
+		datapagemap_add(&pagemaps[file_item], blkno_inseg);
 }
 
-void make_pagemap_from_ptrack(parray *files)
+/*
+ * Build the page maps of the segment files tracked by ptrack.  The map of
+ * each relation is fetched once, and the relations of a database are
+ * queried in batches over one connection to it.
+ */
+static void
+make_pagemap_from_ptrack(parray *files)
 {
-	int i;
+	ptrack_segment *segs;
+	int			nsegs = 0;
+	int			nrels = 0;
+	int			nqueries = 0;
+	PGresult   *res_db;
+	const char *old_dbname = pgut_dbname;
+	int			i;
+
+	segs = pg_malloc(sizeof(ptrack_segment) * Max(parray_num(files), 1));
 	for (i = 0; i < parray_num(files); i++)
 	{
 		pgFile *p = (pgFile *) parray_get(files, i);
-		if (p->ptrack_path != NULL)
+
+		if (p->ptrack_path == NULL)
+			continue;
+		segs[nsegs].file = p;
+		ptrack_segment_identity(&segs[nsegs]);
+		nsegs++;
+	}
+	qsort(segs, nsegs, sizeof(ptrack_segment), ptrack_segment_compare);
+
+	for (i = 0; i < nsegs; i++)
+	{
+		if (i == 0 || segs[i].rel_oid != segs[i - 1].rel_oid ||
+			segs[i].tablespace_oid != segs[i - 1].tablespace_oid ||
+			segs[i].db_oid != segs[i - 1].db_oid)
+			nrels++;
+	}
+
+	reconnect();
+	res_db = execute("SELECT oid, datname FROM pg_database", 0, NULL);
+	disconnect();
+
+	i = 0;
+	while (i < nsegs)
+	{
+		Oid			db_oid = segs[i].db_oid;
+		int			end;
+		int			row;
+
+		for (end = i; end < nsegs && segs[end].db_oid == db_oid; end++)
+			;
+
+		for (row = 0; row < PQntuples(res_db); row++)
 		{
-			char *flat_memory;
-			char *tmp_path = p->ptrack_path;
-			char *tablespace;
-			size_t path_length = strlen(p->ptrack_path);
-			size_t flat_size = 0;
-			size_t start_addr;
-			Oid db_oid, rel_oid, tablespace_oid = 0;
-			int sep_iter, sep_count = 0;
-
-			/* Find target path*/
-			for(sep_iter = (int)path_length; sep_iter >= 0; sep_iter--)
-			{
-				if (IS_DIR_SEP(tmp_path[sep_iter]))
-				{
-					sep_count++;
-				}
-				if (sep_count == 2)
-				{
-					tmp_path += sep_iter + 1;
-					break;
-				}
-			}
-			/* For unix only now */
-			sscanf(tmp_path, "%u/%u_ptrack", &db_oid, &rel_oid);
-			tablespace = strstr(p->ptrack_path, "pg_tblspc");
-			if (tablespace != NULL)
-				sscanf(tablespace+10, "%i/", &tablespace_oid);
-
-			flat_memory = pg_ptrack_get_and_clear(tablespace_oid,
-												  db_oid,
-												  rel_oid,
-												  &flat_size);
-
-			start_addr = (RELSEG_SIZE/8)*p->segno;
-			p->pagemap.bitmapsize = start_addr+RELSEG_SIZE/8 > flat_size ? flat_size - start_addr : RELSEG_SIZE/8;
-			p->pagemap.bitmap = pg_malloc(p->pagemap.bitmapsize);
-			memcpy(p->pagemap.bitmap, flat_memory+start_addr, p->pagemap.bitmapsize);
-			pg_free(flat_memory);
+			if (atooid(PQgetvalue(res_db, row, 0)) == db_oid)
+				break;
 		}
+		if (row == PQntuples(res_db))
+			elog(ERROR, "database with oid %u is not found", db_oid);
+
+		pgut_dbname = PQgetvalue(res_db, row, 1);
+		reconnect();
+		nqueries += pg_ptrack_get_and_clear(segs + i, end - i);
+		disconnect();
+
+		i = end;
 	}
+
+	PQclear(res_db);
+	pgut_dbname = old_dbname;
+	pg_free(segs);
+
+	elog(LOG, "ptrack maps of %d relations, %d segments, fetched in %d queries",
+		 nrels, nsegs, nqueries);
 }
 
 
+
 static bool
 stop_streaming(XLogRecPtr xlogpos, uint32 timeline, bool segment_finished)
 {
@@ -1550,6 +2167,10 @@ stop_streaming(XLogRecPtr xlogpos, uint32 timeline, bool segment_finished)
 	if (stop_backup_lsn != InvalidXLogRecPtr && xlogpos > stop_backup_lsn)
 		return true;
 
+	/* the WAL written since the previous call counts against the limit */
+	if (prevtimeline == timeline && xlogpos > prevpos)
+		throttle_write(xlogpos - prevpos);
+
 	prevtimeline = timeline;
 	prevpos = xlogpos;
 
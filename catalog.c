@@ -214,6 +214,7 @@ catalog_get_last_data_backup(parray *backup_list, TimeLineID tli)
 			backup->tli == tli &&
 			(backup->backup_mode == BACKUP_MODE_DIFF_PAGE ||
 			 backup->backup_mode == BACKUP_MODE_DIFF_PTRACK ||
+			 backup->backup_mode == BACKUP_MODE_DIFF_DELTA ||
 			 backup->backup_mode == BACKUP_MODE_FULL))
 			return backup;
 	}
@@ -248,7 +249,7 @@ pgBackupCreateDir(pgBackup *backup)
 void
 pgBackupWriteConfigSection(FILE *out, pgBackup *backup)
 {
-	static const char *modes[] = { "", "PAGE", "PTRACK", "FULL"};
+	static const char *modes[] = { "", "PAGE", "PTRACK", "DELTA", "FULL"};
 
 	fprintf(out, "# configuration\n");
 	fprintf(out, "BACKUP_MODE=%s\n", modes[backup->backup_mode]);
@@ -292,6 +293,20 @@ pgBackupWriteResultSection(FILE *out, pgBackup *backup)
 	fprintf(out, "XLOG_BLOCK_SIZE=%u\n", backup->wal_block_size);
 	fprintf(out, "CHECKSUM_VERSION=%u\n", backup->checksum_version);
 	fprintf(out, "STREAM=%u\n", backup->stream);
+	if (backup->compress_alg != NOT_DEFINED_COMPRESS)
+	{
+		fprintf(out, "COMPRESS_ALG=%s\n",
+				deparse_compress_alg(backup->compress_alg));
+		fprintf(out, "COMPRESS_LEVEL=%d\n", backup->compress_level);
+	}
+	if (backup->read_mode != READ_MODE_NOT_DEFINED)
+		fprintf(out, "READ_MODE=%s\n", deparse_read_mode(backup->read_mode));
+	if (backup->read_rate > 0 || backup->write_rate > 0)
+	{
+		fprintf(out, "READ_RATE=" UINT64_FORMAT "\n", backup->read_rate);
+		fprintf(out, "WRITE_RATE=" UINT64_FORMAT "\n", backup->write_rate);
+		fprintf(out, "THROTTLED_TIME=%u\n", backup->throttled_time);
+	}
 
 	fprintf(out, "STATUS=%s\n", status2str(backup->status));
 	if (backup->parent_backup != 0)
@@ -338,6 +353,8 @@ catalog_read_ini(const char *path)
 	char	   *stop_lsn = NULL;
 	char	   *status = NULL;
 	char	   *parent_backup = NULL;
+	char	   *compress_alg = NULL;
+	char	   *read_mode = NULL;
 	int			i;
 
 	pgut_option options[] =
@@ -357,6 +374,12 @@ catalog_read_ini(const char *path)
 		{'u', 0, "stream",				NULL, SOURCE_ENV},
 		{'s', 0, "status",				NULL, SOURCE_ENV},
 		{'s', 0, "parent_backup",		NULL, SOURCE_ENV},
+		{'s', 0, "compress-alg",		NULL, SOURCE_ENV},
+		{'i', 0, "compress-level",		NULL, SOURCE_ENV},
+		{'s', 0, "read-mode",			NULL, SOURCE_ENV},
+		{'U', 0, "read-rate",			NULL, SOURCE_ENV},
+		{'U', 0, "write-rate",			NULL, SOURCE_ENV},
+		{'u', 0, "throttled-time",		NULL, SOURCE_ENV},
 		{0}
 	};
 
@@ -382,6 +405,12 @@ catalog_read_ini(const char *path)
 	options[i++].var = &backup->stream;
 	options[i++].var = &status;
 	options[i++].var = &parent_backup;
+	options[i++].var = &compress_alg;
+	options[i++].var = &backup->compress_level;
+	options[i++].var = &read_mode;
+	options[i++].var = &backup->read_rate;
+	options[i++].var = &backup->write_rate;
+	options[i++].var = &backup->throttled_time;
 	Assert(i == lengthof(options) - 1);
 
 	pgut_readopt(path, options, ERROR);
@@ -443,6 +472,18 @@ catalog_read_ini(const char *path)
 		free(parent_backup);
 	}
 
+	if (compress_alg)
+	{
+		backup->compress_alg = parse_compress_alg(compress_alg);
+		free(compress_alg);
+	}
+
+	if (read_mode)
+	{
+		backup->read_mode = parse_read_mode(read_mode);
+		free(read_mode);
+	}
+
 	return backup;
 }
 
@@ -463,12 +504,95 @@ parse_backup_mode(const char *value)
 		return BACKUP_MODE_DIFF_PAGE;
 	else if (len > 0 && pg_strncasecmp("ptrack", v, strlen("ptrack")) == 0)
 		return BACKUP_MODE_DIFF_PTRACK;
+	else if (len > 0 && pg_strncasecmp("delta", v, strlen("delta")) == 0)
+		return BACKUP_MODE_DIFF_DELTA;
 
 	/* Backup mode is invalid, so leave with an error */
 	elog(ERROR, "invalid backup-mode \"%s\"", value);
 	return BACKUP_MODE_INVALID;
 }
 
+CompressAlg
+parse_compress_alg(const char *value)
+{
+	const char *v = value;
+	size_t		len;
+
+	/* Skip all spaces detected */
+	while (IsSpace(*v))
+		v++;
+	len = strlen(v);
+	while (len > 0 && IsSpace(v[len - 1]))
+		len--;
+
+	/* the whole name, not a prefix, so that typos are not taken for one */
+	if (len == strlen("none") && pg_strncasecmp("none", v, len) == 0)
+		return NONE_COMPRESS;
+	else if (len == strlen("pglz") && pg_strncasecmp("pglz", v, len) == 0)
+		return PGLZ_COMPRESS;
+	else if (len == strlen("zlib") && pg_strncasecmp("zlib", v, len) == 0)
+		return ZLIB_COMPRESS;
+
+	/* Compression algorithm is invalid, so leave with an error */
+	elog(ERROR, "invalid compress-algorithm \"%s\"", value);
+	return NOT_DEFINED_COMPRESS;
+}
+
+const char *
+deparse_compress_alg(CompressAlg alg)
+{
+	switch (alg)
+	{
+		case NONE_COMPRESS:
+			return "none";
+		case PGLZ_COMPRESS:
+			return "pglz";
+		case ZLIB_COMPRESS:
+			return "zlib";
+		default:
+			return "";
+	}
+}
+
+ReadMode
+parse_read_mode(const char *value)
+{
+	const char *v = value;
+	size_t		len;
+
+	/* Skip all spaces detected */
+	while (IsSpace(*v))
+		v++;
+	len = strlen(v);
+
+	if (len > 0 && pg_strncasecmp("buffered", v, strlen("buffered")) == 0)
+		return READ_MODE_BUFFERED;
+	else if (len > 0 && pg_strncasecmp("direct", v, strlen("direct")) == 0)
+		return READ_MODE_DIRECT;
+	else if (len > 0 && pg_strncasecmp("dontneed", v, strlen("dontneed")) == 0)
+		return READ_MODE_DONTNEED;
+
+	/* Read mode is invalid, so leave with an error */
+	elog(ERROR, "invalid read-mode \"%s\"", value);
+	return READ_MODE_NOT_DEFINED;
+}
+
+const char *
+deparse_read_mode(ReadMode mode)
+{
+	switch (mode)
+	{
+		case READ_MODE_BUFFERED:
+			return "buffered";
+		case READ_MODE_DIRECT:
+			return "direct";
+		case READ_MODE_DONTNEED:
+			return "dontneed";
+		default:
+			return "";
+	}
+}
+
 /* free pgBackup object */
 void
 pgBackupFree(void *backup)
@@ -530,4 +654,10 @@ catalog_init_config(pgBackup *backup)
 	backup->data_bytes = BYTES_INVALID;
 	backup->stream = false;
 	backup->parent_backup = 0;
+	backup->compress_alg = NOT_DEFINED_COMPRESS;
+	backup->compress_level = DEFAULT_COMPRESS_LEVEL;
+	backup->read_mode = READ_MODE_NOT_DEFINED;
+	backup->read_rate = 0;
+	backup->write_rate = 0;
+	backup->throttled_time = 0;
 }
@@ -11,13 +11,43 @@
 
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "libpq/pqsignal.h"
 #include "storage/block.h"
 #include "storage/bufpage.h"
-#include "storage/checksum_impl.h"
+#include "common/pg_lzcompress.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+/*
+ * Data files are read in runs of up to READ_RUN_BLOCKS contiguous blocks.
+ * With synchronous I/O the kernel is asked to prefetch the next
+ * READ_PREFETCH_RUNS runs, with io_uring READ_RING_RUNS runs are read at
+ * once.  Restore with io_uring writes RESTORE_RING_PAGES pages at once.
+ */
+#define READ_RUN_BLOCKS			32
+#define READ_PREFETCH_RUNS		8
+#define READ_RING_RUNS			8
+#define RESTORE_RING_PAGES		64
+
+/* alignment of read buffers required by O_DIRECT */
+#define READ_BUFFER_ALIGN		4096
+
+/* buffer of copy_file() and calc_file() */
+#define COPY_BUFFER_SIZE		(64 * 1024)
+
+/* run of contiguous blocks to read */
+typedef struct PageRun
+{
+	BlockNumber	blkno;			/* first block of the run */
+	int			nblocks;
+} PageRun;
 
 typedef struct BackupPageHeader
 {
@@ -26,6 +56,79 @@ typedef struct BackupPageHeader
 	uint16		hole_length;	/* number of bytes in "hole" */
 } BackupPageHeader;
 
+/*
+ * In backups taken with page compression every BackupPageHeader is followed
+ * by the number of payload bytes stored for the page.  If the payload size
+ * equals BLCKSZ minus the hole, the page was not compressible and is stored
+ * as is.
+ */
+#define IsCompressedBackup(alg) \
+	((alg) == PGLZ_COMPRESS || (alg) == ZLIB_COMPRESS)
+
+/* Buffer large enough for the worst case output of any algorithm */
+#define COMPRESS_BUFFER_SIZE	(BLCKSZ * 2)
+
+/*
+ * Compress src_size bytes of src into dst.  Returns the size of compressed
+ * data, or -1 if the data could not be compressed.
+ */
+static int32
+do_compress(void *dst, size_t dst_size, const void *src, size_t src_size,
+			CompressAlg alg, int level)
+{
+	switch (alg)
+	{
+		case PGLZ_COMPRESS:
+			return pglz_compress(src, src_size, dst, PGLZ_strategy_always);
+#ifdef HAVE_LIBZ
+		case ZLIB_COMPRESS:
+			{
+				uLongf		compressed_size = dst_size;
+				int			rc;
+
+				rc = compress2(dst, &compressed_size, src, src_size, level);
+				return rc == Z_OK ? (int32) compressed_size : -1;
+			}
+#endif
+		default:
+			elog(ERROR, "invalid compression algorithm %d", alg);
+	}
+
+	return -1;
+}
+
+/*
+ * Decompress src_size bytes of src into dst.  Returns the size of
+ * decompressed data, or -1 on failure.
+ */
+static int32
+do_decompress(void *dst, size_t dst_size, const void *src, size_t src_size,
+			  CompressAlg alg)
+{
+	switch (alg)
+	{
+		case PGLZ_COMPRESS:
+			return pglz_decompress(src, src_size, dst, dst_size);
+#ifdef HAVE_LIBZ
+		case ZLIB_COMPRESS:
+			{
+				uLongf		decompressed_size = dst_size;
+				int			rc;
+
+				rc = uncompress(dst, &decompressed_size, src, src_size);
+				return rc == Z_OK ? (int32) decompressed_size : -1;
+			}
+#else
+		case ZLIB_COMPRESS:
+			elog(ERROR, "zlib compression is not supported by this build");
+#endif
+		default:
+			elog(ERROR, "invalid compression algorithm %d", alg);
+	}
+
+	return -1;
+}
+
 static bool
 parse_page(const DataPage *page,
 		   XLogRecPtr *lsn, uint16 *offset, uint16 *length)
@@ -53,6 +156,786 @@ parse_page(const DataPage *page,
 	return false;
 }
 
+/* state of backup_data_blocks() used by the page handlers */
+typedef struct BackupBlocksState
+{
+	int			fd;
+	FILE	   *out;
+	const char *to_path;
+	pgFile	   *file;
+	const XLogRecPtr *lsn;
+	size_t	   *read_size;
+	size_t	   *write_size;
+	pg_crc32   *crc;
+	pgChunkHash *chunks;		/* hashes of the chunks written */
+	int			nchunks;
+	int			maxchunks;
+} BackupBlocksState;
+
+/*
+ * Add a page of len bytes, about to be written at the end of the backup
+ * file, to the hash of its chunk.  The hash of the previous chunk is
+ * finished when the first page of the next one comes.
+ */
+static void
+hash_chunk_page(BackupBlocksState *state, BlockNumber blkno,
+				const char *data, size_t len)
+{
+	uint32		chunk = blkno / CHUNK_HASH_BLOCKS;
+	pgChunkHash *last = NULL;
+
+	if (state->nchunks > 0)
+		last = &state->chunks[state->nchunks - 1];
+
+	if (last == NULL || last->chunk != chunk)
+	{
+		if (last != NULL)
+			FIN_CRC32C(last->hash);
+		if (state->nchunks == state->maxchunks)
+		{
+			state->maxchunks = Max(state->maxchunks * 2, 16);
+			state->chunks = pgut_realloc(state->chunks,
+										 sizeof(pgChunkHash) * state->maxchunks);
+		}
+		last = &state->chunks[state->nchunks++];
+		last->offset = *state->write_size;
+		last->chunk = chunk;
+		INIT_CRC32C(last->hash);
+	}
+
+	COMP_CRC32C(last->hash, data, len);
+}
+
+/*
+ * Write the page excluding hole to the backup file, compressing it if the
+ * current backup uses page compression.  CRC, chunk hash and write_size are
+ * updated with exactly the bytes written.
+ */
+static void
+write_backup_page(BackupBlocksState *state, BackupPageHeader *header,
+				  DataPage *page)
+{
+	char		write_buffer[sizeof(BackupPageHeader) + sizeof(uint32) +
+							 COMPRESS_BUFFER_SIZE];
+	char		raw[BLCKSZ];
+	char	   *payload = raw;
+	uint32		raw_size;
+	uint32		payload_size;
+	size_t		len = 0;
+	int			upper_offset;
+	int			upper_length;
+
+	upper_offset = header->hole_offset + header->hole_length;
+	upper_length = BLCKSZ - upper_offset;
+
+	/* squeeze out the hole */
+	memcpy(raw, page->data, header->hole_offset);
+	memcpy(raw + header->hole_offset, page->data + upper_offset, upper_length);
+	raw_size = header->hole_offset + upper_length;
+	payload_size = raw_size;
+
+	memcpy(write_buffer, header, sizeof(BackupPageHeader));
+	len += sizeof(BackupPageHeader);
+
+	if (IsCompressedBackup(current.compress_alg))
+	{
+		char		compressed[COMPRESS_BUFFER_SIZE];
+		int32		compressed_size;
+
+		compressed_size = do_compress(compressed, sizeof(compressed),
+									  raw, raw_size,
+									  current.compress_alg,
+									  current.compress_level);
+
+		/* store the page as is if it didn't get smaller */
+		if (compressed_size > 0 && (uint32) compressed_size < raw_size)
+		{
+			payload_size = compressed_size;
+			memcpy(write_buffer + len + sizeof(uint32), compressed,
+				   payload_size);
+			payload = NULL;
+		}
+
+		memcpy(write_buffer + len, &payload_size, sizeof(uint32));
+		len += sizeof(uint32);
+	}
+
+	if (payload != NULL)
+		memcpy(write_buffer + len, payload, payload_size);
+	len += payload_size;
+
+	if (fwrite(write_buffer, 1, len, state->out) != len)
+		elog(ERROR, "cannot write at block %u of \"%s\": %s",
+			 header->block, state->to_path, strerror(errno));
+
+	hash_chunk_page(state, header->block, write_buffer, len);
+	COMP_CRC32C(*state->crc, write_buffer, len);
+	*state->write_size += len;
+	throttle_write(len);
+}
+
+/*
+ * Build the path of the backup copy of file.  In check mode everything goes
+ * to $BACKUP_PATH/tmp and is removed afterwards.
+ */
+static void
+backup_file_path(char *to_path, const char *from_root, const char *to_root,
+				 pgFile *file)
+{
+	if (check)
+		snprintf(to_path, MAXPGPATH, "%s/tmp", backup_path);
+	else
+		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+}
+
+/* set once O_DIRECT was refused, to warn only once */
+static volatile uint32 direct_read_failed = 0;
+
+/*
+ * Open a file of the database cluster for reading in the configured read
+ * mode.  *mode receives the mode actually used: if the file system refuses
+ * O_DIRECT, the file is read through the page cache and the pages read are
+ * dropped instead.  Returns -1 with errno set on failure.
+ */
+static int
+open_source_file(const char *path, ReadMode *mode)
+{
+	*mode = read_mode;
+
+#ifdef O_DIRECT
+	if (*mode == READ_MODE_DIRECT)
+	{
+		int			fd = open(path, O_RDONLY | PG_BINARY | O_DIRECT);
+
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+
+		if (__sync_lock_test_and_set(&direct_read_failed, 1) == 0)
+			elog(WARNING, "O_DIRECT is not supported for \"%s\", dropping read pages from cache instead",
+				 path);
+	}
+#else
+	if (*mode == READ_MODE_DIRECT &&
+		__sync_lock_test_and_set(&direct_read_failed, 1) == 0)
+		elog(WARNING, "O_DIRECT is not supported on this platform, dropping read pages from cache instead");
+#endif
+	if (*mode == READ_MODE_DIRECT)
+		*mode = READ_MODE_DONTNEED;
+
+	return open(path, O_RDONLY | PG_BINARY);
+}
+
+/*
+ * Drop the pages already read from the page cache in dontneed read mode.
+ */
+static void
+release_source_pages(int fd, ReadMode mode, off_t offset, off_t len)
+{
+	if (mode == READ_MODE_DONTNEED)
+		(void) posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+/*
+ * Allocate a read buffer aligned for O_DIRECT.
+ */
+static char *
+alloc_read_buffer(size_t size)
+{
+	void	   *buf;
+
+	if (posix_memalign(&buf, READ_BUFFER_ALIGN, size) != 0)
+		elog(ERROR, "out of memory");
+	return (char *) buf;
+}
+
+/*
+ * read() repeated until len bytes are read or end of file is reached.
+ */
+static ssize_t
+read_source(int fd, char *buf, size_t len)
+{
+	size_t		done = 0;
+
+	while (done < len)
+	{
+		ssize_t		ret = read(fd, buf + done, len - done);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+/*
+ * pread() of the len bytes at offset repeated from done, the bytes already
+ * in buf, until all are read or end of file is reached.  A read may return
+ * less than asked for, e.g. when interrupted by a signal or on a network
+ * file system, only a read returning nothing tells the end of the file.
+ */
+static ssize_t
+pread_source(int fd, char *buf, size_t len, off_t offset, size_t done)
+{
+	while (done < len)
+	{
+		ssize_t		ret = pread(fd, buf + done, len - done, offset + done);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+/*
+ * Read mode used by the backup: the configured one, unless O_DIRECT had to
+ * be replaced by dropping cache pages for some files.
+ */
+ReadMode
+effective_read_mode(void)
+{
+	if (read_mode == READ_MODE_DIRECT && direct_read_failed)
+		return READ_MODE_DONTNEED;
+	return read_mode;
+}
+
+static void
+add_page_run(PageRun **runs, int *nruns, int *maxruns, BlockNumber blknum)
+{
+	PageRun    *last = *nruns > 0 ? &(*runs)[*nruns - 1] : NULL;
+
+	if (last != NULL && last->blkno + last->nblocks == blknum &&
+		last->nblocks < READ_RUN_BLOCKS)
+	{
+		last->nblocks++;
+		return;
+	}
+
+	if (*nruns == *maxruns)
+	{
+		*maxruns *= 2;
+		*runs = (PageRun *) pg_realloc(*runs, sizeof(PageRun) * *maxruns);
+	}
+	(*runs)[*nruns].blkno = blknum;
+	(*runs)[*nruns].nblocks = 1;
+	(*nruns)++;
+}
+
+/*
+ * Collect the blocks of pagemap in start_blk..end_blk-1 as runs of
+ * contiguous blocks, each at most READ_RUN_BLOCKS long, so that a run can
+ * be read with one request.  Returns the number of runs, the array is
+ * allocated into *runs.
+ */
+static int
+pagemap_runs(datapagemap_t *pagemap, BlockNumber start_blk,
+			 BlockNumber end_blk, PageRun **runs)
+{
+	datapagemap_iterator_t *iter;
+	BlockNumber	blknum;
+	int			nruns = 0;
+	int			maxruns = 64;
+
+	*runs = (PageRun *) pg_malloc(sizeof(PageRun) * maxruns);
+
+	iter = datapagemap_iterate(pagemap);
+	while (datapagemap_next(iter, &blknum))
+	{
+		if (blknum < start_blk || blknum >= end_blk)
+			continue;
+		add_page_run(runs, &nruns, &maxruns, blknum);
+	}
+	pg_free(iter);
+
+	return nruns;
+}
+
+/*
+ * Same as pagemap_runs() for all the whole pages of the file in
+ * start_blk..end_blk-1.
+ */
+static int
+scan_runs(int fd, pgFile *file, BlockNumber start_blk, BlockNumber end_blk,
+		  PageRun **runs)
+{
+	struct stat	st;
+	BlockNumber	nblocks;
+	BlockNumber	blknum;
+	int			nruns = 0;
+	int			maxruns = 64;
+
+	if (fstat(fd, &st) == -1)
+		elog(ERROR, "cannot stat \"%s\": %s", file->path, strerror(errno));
+	nblocks = st.st_size / BLCKSZ;
+	if (nblocks > end_blk)
+		nblocks = end_blk;
+
+	*runs = (PageRun *) pg_malloc(sizeof(PageRun) * maxruns);
+	for (blknum = start_blk; blknum < nblocks; blknum++)
+		add_page_run(runs, &nruns, &maxruns, blknum);
+
+	return nruns;
+}
+
+/*
+ * Read a page again after a failed check.
+ */
+static void
+reread_page(int fd, DataPage *page, off_t offset, pgFile *file,
+			BlockNumber blknum)
+{
+	if (pread(fd, page->data, BLCKSZ, offset) != BLCKSZ)
+		elog(ERROR, "cannot read block %u of \"%s\": %s",
+			 blknum, file->path, strerror(errno));
+}
+
+/*
+ * Result of the checks of a data page.  A page with a bad header or checksum
+ * may be torn by a write in progress, it is deferred and read again once
+ * the other pages of its read run have been checked.  See
+ * backup_checked_pages() for how long this lets the write complete.
+ */
+typedef enum PageCheck
+{
+	PAGE_VALID,
+	PAGE_EMPTY,				/* all zeroes */
+	PAGE_TORN_HEADER,		/* suspicious, bad page header */
+	PAGE_TORN_CHECKSUM,		/* suspicious, bad checksum */
+	PAGE_STOP				/* don't copy this page and the rest of the file */
+} PageCheck;
+
+/* a page read from a data file and the results of its checks */
+typedef struct CheckedPage
+{
+	BackupPageHeader header;
+	XLogRecPtr	lsn;
+	PageCheck	check;
+} CheckedPage;
+
+/*
+ * Times a deferred page is read again, and the pause before each read: a
+ * page still torn about 10ms after the first of its re-reads is an error.
+ */
+#define PAGE_RECHECK_TRIES		100
+#define PAGE_RECHECK_DELAY		100		/* microseconds */
+
+/*
+ * Check a page read from block blknum of the file.  full_scan tells that the
+ * file is scanned entirely rather than read by its page map.  checksum is
+ * the checksum computed for the page, if the cluster has checksums.
+ */
+static PageCheck
+check_data_page(BackupBlocksState *state, DataPage *page, BlockNumber blknum,
+				bool full_scan, uint16 checksum, CheckedPage *checked)
+{
+	pgFile	   *file = state->file;
+
+	checked->header.block = blknum;
+
+	/*
+	 * If an invalid data page was found, fallback to simple copy to ensure
+	 * all pages in the file don't have BackupPageHeader.
+	 */
+	if (!parse_page(page, &checked->lsn,
+					&checked->header.hole_offset, &checked->header.hole_length))
+	{
+		struct stat st;
+
+		if (page_is_zero(page->data))
+		{
+			elog(LOG, "File: %s blknum %u, empty page", file->path, blknum);
+			/* the whole page is a hole, nothing but the header is stored */
+			checked->header.hole_offset = 0;
+			checked->header.hole_length = BLCKSZ;
+			return PAGE_EMPTY;
+		}
+
+		if (stat(file->path, &st) != 0)
+		{
+			/* removed since, its pages are not needed */
+			if (errno == ENOENT)
+			{
+				elog(LOG, "File: %s blknum %u, file has been removed", file->path, blknum);
+				return PAGE_STOP;
+			}
+			elog(ERROR, "cannot stat \"%s\": %s", file->path, strerror(errno));
+		}
+		elog(LOG, "File: %s blknum %u, invalid page header, file size was %lu and is %lu",
+			 file->path, blknum, (unsigned long) file->size, (unsigned long) st.st_size);
+		if (st.st_size != file->size && blknum >= file->size/BLCKSZ-1)
+		{
+			elog(WARNING, "File: %s blknum %u, file size has changed before backup start", file->path, blknum);
+			return PAGE_STOP;
+		}
+		if (full_scan && blknum >= file->size/BLCKSZ-1)
+		{
+			elog(WARNING, "File: %s blknum %u, the last page is empty, skip", file->path, blknum);
+			return PAGE_STOP;
+		}
+		if (st.st_size != file->size && blknum < file->size/BLCKSZ-1)
+			elog(WARNING, "File: %s blknum %u, file size has changed before backup start, it seems bad", file->path, blknum);
+		return PAGE_TORN_HEADER;
+	}
+
+	if (current.checksum_version && checksum != page->page_data.pd_checksum)
+	{
+		/*
+		 * A page written since the backup has started is restored from its
+		 * full page image by WAL replay, whatever is copied now.  An LSN
+		 * past the WAL the server has inserted is garbage, not a write.
+		 */
+		if (checked->lsn > current.start_lsn && lsn_is_inserted(checked->lsn))
+		{
+			elog(LOG, "File: %s blknum %u have wrong checksum, modified after backup start", file->path, blknum);
+			return PAGE_VALID;
+		}
+		return PAGE_TORN_CHECKSUM;
+	}
+
+	return PAGE_VALID;
+}
+
+/*
+ * Read a deferred page again until it passes the checks.  Fails if it is
+ * still bad after PAGE_RECHECK_TRIES reads.
+ */
+static PageCheck
+recheck_data_page(BackupBlocksState *state, DataPage *page, BlockNumber blknum,
+				  bool full_scan, CheckedPage *checked)
+{
+	pgFile	   *file = state->file;
+	PageCheck	check = checked->check;
+	uint16		checksum = 0;
+	int			try;
+
+	for (try = 0; try < PAGE_RECHECK_TRIES; try++)
+	{
+		elog(LOG, "File: %s blknum %u have wrong %s, try again", file->path,
+			 blknum, check == PAGE_TORN_HEADER ? "page header" : "checksum");
+		pg_usleep(PAGE_RECHECK_DELAY);
+		reread_page(state->fd, page, (off_t) blknum * BLCKSZ, file, blknum);
+		*state->read_size += BLCKSZ;
+
+		if (current.checksum_version)
+			pg_checksum_pages(page->data, 1,
+							  file->segno * RELSEG_SIZE + blknum, &checksum);
+		check = check_data_page(state, page, blknum, full_scan, checksum,
+								checked);
+		if (check != PAGE_TORN_HEADER && check != PAGE_TORN_CHECKSUM)
+			return check;
+	}
+
+	if (check == PAGE_TORN_HEADER)
+		elog(ERROR, "File: %s blknum %u have wrong page header.", file->path, blknum);
+	else
+		elog(ERROR, "File: %s blknum %u have wrong checksum.", file->path, blknum);
+	return check;
+}
+
+/*
+ * Check the npages pages read from blocks blkno.. of the file, then write
+ * them in block order.  Suspicious pages are read again only after all the
+ * others are checked, so that a page torn by a write in progress doesn't
+ * hold up the pages after it, and its write has time to complete.  Returns
+ * false if the rest of the file must not be copied.
+ *
+ * The deferral only lasts to the end of this run of at most READ_RUN_BLOCKS
+ * pages, not to the end of the file or segment: the pages of a backup file
+ * must stay in ascending block order, and deferring further would mean
+ * holding back every page read after the torn one.  So the window given to
+ * the write is the checks of the rest of the run plus PAGE_RECHECK_TRIES
+ * re-reads PAGE_RECHECK_DELAY apart.
+ */
+static bool
+backup_checked_pages(BackupBlocksState *state, DataPage *pages, int npages,
+					 BlockNumber blkno, bool full_scan)
+{
+	CheckedPage	checked[READ_RUN_BLOCKS];
+	uint16		checksums[READ_RUN_BLOCKS];
+	int			end = npages;
+	int			i;
+
+	Assert(npages <= READ_RUN_BLOCKS);
+
+	/* the checksums of the whole run at once */
+	if (current.checksum_version)
+		pg_checksum_pages(pages[0].data, npages,
+						  state->file->segno * RELSEG_SIZE + blkno, checksums);
+	else
+		memset(checksums, 0, sizeof(checksums));
+
+	for (i = 0; i < end; i++)
+	{
+		checked[i].check = check_data_page(state, &pages[i], blkno + i,
+										   full_scan, checksums[i],
+										   &checked[i]);
+		*state->read_size += BLCKSZ;
+		if (checked[i].check == PAGE_STOP)
+			end = i;
+	}
+
+	/* the deferred pages */
+	for (i = 0; i < end; i++)
+	{
+		if (checked[i].check != PAGE_TORN_HEADER &&
+			checked[i].check != PAGE_TORN_CHECKSUM)
+			continue;
+
+		checked[i].check = recheck_data_page(state, &pages[i], blkno + i,
+											 full_scan, &checked[i]);
+		if (checked[i].check == PAGE_STOP)
+			end = i;
+	}
+
+	for (i = 0; i < end; i++)
+	{
+		/*
+		 * In delta mode skip pages not modified since the parent backup
+		 * has started.  Empty pages are kept so that the restored file
+		 * gets its full length.
+		 */
+		if (full_scan && state->lsn != NULL &&
+			current.backup_mode == BACKUP_MODE_DIFF_DELTA &&
+			checked[i].check != PAGE_EMPTY && checked[i].lsn < *state->lsn)
+			continue;
+
+		write_backup_page(state, &checked[i].header, &pages[i]);
+	}
+
+	return end == npages;
+}
+
+/*
+ * Copy blocks start_blk..end_blk-1 of the data file opened as fd to out,
+ * reading it in the given read mode.
+ * If lsn is not NULL, pages only which are modified after the lsn will be
+ * copied.  The counters and CRC are accumulated into the given variables
+ * rather than into the pgFile, so that several threads can each copy a
+ * part of one file.  The hashes of the chunks written are returned in
+ * chunks, with offsets from the start of out.
+ */
+static void
+backup_data_blocks(int fd, ReadMode mode, FILE *out, const char *to_path,
+				   pgFile *file,
+				   const XLogRecPtr *lsn,
+				   BlockNumber start_blk, BlockNumber end_blk,
+				   size_t *read_size, size_t *write_size, pg_crc32 *crc,
+				   pgChunkHash **chunks, int *nchunks)
+{
+	BackupBlocksState state;
+	bool		full_scan = (file->pagemap.bitmapsize == 0);
+	PageRun	   *runs;
+	int			nruns;
+	int			run;
+	int			batch_runs = 1;
+	int			advised = 0;
+	pgIORing   *ring = NULL;
+	DataPage   *pages = NULL;
+	ssize_t		lens[READ_RING_RUNS];
+	bool		stop_backup = false;
+
+	state.fd = fd;
+	state.out = out;
+	state.to_path = to_path;
+	state.file = file;
+	state.lsn = lsn;
+	state.read_size = read_size;
+	state.write_size = write_size;
+	state.crc = crc;
+	state.chunks = NULL;
+	state.nchunks = 0;
+	state.maxchunks = 0;
+
+	/*
+	 * Read each page and write the page excluding hole. If it has been
+	 * determined that the page can be copied safely, but no page map
+	 * has been built, it means that we are in presence of a relation
+	 * file that needs to be completely scanned. If a page map is present
+	 * only scan the blocks needed. In each case, pages are copied without
+	 * their hole to ensure some basic level of compression.
+	 */
+	if (full_scan)
+		nruns = scan_runs(state.fd, file, start_blk, end_blk, &runs);
+	else
+		nruns = pagemap_runs(&file->pagemap, start_blk, end_blk, &runs);
+
+	if (io_engine == IO_ENGINE_IO_URING && nruns > 1)
+	{
+		ring = io_ring_get(READ_RING_RUNS, READ_RUN_BLOCKS * BLCKSZ);
+		if (ring != NULL)
+			batch_runs = READ_RING_RUNS;
+	}
+	if (ring == NULL)
+		pages = (DataPage *) alloc_read_buffer(sizeof(DataPage) * READ_RUN_BLOCKS);
+
+	for (run = 0; run < nruns && !stop_backup; run += batch_runs)
+	{
+		int			nbatch = Min(batch_runs, nruns - run);
+		int			r;
+
+		if (ring != NULL)
+		{
+			/* read the whole batch of runs with one system call */
+			for (r = 0; r < nbatch; r++)
+				throttle_read(runs[run + r].nblocks * BLCKSZ);
+			for (r = 0; r < nbatch; r++)
+				io_ring_read(ring, r, state.fd,
+							 (off_t) runs[run + r].blkno * BLCKSZ,
+							 runs[run + r].nblocks * BLCKSZ);
+			io_ring_wait(ring);
+			for (r = 0; r < nbatch; r++)
+			{
+				size_t		len = (size_t) runs[run + r].nblocks * BLCKSZ;
+
+				lens[r] = io_ring_result(ring, r);
+				if (lens[r] == -EINTR || lens[r] == -EAGAIN)
+					lens[r] = 0;
+				if (lens[r] < 0)
+					elog(ERROR, "cannot read block %u of \"%s\": %s",
+						 runs[run + r].blkno, file->path, strerror(-lens[r]));
+
+				/* a partial completion is read on to the end of the run */
+				if (lens[r] < (ssize_t) len)
+				{
+					lens[r] = pread_source(state.fd, io_ring_buffer(ring, r),
+										   len,
+										   (off_t) runs[run + r].blkno * BLCKSZ,
+										   lens[r]);
+					if (lens[r] < 0)
+						elog(ERROR, "cannot read block %u of \"%s\": %s",
+							 runs[run + r].blkno, file->path, strerror(errno));
+				}
+			}
+		}
+		else
+		{
+			struct iovec iov[READ_RUN_BLOCKS];
+			int			i;
+
+			/*
+			 * Let the kernel read ahead the next runs while this one is
+			 * being processed.  Direct reads bypass the cache.
+			 */
+			for (; mode != READ_MODE_DIRECT && advised < nruns &&
+				 advised <= run + READ_PREFETCH_RUNS;
+				 advised++)
+				(void) posix_fadvise(state.fd,
+									 (off_t) runs[advised].blkno * BLCKSZ,
+									 (off_t) runs[advised].nblocks * BLCKSZ,
+									 POSIX_FADV_WILLNEED);
+
+			for (i = 0; i < runs[run].nblocks; i++)
+			{
+				iov[i].iov_base = pages[i].data;
+				iov[i].iov_len = BLCKSZ;
+			}
+			throttle_read(runs[run].nblocks * BLCKSZ);
+			lens[0] = preadv(state.fd, iov, runs[run].nblocks,
+							 (off_t) runs[run].blkno * BLCKSZ);
+			if (lens[0] < 0 && errno == EINTR)
+				lens[0] = 0;
+
+			/* a short read is completed, the pages are contiguous */
+			if (lens[0] >= 0 && lens[0] < (ssize_t) runs[run].nblocks * BLCKSZ)
+				lens[0] = pread_source(state.fd, pages[0].data,
+									   (size_t) runs[run].nblocks * BLCKSZ,
+									   (off_t) runs[run].blkno * BLCKSZ,
+									   lens[0]);
+			if (lens[0] < 0)
+				elog(ERROR, "cannot read block %u of \"%s\": %s",
+					 runs[run].blkno, file->path, strerror(errno));
+		}
+
+		for (r = 0; r < nbatch && !stop_backup; r++)
+		{
+			DataPage   *buf;
+			int			npages = runs[run + r].nblocks;
+
+			buf = ring != NULL ? (DataPage *) io_ring_buffer(ring, r) : pages;
+
+			/*
+			 * The file was truncated after its size was taken, as the read
+			 * reached the end of the file.
+			 */
+			if (lens[r] < (ssize_t) npages * BLCKSZ)
+			{
+				npages = lens[r] / BLCKSZ;
+				elog(LOG, "File: %s blknum %u, file was truncated, skip", file->path,
+					 runs[run + r].blkno + npages);
+				stop_backup = true;
+			}
+
+			if (!backup_checked_pages(&state, buf, npages,
+									  runs[run + r].blkno, full_scan))
+				stop_backup = true;
+		}
+
+		for (r = 0; r < nbatch; r++)
+			release_source_pages(fd, mode, (off_t) runs[run + r].blkno * BLCKSZ,
+								 (off_t) runs[run + r].nblocks * BLCKSZ);
+	}
+
+	if (pages)
+		free(pages);
+	pg_free(runs);
+
+	if (state.nchunks > 0)
+		FIN_CRC32C(state.chunks[state.nchunks - 1].hash);
+	*chunks = state.chunks;
+	*nchunks = state.nchunks;
+}
+
+/*
+ * Tail of backup_data_file(): store the CRC, treat empty files as non data files, and drop the backup copy if
+ * no page was written.
+ */
+static bool
+finish_data_file(pgFile *file, const char *to_path, pg_crc32 crc)
+{
+	/*
+	 * update file permission
+	 * FIXME: Should set permission on open?
+	 */
+	if (!check && chmod(to_path, FILE_PERMISSION) == -1)
+		elog(ERROR, "cannot change mode of \"%s\": %s", file->path,
+			 strerror(errno));
+
+	/* finish CRC calculation and store into pgFile */
+	FIN_CRC32C(crc);
+	file->crc = crc;
+
+	/* Treat empty file as not-datafile */
+	if (file->read_size == 0)
+		file->is_datafile = false;
+
+	/* We do not backup if all pages skipped. */
+	if (file->write_size == 0 && file->read_size > 0)
+	{
+		if (remove(to_path) == -1)
+			elog(ERROR, "cannot remove file \"%s\": %s", to_path,
+				 strerror(errno));
+		return false;
+	}
+
+	/* remove $BACKUP_PATH/tmp created during check */
+	if (check)
+		remove(to_path);
+
+	return true;
+}
+
 /*
  * Backup data file in the from_root directory to the to_root directory with
  * same relative path.
@@ -64,16 +947,10 @@ backup_data_file(const char *from_root, const char *to_root,
 				 pgFile *file, const XLogRecPtr *lsn)
 {
 	char				to_path[MAXPGPATH];
-	FILE				*in;
+	int					in;
+	ReadMode			mode;
 	FILE				*out;
-	BackupPageHeader	header;
-	DataPage			page; /* used as read buffer */
-	BlockNumber			blknum = 0;
-	size_t				read_len = 0;
 	pg_crc32			crc;
-	off_t				offset;
-	char				write_buffer[sizeof(header)+BLCKSZ];
-	size_t				write_buffer_real_size;
 
 	INIT_CRC32C(crc);
 
@@ -82,8 +959,8 @@ backup_data_file(const char *from_root, const char *to_root,
 	file->write_size = 0;
 
 	/* open backup mode file for read */
-	in = fopen(file->path, "r");
-	if (in == NULL)
+	in = open_source_file(file->path, &mode);
+	if (in < 0)
 	{
 		FIN_CRC32C(crc);
 		file->crc = crc;
@@ -97,15 +974,12 @@ backup_data_file(const char *from_root, const char *to_root,
 	}
 
 	/* open backup file for write  */
-	if (check)
-		snprintf(to_path, lengthof(to_path), "%s/tmp", backup_path);
-	else
-		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	backup_file_path(to_path, from_root, to_root, file);
 	out = fopen(to_path, "w");
 	if (out == NULL)
 	{
 		int errno_tmp = errno;
-		fclose(in);
+		close(in);
 		elog(ERROR, "cannot open backup file \"%s\": %s",
 			 to_path, strerror(errno_tmp));
 	}
@@ -113,456 +987,1031 @@ backup_data_file(const char *from_root, const char *to_root,
 	/* confirm server version */
 	check_server_version();
 
+	backup_data_blocks(in, mode, out, to_path, file, lsn, 0, InvalidBlockNumber,
+					   &file->read_size, &file->write_size, &crc,
+					   &file->chunks, &file->nchunks);
 
 	/*
-	 * Read each page and write the page excluding hole. If it has been
-	 * determined that the page can be copied safely, but no page map
-	 * has been built, it means that we are in presence of a relation
-	 * file that needs to be completely scanned. If a page map is present
-	 * only scan the blocks needed. In each case, pages are copied without
-	 * their hole to ensure some basic level of compression.
+	 * If we have pagemap then file can't be a zero size.
+	 * Otherwise, we will clear the last file.
+	 * Increase read_size to delete after.
 	 */
-	if (file->pagemap.bitmapsize == 0)
+	if (file->pagemap.bitmapsize != 0 && file->read_size == 0)
+		file->read_size++;
+
+	close(in);
+	fclose(out);
+
+	return finish_data_file(file, to_path, crc);
+}
+
+/*
+ * Backup blocks start_blk..end_blk-1 of a data file into the part file
+ * "<backup file>.part<part>".  The parts of a file are copied by different
+ * threads and are kept as they are, backup_data_file_join() records them
+ * as the backup copy of the file.  Sizes of the part are returned in
+ * read_size and write_size, its CRC in crc and the hashes of its chunks,
+ * with offsets in the part, in chunks.  start_blk must be a multiple of
+ * CHUNK_HASH_BLOCKS so that no chunk spans two parts.  Returns false if the
+ * file vanished.
+ */
+bool
+backup_data_file_part(const char *from_root, const char *to_root,
+					  pgFile *file, const XLogRecPtr *lsn,
+					  BlockNumber start_blk, BlockNumber end_blk, int part,
+					  size_t *read_size, size_t *write_size, pg_crc32 *crc,
+					  pgChunkHash **chunks, int *nchunks)
+{
+	char				to_path[MAXPGPATH];
+	char				part_path[MAXPGPATH];
+	int					in;
+	ReadMode			mode;
+	FILE				*out;
+
+	Assert(start_blk % CHUNK_HASH_BLOCKS == 0);
+
+	*read_size = 0;
+	*write_size = 0;
+	*chunks = NULL;
+	*nchunks = 0;
+
+	in = open_source_file(file->path, &mode);
+	if (in < 0)
 	{
-		for (blknum = 0;
-			 (read_len = fread(&page, 1, sizeof(page), in)) == sizeof(page);
-			 ++blknum)
+		/* maybe vanished, it's not error */
+		if (errno == ENOENT)
+			return false;
+
+		elog(ERROR, "cannot open backup mode file \"%s\": %s",
+			 file->path, strerror(errno));
+	}
+
+	backup_file_path(to_path, from_root, to_root, file);
+	snprintf(part_path, lengthof(part_path), "%s.part%d", to_path, part);
+	out = fopen(part_path, "w");
+	if (out == NULL)
+	{
+		int errno_tmp = errno;
+		close(in);
+		elog(ERROR, "cannot open backup file \"%s\": %s",
+			 part_path, strerror(errno_tmp));
+	}
+
+	/* confirm server version */
+	check_server_version();
+
+	INIT_CRC32C(*crc);
+	backup_data_blocks(in, mode, out, part_path, file, lsn, start_blk, end_blk,
+					   read_size, write_size, crc, chunks, nchunks);
+	FIN_CRC32C(*crc);
+
+	close(in);
+	if (fclose(out) != 0)
+		elog(ERROR, "cannot write backup file \"%s\": %s",
+			 part_path, strerror(errno));
+
+	if (!check && chmod(part_path, FILE_PERMISSION) == -1)
+		elog(ERROR, "cannot change mode of \"%s\": %s", part_path,
+			 strerror(errno));
+
+	return true;
+}
+
+/*
+ * CRC-32C operator of len2 zero bytes, applied with the GF(2) matrices of
+ * zlib's crc32_combine().
+ */
+static uint32
+gf2_matrix_times(const uint32 *mat, uint32 vec)
+{
+	uint32		sum = 0;
+
+	while (vec)
+	{
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void
+gf2_matrix_square(uint32 *square, const uint32 *mat)
+{
+	int			n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/*
+ * Return the CRC-32C of the concatenation of two byte strings from their
+ * CRCs crc1 and crc2, and the length of the second one.
+ */
+static pg_crc32
+crc32c_combine(pg_crc32 crc1, pg_crc32 crc2, uint64 len2)
+{
+	uint32		even[32];
+	uint32		odd[32];
+	uint32		row = 1;
+	int			n;
+
+	if (len2 == 0)
+		return crc1;
+
+	/* operator of one zero bit, reflected CRC-32C polynomial */
+	odd[0] = 0x82F63B78;
+	for (n = 1; n < 32; n++)
+	{
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);	/* two zero bits */
+	gf2_matrix_square(odd, even);	/* four zero bits */
+
+	/* apply len2 zero bytes to crc1, squaring for each bit of len2 */
+	do
+	{
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+/*
+ * Record the nparts part files written by backup_data_file_part() as the
+ * backup copy of file, which is read as their concatenation in part order.
+ * read_size and write_size of file must already hold the sums over all the
+ * parts.  The CRC of the copy is combined from those of the parts, the
+ * chunk hashes of the parts are joined into those of file, with offsets in
+ * the copy, and freed.  If discard is true, or no page was written, the
+ * parts are removed.
+ */
+bool
+backup_data_file_join(const char *from_root, const char *to_root,
+					  pgFile *file, int nparts, size_t *part_sizes,
+					  pg_crc32 *part_crcs, pgChunkHash **part_chunks,
+					  int *part_nchunks, bool discard)
+{
+	char		to_path[MAXPGPATH];
+	char		part_path[MAXPGPATH];
+	uint64		offset = 0;		/* of the current part in the copy */
+	int			part;
+	int			i;
+
+	/* We do not backup if all pages skipped. */
+	if (!discard && file->write_size == 0 && file->read_size > 0)
+		discard = true;
+
+	if (!discard)
+	{
+		file->nparts = nparts;
+		INIT_CRC32C(file->crc);
+		FIN_CRC32C(file->crc);
+		for (part = 0; part < nparts; part++)
+			file->nchunks += part_nchunks[part];
+		file->chunks = pgut_newarray(pgChunkHash, Max(file->nchunks, 1));
+		file->nchunks = 0;
+	}
+
+	backup_file_path(to_path, from_root, to_root, file);
+	for (part = 0; part < nparts; part++)
+	{
+		if (discard)
 		{
-			XLogRecPtr	page_lsn;
-			int		upper_offset;
-			int		upper_length;
-			int		try_checksum = 100;
-			bool	stop_backup = false;
+			snprintf(part_path, lengthof(part_path), "%s.part%d", to_path,
+					 part);
+			if (unlink(part_path) == -1 && errno != ENOENT)
+				elog(ERROR, "cannot remove file \"%s\": %s", part_path,
+					 strerror(errno));
+		}
+		else
+		{
+			for (i = 0; i < part_nchunks[part]; i++)
+			{
+				file->chunks[file->nchunks] = part_chunks[part][i];
+				file->chunks[file->nchunks].offset += offset;
+				file->nchunks++;
+			}
+			file->crc = crc32c_combine(file->crc, part_crcs[part],
+									   part_sizes[part]);
+			offset += part_sizes[part];
+		}
+		free(part_chunks[part]);
+		part_chunks[part] = NULL;
+	}
 
-			header.block = blknum;
+	return !discard;
+}
 
-			while(try_checksum)
+/*
+ * Backup copy of a data file opened for read.  The copy of a split file is
+ * kept in its part files, which are read as one file in part order.
+ * Sequential reads are buffered, reads at an offset are not.
+ */
+#define BACKUP_COPY_BUFFER_SIZE		(64 * 1024)
+
+struct pgBackupCopy
+{
+	const pgFile *file;
+	int			nfiles;
+	int		   *fds;
+	uint64	   *ends;			/* offset of the end of each file in the copy */
+	uint64		pos;			/* position of the sequential reads */
+	char	   *buf;
+	uint64		buf_start;		/* offset of buf in the copy */
+	size_t		buf_len;
+};
+
+/*
+ * Open the backup copy of file, whose path is that of the backup file.
+ * Returns NULL if a file of the copy doesn't exist.
+ */
+pgBackupCopy *
+backup_copy_open(const pgFile *file)
+{
+	pgBackupCopy *copy;
+	int			i;
+
+	copy = pgut_new(pgBackupCopy);
+	copy->file = file;
+	copy->nfiles = Max(file->nparts, 1);
+	copy->fds = pgut_newarray(int, copy->nfiles);
+	copy->ends = pgut_newarray(uint64, copy->nfiles);
+	copy->pos = 0;
+	copy->buf = NULL;
+	copy->buf_start = 0;
+	copy->buf_len = 0;
+
+	for (i = 0; i < copy->nfiles; i++)
+	{
+		char		path[MAXPGPATH];
+		struct stat	st;
+
+		if (file->nparts > 0)
+			snprintf(path, lengthof(path), "%s.part%d", file->path, i);
+		else
+			strlcpy(path, file->path, lengthof(path));
+
+		copy->fds[i] = open(path, O_RDONLY | PG_BINARY);
+		if (copy->fds[i] == -1)
+		{
+			int			errno_tmp = errno;
+
+			copy->nfiles = i;
+			backup_copy_close(copy);
+			if (errno_tmp == ENOENT)
 			{
-				try_checksum--;
-				/*
-				 * If an invalid data page was found, fallback to simple copy to ensure
-				 * all pages in the file don't have BackupPageHeader.
-				 */
-				if (!parse_page(&page, &page_lsn,
-								&header.hole_offset, &header.hole_length))
-				{
-					struct stat st;
-					int i;
-
-					for(i=0; i<BLCKSZ && page.data[i] == 0; i++);
-					if (i == BLCKSZ)
-					{
-						elog(LOG, "File: %s blknum %u, empty page", file->path, blknum);
-						goto end_checks;
-					}
-
-					stat(file->path, &st);
-					elog(WARNING, "SIZE: %lu %lu pages:%lu pages:%lu i:%i", file->size, st.st_size, file->size/BLCKSZ, st.st_size/BLCKSZ, i);
-					if (st.st_size != file->size && blknum >= file->size/BLCKSZ-1)
-					{
-						stop_backup = true;
-						elog(WARNING, "File: %s blknum %u, file size has changed before backup start", file->path, blknum);
-						break;
-					}
-					if (blknum >= file->size/BLCKSZ-1)
-					{
-						stop_backup = true;
-						elog(WARNING, "File: %s blknum %u, the last page is empty, skip", file->path, blknum);
-						break;
-					}
-					if (st.st_size != file->size && blknum < file->size/BLCKSZ-1)
-					{
-						elog(WARNING, "File: %s blknum %u, file size has changed before backup start, it seems bad", file->path, blknum);
-						if (!try_checksum)
-							break;
-					}
-					if (try_checksum)
-					{
-						elog(WARNING, "File: %s blknum %u have wrong page header, try again", file->path, blknum);
-						fseek(in, -sizeof(page), SEEK_CUR);
-						fread(&page, 1, sizeof(page), in);
-						continue;
-					}
-					else
-						elog(ERROR, "File: %s blknum %u have wrong page header.", file->path, blknum);
-				}
+				errno = errno_tmp;
+				return NULL;
+			}
+			elog(ERROR, "cannot open backup file \"%s\": %s", path,
+				 strerror(errno_tmp));
+		}
+		if (fstat(copy->fds[i], &st) == -1)
+			elog(ERROR, "cannot stat backup file \"%s\": %s", path,
+				 strerror(errno));
+		copy->ends[i] = (i > 0 ? copy->ends[i - 1] : 0) + st.st_size;
+	}
+
+	return copy;
+}
+
+void
+backup_copy_close(pgBackupCopy *copy)
+{
+	int			i;
+
+	for (i = 0; i < copy->nfiles; i++)
+		close(copy->fds[i]);
+	pg_free(copy->fds);
+	pg_free(copy->ends);
+	if (copy->buf)
+		pg_free(copy->buf);
+	pg_free(copy);
+}
+
+uint64
+backup_copy_size(const pgBackupCopy *copy)
+{
+	return copy->nfiles > 0 ? copy->ends[copy->nfiles - 1] : 0;
+}
+
+/*
+ * Read up to len bytes at offset of the copy into buf.  Returns the number
+ * of bytes read, less than len only at the end of the copy.
+ */
+size_t
+backup_copy_pread(pgBackupCopy *copy, char *buf, size_t len, uint64 offset)
+{
+	size_t		done = 0;
+	int			i = 0;
+
+	while (done < len)
+	{
+		uint64		start;
+		ssize_t		ret;
+
+		while (i < copy->nfiles && offset >= copy->ends[i])
+			i++;
+		if (i == copy->nfiles)
+			break;
 
+		start = (i > 0) ? copy->ends[i - 1] : 0;
+		ret = pread(copy->fds[i], buf + done,
+					Min(len - done, copy->ends[i] - offset),
+					(off_t) (offset - start));
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			elog(ERROR, "cannot read backup file \"%s\": %s",
+				 copy->file->path, strerror(errno));
+		}
+		if (ret == 0)
+			elog(ERROR, "backup file \"%s\" was truncated",
+				 copy->file->path);
+		done += ret;
+		offset += ret;
+	}
+
+	return done;
+}
+
+/*
+ * Read up to len bytes at the position of the sequential reads and move it
+ * on.  Returns the number of bytes read, less than len only at the end of
+ * the copy.
+ */
+size_t
+backup_copy_read(pgBackupCopy *copy, void *buf, size_t len)
+{
+	size_t		done = 0;
+
+	if (copy->buf == NULL)
+		copy->buf = pg_malloc(BACKUP_COPY_BUFFER_SIZE);
+
+	while (done < len)
+	{
+		size_t		n;
+
+		if (copy->pos < copy->buf_start ||
+			copy->pos >= copy->buf_start + copy->buf_len)
+		{
+			copy->buf_start = copy->pos;
+			copy->buf_len = backup_copy_pread(copy, copy->buf,
+											  BACKUP_COPY_BUFFER_SIZE,
+											  copy->pos);
+			if (copy->buf_len == 0)
+				break;
+		}
+
+		n = Min(len - done, copy->buf_start + copy->buf_len - copy->pos);
+		memcpy((char *) buf + done,
+			   copy->buf + (copy->pos - copy->buf_start), n);
+		done += n;
+		copy->pos += n;
+	}
+
+	return done;
+}
+
+/*
+ * Move the position of the sequential reads len bytes on.
+ */
+void
+backup_copy_skip(pgBackupCopy *copy, size_t len)
+{
+	copy->pos += len;
+}
+
+/*
+ * CRC-32C of the whole copy.
+ */
+pg_crc32
+backup_copy_crc(pgBackupCopy *copy)
+{
+	char		buf[BLCKSZ * 8];
+	uint64		offset = 0;
+	size_t		read_len;
+	pg_crc32	crc;
+
+	INIT_CRC32C(crc);
+	while ((read_len = backup_copy_pread(copy, buf, sizeof(buf), offset)) > 0)
+	{
+		COMP_CRC32C(crc, buf, read_len);
+		offset += read_len;
+	}
+	FIN_CRC32C(crc);
 
-				if(current.checksum_version &&
-				   pg_checksum_page(page.data, file->segno * RELSEG_SIZE + blknum) != ((PageHeader) page.data)->pd_checksum)
-				{
-					if (try_checksum)
-					{
-						elog(WARNING, "File: %s blknum %u have wrong checksum, try again", file->path, blknum);
-						usleep(100);
-						fseek(in, -sizeof(page), SEEK_CUR);
-						fread(&page, 1, sizeof(page), in);
-					}
-					else
-						elog(ERROR, "File: %s blknum %u have wrong checksum.", file->path, blknum);
-				} else {
-					try_checksum = 0;
-				}
-			}
+	return crc;
+}
 
-			end_checks:
+/*
+ * Check chunk index of the backup copy of file, opened as copy, against its
+ * hash.  A chunk ends where the next one starts, the last one at the end
+ * of the file.
+ */
+bool
+check_backup_chunk(pgBackupCopy *copy, const pgFile *file, int index)
+{
+	const pgChunkHash *chunk = &file->chunks[index];
+	uint64		end;
+	uint64		offset;
+	char		buf[BLCKSZ * 8];
+	pg_crc32	hash;
+
+	end = (index + 1 < file->nchunks) ? file->chunks[index + 1].offset :
+		(uint64) file->write_size;
+	if (chunk->offset >= end)
+		return false;
 
-			file->read_size += read_len;
+	INIT_CRC32C(hash);
+	for (offset = chunk->offset; offset < end;)
+	{
+		size_t		read_len;
 
-			if(stop_backup)
-				break;
+		read_len = backup_copy_pread(copy, buf, Min(sizeof(buf), end - offset),
+									 offset);
+		if (read_len == 0)
+			return false;
+		COMP_CRC32C(hash, buf, read_len);
+		offset += read_len;
+	}
+	FIN_CRC32C(hash);
 
-			upper_offset = header.hole_offset + header.hole_length;
-			upper_length = BLCKSZ - upper_offset;
+	return hash == chunk->hash;
+}
 
-			write_buffer_real_size = sizeof(header)+header.hole_offset+upper_length;
-			memcpy(write_buffer, &header, sizeof(header));
-			if (header.hole_offset)
-				memcpy(write_buffer+sizeof(header), page.data, header.hole_offset);
-			if (upper_length)
-				memcpy(write_buffer+sizeof(header)+header.hole_offset, page.data + upper_offset, upper_length);
+/*
+ * Check all the chunks of the backup copy of file, opened as copy, and
+ * report the blocks of each corrupted one.  Returns the number of corrupted
+ * chunks.
+ */
+int
+check_backup_chunks(pgBackupCopy *copy, const pgFile *file,
+					const char *rel_path)
+{
+	int			ncorrupted = 0;
+	int			i;
 
-			/* write data page excluding hole */
-			if(fwrite(write_buffer, 1, write_buffer_real_size, out) != write_buffer_real_size)
-			{
-				int errno_tmp = errno;
-				/* oops */
-				fclose(in);
-				fclose(out);
-				elog(ERROR, "cannot write at block %u of \"%s\": %s",
-					 blknum, to_path, strerror(errno_tmp));
-			}
+	/* the chunks must cover the whole file */
+	if (file->chunks[0].offset != 0)
+	{
+		elog(WARNING, "chunk hashes of backup file \"%s\" are broken", rel_path);
+		return 1;
+	}
 
-			/* update CRC */
-			COMP_CRC32C(crc, &header, sizeof(header));
-			COMP_CRC32C(crc, page.data, header.hole_offset);
-			COMP_CRC32C(crc, page.data + upper_offset, upper_length);
+	for (i = 0; i < file->nchunks; i++)
+	{
+		if (interrupted)
+			elog(ERROR, "interrupted during validate");
 
-			file->write_size += sizeof(header) + read_len - header.hole_length;
+		if (!check_backup_chunk(copy, file, i))
+		{
+			elog(WARNING, "blocks %u-%u of backup file \"%s\" are corrupted",
+				 file->chunks[i].chunk * CHUNK_HASH_BLOCKS,
+				 (file->chunks[i].chunk + 1) * CHUNK_HASH_BLOCKS - 1, rel_path);
+			ncorrupted++;
 		}
 	}
-	else
-	{
-		datapagemap_iterator_t *iter;
-		iter = datapagemap_iterate(&file->pagemap);
-		while (datapagemap_next(iter, &blknum))
-		{
-			XLogRecPtr	page_lsn;
-			int		upper_offset;
-			int		upper_length;
-			int 	ret;
-			int		try_checksum = 100;
-			bool	stop_backup = false;
-
-			offset = blknum * BLCKSZ;
-			while(try_checksum)
-			{
-				if (offset > 0)
-				{
-					ret = fseek(in, offset, SEEK_SET);
-					if (ret != 0)
-						elog(ERROR,
-							 "Can't seek in file offset: %llu ret:%i\n",
-							 (long long unsigned int) offset, ret);
-				}
-				read_len = fread(&page, 1, sizeof(page), in);
 
-				header.block = blknum;
+	return ncorrupted;
+}
 
-				try_checksum--;
+/*
+ * Deallocate block blknum of the file opened as fd, so that it reads as
+ * zeroes and takes no space.  Returns false if the file system can't punch
+ * holes.
+ */
+static bool
+punch_block(int fd, BlockNumber blknum, const char *to_path)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  (off_t) blknum * BLCKSZ, BLCKSZ) == 0)
+		return true;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		elog(ERROR, "cannot punch block %u of \"%s\": %s",
+			 blknum, to_path, strerror(errno));
+#endif
+	return false;
+}
 
-				/*
-				 * If an invalid data page was found, fallback to simple copy to ensure
-				 * all pages in the file don't have BackupPageHeader.
-				 */
-				if (!parse_page(&page, &page_lsn,
-								&header.hole_offset, &header.hole_length))
-				{
-					struct stat st;
-					int i;
-
-					for(i=0; i<BLCKSZ && page.data[i] == 0; i++);
-					if (i == BLCKSZ)
-					{
-						elog(LOG, "File: %s blknum %u, empty page", file->path, blknum);
-						goto end_checks2;
-					}
-
-					stat(file->path, &st);
-					elog(WARNING, "PTRACK SIZE: %lu %lu pages:%lu pages:%lu i:%i", file->size, st.st_size, file->size/BLCKSZ, st.st_size/BLCKSZ, i);
-					if (st.st_size != file->size && blknum >= file->size/BLCKSZ-1)
-					{
-						stop_backup = true;
-						elog(WARNING, "File: %s blknum %u, file size has changed before backup start", file->path, blknum);
-						break;
-					}
-					if (st.st_size != file->size && blknum < file->size/BLCKSZ-1)
-					{
-						elog(WARNING, "File: %s blknum %u, file size has changed before backup start, it seems bad", file->path, blknum);
-						if (!try_checksum)
-							break;
-					}
-					if (try_checksum)
-					{
-						elog(WARNING, "File: %s blknum %u have wrong page header, try again", file->path, blknum);
-						usleep(100);
-						fseek(in, -sizeof(page), SEEK_CUR);
-						fread(&page, 1, sizeof(page), in);
-						continue;
-					}
-					else
-						elog(ERROR, "File: %s blknum %u have wrong page header.", file->path, blknum);
-				}
+/*
+ * Clear blocks start_blk..end_blk-1 of an existing file updated by an
+ * incremental restore.  No backup of the chain holds them, so they must
+ * read as zeroes, but the file may still have old data there.  Blocks
+ * already all-zero or past its end are left alone.  Returns the number of
+ * blocks cleared.
+ */
+static BlockNumber
+clear_missing_blocks(int fd, BlockNumber start_blk, BlockNumber end_blk,
+					 const char *to_path)
+{
+	DataPage	page;
+	BlockNumber	blknum;
+	BlockNumber	ncleared = 0;
 
-				if(current.checksum_version &&
-				   pg_checksum_page(page.data, file->segno * RELSEG_SIZE + blknum) != ((PageHeader) page.data)->pd_checksum)
-				{
-					if (try_checksum)
-						elog(LOG, "File: %s blknum %u have wrong checksum, try again", file->path, blknum);
-					else
-						elog(ERROR, "File: %s blknum %u have wrong checksum.", file->path, blknum);
-				}
-				else
-				{
-					try_checksum = 0;
-				}
-			}
+	for (blknum = start_blk; blknum < end_blk; blknum++)
+	{
+		ssize_t		len = pread(fd, page.data, BLCKSZ, (off_t) blknum * BLCKSZ);
 
-			file->read_size += read_len;
+		if (len < 0)
+			elog(ERROR, "cannot read block %u of \"%s\": %s",
+				 blknum, to_path, strerror(errno));
+		if (len == 0)
+			break;
+		if (len == BLCKSZ && page_is_zero(page.data))
+			continue;
+
+		ncleared++;
+		if (punch_block(fd, blknum, to_path))
+			continue;
+		memset(page.data, 0, BLCKSZ);
+		if (pwrite(fd, page.data, BLCKSZ, (off_t) blknum * BLCKSZ) != BLCKSZ)
+			elog(ERROR, "cannot write block %u of \"%s\": %s",
+				 blknum, to_path, strerror(errno));
+	}
 
-			if(stop_backup)
-				break;
+	return ncleared;
+}
+
+/*
+ * Write the pages queued on the ring by restore_data_file().
+ */
+static void
+flush_restore_writes(pgIORing *ring, BlockNumber *blocks, int nqueued,
+					 const char *to_path)
+{
+	int			i;
 
-			end_checks2:
-			
-			upper_offset = header.hole_offset + header.hole_length;
-			upper_length = BLCKSZ - upper_offset;
+	if (nqueued == 0)
+		return;
 
-			write_buffer_real_size = sizeof(header)+header.hole_offset+upper_length;
-			memcpy(write_buffer, &header, sizeof(header));
-			if (header.hole_offset)
-				memcpy(write_buffer+sizeof(header), page.data, header.hole_offset);
-			if (upper_length)
-				memcpy(write_buffer+sizeof(header)+header.hole_offset, page.data + upper_offset, upper_length);
+	io_ring_wait(ring);
+	for (i = 0; i < nqueued; i++)
+	{
+		ssize_t		res = io_ring_result(ring, i);
 
-			/* write data page excluding hole */
-			if(fwrite(write_buffer, 1, write_buffer_real_size, out) != write_buffer_real_size)
-			{
-				int errno_tmp = errno;
-				/* oops */
-				fclose(in);
-				fclose(out);
-				elog(ERROR, "cannot write at block %u of \"%s\": %s",
-					 blknum, to_path, strerror(errno_tmp));
-			}
+		if (res != BLCKSZ)
+			elog(ERROR, "cannot write block %u of \"%s\": %s",
+				 blocks[i], to_path,
+				 res < 0 ? strerror(-res) : "short write");
+	}
+}
 
-			/* update CRC */
-			COMP_CRC32C(crc, &header, sizeof(header));
-			COMP_CRC32C(crc, page.data, header.hole_offset);
-			COMP_CRC32C(crc, page.data + upper_offset, upper_length);
+/*
+ * Version of a data file in one backup of the chain, read by
+ * restore_data_file().  Every backup file holds its pages in ascending
+ * block order, so the versions are merged by reading each of them once.
+ */
+typedef struct RestoreSource
+{
+	pgFileVersion *version;
+	pgBackupCopy *in;
+	bool		eof;
+	BackupPageHeader header;	/* header of the next page */
+	uint32		payload_size;	/* bytes stored for the next page */
+	int			chunk;			/* next chunk hash of the file to check */
+} RestoreSource;
+
+/*
+ * Read the header of the next page of src, or set src->eof.
+ */
+static void
+restore_read_header(RestoreSource *src)
+{
+	pgFile	   *file = src->version->file;
+	BlockNumber	prev_blk = src->header.block;
+	size_t		read_len;
+	uint32		raw_size;
 
-			file->write_size += sizeof(header) + read_len - header.hole_length;
+	read_len = backup_copy_read(src->in, &src->header, sizeof(src->header));
+	if (read_len != sizeof(src->header))
+	{
+		if (read_len == 0)
+		{
+			src->eof = true;	/* EOF found */
+			return;
 		}
-		pg_free(iter);
-		/*
-		 * If we have pagemap then file can't be a zero size.
-		 * Otherwise, we will clear the last file.
-		 * Increase read_size to delete after.
-		 */
-		if (file->read_size == 0)
-			file->read_size++;
+		elog(ERROR, "odd size page found after block %u of \"%s\"",
+			 prev_blk, file->path);
 	}
 
-	/*
-	 * update file permission
-	 * FIXME: Should set permission on open?
-	 */
-	if (!check && chmod(to_path, FILE_PERMISSION) == -1)
+	if ((prev_blk != InvalidBlockNumber && src->header.block <= prev_blk) ||
+		src->header.hole_offset > BLCKSZ ||
+		(int) src->header.hole_offset + (int) src->header.hole_length > BLCKSZ)
+		elog(ERROR, "backup is broken at block %u of \"%s\"",
+			 src->header.block, file->path);
+
+	raw_size = BLCKSZ - src->header.hole_length;
+	if (IsCompressedBackup(src->version->backup->compress_alg))
 	{
-		int errno_tmp = errno;
-		fclose(in);
-		fclose(out);
-		elog(ERROR, "cannot change mode of \"%s\": %s", file->path,
-			 strerror(errno_tmp));
+		if (backup_copy_read(src->in, &src->payload_size, sizeof(src->payload_size)) != sizeof(src->payload_size))
+			elog(ERROR, "cannot read block %u of \"%s\"",
+				 src->header.block, file->path);
+		if (src->payload_size > raw_size)
+			elog(ERROR, "backup is broken at block %u of \"%s\"",
+				 src->header.block, file->path);
 	}
+	else
+		src->payload_size = raw_size;
+}
 
-	fclose(in);
-	fclose(out);
+/*
+ * Skip the next page of src, a newer backup of the chain has it.
+ */
+static void
+restore_skip_page(RestoreSource *src)
+{
+	backup_copy_skip(src->in, src->payload_size);
+}
 
-	/* finish CRC calculation and store into pgFile */
-	FIN_CRC32C(crc);
-	file->crc = crc;
+/*
+ * Check the hash of the chunk of the next page of src, unless it was checked
+ * with a previous page.  Chunks whose pages are all taken from newer backups
+ * are never read.
+ */
+static void
+restore_check_chunk(RestoreSource *src)
+{
+	pgFile	   *file = src->version->file;
+	uint32		chunk = src->header.block / CHUNK_HASH_BLOCKS;
 
-	/* Treat empty file as not-datafile */
-	if (file->read_size == 0)
-		file->is_datafile = false;
+	while (src->chunk < file->nchunks && file->chunks[src->chunk].chunk < chunk)
+		src->chunk++;
+	if (src->chunk == file->nchunks || file->chunks[src->chunk].chunk != chunk)
+		return;
 
-	/* We do not backup if all pages skipped. */
-	if (file->write_size == 0 && file->read_size > 0)
+	if (!check_backup_chunk(src->in, file, src->chunk))
+		elog(ERROR, "blocks %u-%u of backup file \"%s\" are corrupted",
+			 chunk * CHUNK_HASH_BLOCKS, (chunk + 1) * CHUNK_HASH_BLOCKS - 1,
+			 file->path);
+	src->chunk++;
+}
+
+/*
+ * Read the next page of src into page, restoring the hole and the checksum.
+ */
+static void
+restore_read_page(RestoreSource *src, DataPage *page)
+{
+	BackupPageHeader *header = &src->header;
+	pgFile	   *file = src->version->file;
+	pgBackup   *backup = src->version->backup;
+	int			upper_offset = header->hole_offset + header->hole_length;
+	int			upper_length = BLCKSZ - upper_offset;
+	uint32		raw_size = header->hole_offset + upper_length;
+
+	/* read lower/upper into page->data and restore hole */
+	memset(page->data + header->hole_offset, 0, header->hole_length);
+
+	if (src->payload_size != raw_size)
 	{
-		if (remove(to_path) == -1)
-			elog(ERROR, "cannot remove file \"%s\": %s", to_path,
-				 strerror(errno));
-		return false;
+		char		compressed[COMPRESS_BUFFER_SIZE];
+		char		raw[BLCKSZ];
+
+		if (backup_copy_read(src->in, compressed, src->payload_size) != src->payload_size)
+			elog(ERROR, "cannot read block %u of \"%s\"",
+				 header->block, file->path);
+		if (do_decompress(raw, raw_size, compressed, src->payload_size,
+						  backup->compress_alg) != (int32) raw_size)
+			elog(ERROR, "cannot decompress block %u of \"%s\"",
+				 header->block, file->path);
+
+		memcpy(page->data, raw, header->hole_offset);
+		memcpy(page->data + upper_offset, raw + header->hole_offset,
+			   upper_length);
+	}
+	else if (backup_copy_read(src->in, page->data, header->hole_offset) != header->hole_offset ||
+			 backup_copy_read(src->in, page->data + upper_offset, upper_length) != upper_length)
+	{
+		elog(ERROR, "cannot read block %u of \"%s\"",
+			 header->block, file->path);
 	}
 
-	/* remove $BACKUP_PATH/tmp created during check */
-	if (check)
-		remove(to_path);
+	/* update checksum because we are not save whole */
+	if(backup->checksum_version)
+	{
+		/* skip calc checksum if zero page */
+		if (page->page_data.pd_upper == 0 && page_is_zero(page->data))
+			return;
+		pg_checksum_pages(page->data, 1,
+						  file->segno * RELSEG_SIZE + header->block,
+						  &page->page_data.pd_checksum);
+	}
+}
 
-	return true;
+/*
+ * Check whether the existing file at to_path already has the contents of
+ * file, which is a whole copy in the backup.
+ */
+static bool
+restored_file_is_unchanged(const char *to_path, pgFile *file)
+{
+	struct stat	st;
+	pgFile		existing;
+
+	if (stat(to_path, &st) == -1 || !S_ISREG(st.st_mode) ||
+		st.st_size != file->write_size)
+		return false;
+
+	existing.path = (char *) to_path;
+	return pgFileGetCRC(&existing) == file->crc;
 }
 
 /*
- * Restore files in the from_root directory to the to_root directory with
- * same relative path.
+ * Restore a file into the to_root directory from its versions in a chain of
+ * backups, newest first.  Each page is taken from the newest backup holding
+ * it, so the file is written once, in ascending block order, however long
+ * the chain is.  All-zero pages are not written, they are left as holes.
+ *
+ * In incremental restore an existing file is kept, and only the pages that
+ * differ from the restored ones are written.  Blocks that become all-zero
+ * pages, and blocks below the restored length that are in no backup, are
+ * punched out of it or zeroed.
  */
 void
-restore_data_file(const char *from_root,
-				  const char *to_root,
-				  pgFile *file,
-				  pgBackup *backup)
+restore_data_file(const char *to_root, pgFileVersion *versions, int nversions)
 {
 	char				to_path[MAXPGPATH];
-	FILE			   *in;
 	FILE			   *out;
-	BackupPageHeader	header;
-	BlockNumber			blknum;
-
-	/* If the file is not a datafile, just copy it. */
-	if (!file->is_datafile)
+	RestoreSource	   *sources;
+	BlockNumber			next_blk = 0;	/* block at the write position */
+	BlockNumber			nblocks = 0;	/* blocks of the restored file */
+	BlockNumber			restored_blocks;	/* up to the last restored block */
+	BlockNumber			newest_blocks = 0;	/* blocks in the newest version */
+	BlockNumber			nchanged = 0;
+	pgIORing		   *ring = NULL;
+	BlockNumber			queued_blocks[RESTORE_RING_PAGES];
+	int					nqueued = 0;
+	int					i;
+
+	join_path_components(to_path, to_root,
+						 versions[0].file->path + strlen(versions[0].root) + 1);
+
+	/* If the file is not a datafile, the newest version is a whole copy. */
+	if (!versions[0].file->is_datafile)
 	{
-		copy_file(from_root, to_root, file);
+		if (incremental_restore &&
+			restored_file_is_unchanged(to_path, versions[0].file))
+		{
+			elog(LOG, "unchanged, skip");
+			return;
+		}
+		copy_file(versions[0].root, to_root, versions[0].file);
 		return;
 	}
 
-	/* open backup mode file for read */
-	in = fopen(file->path, "r");
-	if (in == NULL)
+	/* open the backup files for read */
+	sources = pgut_malloc(sizeof(RestoreSource) * nversions);
+	for (i = 0; i < nversions; i++)
 	{
-		elog(ERROR, "cannot open backup file \"%s\": %s", file->path,
-			 strerror(errno));
+		RestoreSource *src = &sources[i];
+
+		src->version = &versions[i];
+		src->eof = false;
+		src->header.block = InvalidBlockNumber;
+		src->chunk = 0;
+		src->in = backup_copy_open(versions[i].file);
+		if (src->in == NULL)
+			elog(ERROR, "cannot open backup file \"%s\": %s",
+				 versions[i].file->path, strerror(errno));
+		restore_read_header(src);
 	}
 
 	/*
-	 * Open backup file for write. 	We use "r+" at first to overwrite only
-	 * modified pages for differential restore. If the file is not exists,
-	 * re-open it with "w" to create an empty file.
+	 * The destination was cleared unless the restore is incremental, in
+	 * which case an existing file is updated in place.
 	 */
-	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
-	out = fopen(to_path, "r+");
-	if (out == NULL && errno == ENOENT)
+	out = NULL;
+	if (incremental_restore)
+		out = fopen(to_path, "r+");
+	if (out == NULL && (!incremental_restore || errno == ENOENT))
 		out = fopen(to_path, "w");
 	if (out == NULL)
-	{
-		int errno_tmp = errno;
-		fclose(in);
 		elog(ERROR, "cannot open restore target file \"%s\": %s",
-			 to_path, strerror(errno_tmp));
-	}
+			 to_path, strerror(errno));
+
+	/*
+	 * With io_uring the pages are restored directly into the buffers of the
+	 * ring and written in batches.
+	 */
+	if (io_engine == IO_ENGINE_IO_URING)
+		ring = io_ring_get(RESTORE_RING_PAGES, BLCKSZ);
 
-	for (blknum = 0; ; blknum++)
+	for (;;)
 	{
-		size_t		read_len;
-		DataPage	page;		/* used as read buffer */
-		int			upper_offset;
-		int			upper_length;
+		DataPage	local_page;
+		DataPage   *page = &local_page;
+		RestoreSource *newest = NULL;
+		BlockNumber	blknum;
 
-		/* read BackupPageHeader */
-		read_len = fread(&header, 1, sizeof(header), in);
-		if (read_len != sizeof(header))
+		/* the lowest next block, from the newest backup on ties */
+		for (i = 0; i < nversions; i++)
 		{
-			int errno_tmp = errno;
-			if (read_len == 0 && feof(in))
-				break;		/* EOF found */
-			else if (read_len != 0 && feof(in))
-			{
-				elog(ERROR,
-					 "odd size page found at block %u of \"%s\"",
-					 blknum, file->path);
-			}
-			else
-			{
-				elog(ERROR, "cannot read block %u of \"%s\": %s",
-					 blknum, file->path, strerror(errno_tmp));
-			}
+			if (!sources[i].eof &&
+				(newest == NULL || sources[i].header.block < newest->header.block))
+				newest = &sources[i];
 		}
+		if (newest == NULL)
+			break;
+		blknum = newest->header.block;
 
-		if (header.block < blknum || header.hole_offset > BLCKSZ ||
-			(int) header.hole_offset + (int) header.hole_length > BLCKSZ)
+		/* the blocks skipped over are in no backup */
+		if (incremental_restore && blknum > nblocks)
+			nchanged += clear_missing_blocks(fileno(out), nblocks, blknum,
+											 to_path);
+
+		/* older versions of the page are not needed */
+		for (i = newest - sources + 1; i < nversions; i++)
 		{
-			elog(ERROR, "backup is broken at block %u",
-				 blknum);
+			if (!sources[i].eof && sources[i].header.block == blknum)
+			{
+				restore_skip_page(&sources[i]);
+				restore_read_header(&sources[i]);
+			}
 		}
 
-		upper_offset = header.hole_offset + header.hole_length;
-		upper_length = BLCKSZ - upper_offset;
-
-		/* read lower/upper into page.data and restore hole */
-		memset(page.data + header.hole_offset, 0, header.hole_length);
+		if (ring != NULL)
+			page = (DataPage *) io_ring_buffer(ring, nqueued);
+		restore_check_chunk(newest);
+		restore_read_page(newest, page);
+		restore_read_header(newest);
+		nblocks = blknum + 1;
+		if (newest == &sources[0])
+			newest_blocks = nblocks;
 
-		if (fread(page.data, 1, header.hole_offset, in) != header.hole_offset ||
-			fread(page.data + upper_offset, 1, upper_length, in) != upper_length)
+		/*
+		 * Skip a page that is already there.  Pages are written in ascending
+		 * order, so no buffered write covers this block yet and it can be
+		 * read at the descriptor.
+		 */
+		if (incremental_restore)
 		{
-			elog(ERROR, "cannot read block %u of \"%s\": %s",
-				 blknum, file->path, strerror(errno));
+			DataPage	existing;
+
+			if (pread(fileno(out), existing.data, BLCKSZ,
+					  (off_t) blknum * BLCKSZ) == BLCKSZ &&
+				memcmp(existing.data, page->data, BLCKSZ) == 0)
+				continue;
 		}
+		nchanged++;
+
+		/*
+		 * A new file has a hole wherever nothing is written, an existing
+		 * one gets it punched.  The size is set once all pages are done.
+		 */
+		if (page->page_data.pd_upper == 0 && page_is_zero(page->data) &&
+			(!incremental_restore || punch_block(fileno(out), blknum, to_path)))
+			continue;
 
-		/* update checksum because we are not save whole */
-		if(backup->checksum_version)
+		if (ring != NULL)
 		{
-			/* skip calc checksum if zero page */
-			if(page.page_data.pd_upper == 0)
+			io_ring_write(ring, nqueued, fileno(out), (off_t) blknum * BLCKSZ,
+						  BLCKSZ);
+			queued_blocks[nqueued++] = blknum;
+			if (nqueued == RESTORE_RING_PAGES)
 			{
-				int i;
-				for(i=0; i<BLCKSZ && page.data[i] == 0; i++);
-				if (i == BLCKSZ)
-					goto skip_checksum;
+				flush_restore_writes(ring, queued_blocks, nqueued, to_path);
+				nqueued = 0;
 			}
-			((PageHeader) page.data)->pd_checksum = pg_checksum_page(page.data, file->segno * RELSEG_SIZE + header.block);
+			continue;
 		}
 
-		skip_checksum:
-
-		/*
-		 * Seek and write the restored page. Backup might have holes in
-		 * differential backups.
-		 */
-		blknum = header.block;
-		if (fseek(out, blknum * BLCKSZ, SEEK_SET) < 0)
+		/* seek only over blocks that are in no backup */
+		if (blknum != next_blk &&
+			fseeko(out, (off_t) blknum * BLCKSZ, SEEK_SET) < 0)
 			elog(ERROR, "cannot seek block %u of \"%s\": %s",
 				 blknum, to_path, strerror(errno));
-		if (fwrite(page.data, 1, sizeof(page), out) != sizeof(page))
+		if (fwrite(page->data, 1, BLCKSZ, out) != BLCKSZ)
 			elog(ERROR, "cannot write block %u of \"%s\": %s",
-				 blknum, file->path, strerror(errno));
+				 blknum, to_path, strerror(errno));
+		next_blk = blknum + 1;
 	}
 
-	/* update file permission */
-	if (chmod(to_path, file->mode) == -1)
-	{
-		int errno_tmp = errno;
+	if (ring != NULL)
+		flush_restore_writes(ring, queued_blocks, nqueued, to_path);
 
-		fclose(in);
-		fclose(out);
+	/*
+	 * The file had the size recorded by the newest backup, older versions
+	 * may hold blocks it was truncated off since.  Pages copied while the
+	 * file grew are kept.  Without a recorded size the file ends at the
+	 * last restored block.
+	 */
+	restored_blocks = nblocks;
+	if (versions[0].file->size != BYTES_INVALID)
+		nblocks = Max((BlockNumber) (versions[0].file->size / BLCKSZ),
+					  newest_blocks);
+	if (incremental_restore && nblocks > restored_blocks)
+		nchanged += clear_missing_blocks(fileno(out), restored_blocks,
+										 nblocks, to_path);
+
+	/*
+	 * Extend the file over trailing holes, and drop the blocks of an
+	 * existing file that are beyond the backup.
+	 */
+	if (fflush(out) != 0 ||
+		ftruncate(fileno(out), (off_t) nblocks * BLCKSZ) != 0)
+		elog(ERROR, "cannot truncate \"%s\": %s", to_path,
+			 strerror(errno));
+	if (incremental_restore)
+		elog(LOG, "%u of %u pages changed", nchanged, nblocks);
+
+	/* update file permission */
+	if (chmod(to_path, versions[0].file->mode) == -1)
 		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
-			 strerror(errno_tmp));
-	}
+			 strerror(errno));
 
-	fclose(in);
+	for (i = 0; i < nversions; i++)
+		backup_copy_close(sources[i].in);
+	pg_free(sources);
 	fclose(out);
 }
 
+/*
+ * Find the next extent of data of the file opened as fd, at or after
+ * *offset.  The start of the extent is stored in *offset, its end is
+ * returned, or -1 if there is no data after *offset.  Without SEEK_DATA the
+ * rest of the file is one extent, ending at EXTENT_TO_EOF.
+ */
+#define EXTENT_TO_EOF	((off_t) PG_INT64_MAX)
+
+static off_t
+next_data_extent(int fd, off_t *offset, const char *path)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off_t		data;
+	off_t		hole = -1;
+
+	data = lseek(fd, *offset, SEEK_DATA);
+	if (data == -1 && errno == ENXIO)
+		return -1;
+	if (data != -1)
+		hole = lseek(fd, data, SEEK_HOLE);
+	if (data == -1 || hole == -1)
+	{
+		/* the file system doesn't know holes */
+		if (errno == EINVAL || errno == EOPNOTSUPP)
+			return (lseek(fd, *offset, SEEK_SET) == -1) ? -1 : EXTENT_TO_EOF;
+		elog(ERROR, "cannot seek \"%s\": %s", path, strerror(errno));
+	}
+	if (lseek(fd, data, SEEK_SET) == -1)
+		elog(ERROR, "cannot seek \"%s\": %s", path, strerror(errno));
+
+	*offset = data;
+	return hole;
+#else
+	return EXTENT_TO_EOF;
+#endif
+}
+
+/* add len zero bytes to crc */
+static void
+comp_crc32c_zeroes(pg_crc32 *crc, off_t len)
+{
+	static const char zeroes[COPY_BUFFER_SIZE];
+
+	while (len > 0)
+	{
+		size_t		n = Min(len, (off_t) sizeof(zeroes));
+
+		COMP_CRC32C(*crc, zeroes, n);
+		len -= n;
+	}
+}
+
+/*
+ * Copy a file, which isn't a data file or is a whole copy of one in a
+ * backup, keeping its holes: only the extents of data are read, and
+ * skipped over in the destination.
+ */
 bool
 copy_file(const char *from_root, const char *to_root, pgFile *file)
 {
 	char		to_path[MAXPGPATH];
-	FILE	   *in;
+	int			in;
 	FILE	   *out;
-	size_t		read_len = 0;
+	ssize_t		read_len = 0;
+	off_t		offset = 0;
 	int			errno_tmp;
-	char		buf[8192];
+	off_t		extent_end;
+	char	   *buf;
 	struct stat	st;
 	pg_crc32	crc;
+	ReadMode	mode;
 
 	INIT_CRC32C(crc);
 
@@ -571,8 +2020,8 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 	file->write_size = 0;
 
 	/* open backup mode file for read */
-	in = fopen(file->path, "r");
-	if (in == NULL)
+	in = open_source_file(file->path, &mode);
+	if (in < 0)
 	{
 		FIN_CRC32C(crc);
 		file->crc = crc;
@@ -594,68 +2043,89 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 	if (out == NULL)
 	{
 		int errno_tmp = errno;
-		fclose(in);
+		close(in);
 		elog(ERROR, "cannot open destination file \"%s\": %s",
 			 to_path, strerror(errno_tmp));
 	}
 
 	/* stat source file to change mode of destination file */
-	if (fstat(fileno(in), &st) == -1)
+	if (fstat(in, &st) == -1)
 	{
-		fclose(in);
+		close(in);
 		fclose(out);
 		elog(ERROR, "cannot stat \"%s\": %s", file->path,
 			 strerror(errno));
 	}
 
-	/* copy content and calc CRC */
-	for (;;)
+	buf = alloc_read_buffer(COPY_BUFFER_SIZE);
+
+	/* copy the extents of data and calc CRC, holes read as zeroes */
+	while ((extent_end = next_data_extent(in, &offset, file->path)) != -1)
 	{
-		if ((read_len = fread(buf, 1, sizeof(buf), in)) != sizeof(buf))
-			break;
+		off_t		hole_start = file->write_size;
 
-		if (fwrite(buf, 1, read_len, out) != read_len)
+		if (offset > hole_start)
 		{
-			errno_tmp = errno;
-			/* oops */
-			fclose(in);
-			fclose(out);
-			elog(ERROR, "cannot write to \"%s\": %s", to_path,
-				 strerror(errno_tmp));
+			if (fseeko(out, offset, SEEK_SET) != 0)
+				elog(ERROR, "cannot seek \"%s\": %s", to_path,
+					 strerror(errno));
+			comp_crc32c_zeroes(&crc, offset - hole_start);
+			file->write_size = offset;
 		}
-		/* update CRC */
-		COMP_CRC32C(crc, buf, read_len);
 
-		file->write_size += sizeof(buf);
-		file->read_size += sizeof(buf);
-	}
+		/* O_DIRECT reads whole aligned blocks, the last one may be short */
+		while (offset < extent_end &&
+			   (read_len = read_source(in, buf,
+									   TYPEALIGN(READ_BUFFER_ALIGN,
+												 Min(COPY_BUFFER_SIZE,
+													 extent_end - offset)))) > 0)
+		{
+			throttle_read(read_len);
+			throttle_write(read_len);
+			if (fwrite(buf, 1, read_len, out) != read_len)
+			{
+				errno_tmp = errno;
+				/* oops */
+				close(in);
+				fclose(out);
+				elog(ERROR, "cannot write to \"%s\": %s", to_path,
+					 strerror(errno_tmp));
+			}
+			/* update CRC */
+			COMP_CRC32C(crc, buf, read_len);
+			release_source_pages(in, mode, offset, read_len);
+			offset += read_len;
 
-	errno_tmp = errno;
-	if (!feof(in))
-	{
-		fclose(in);
-		fclose(out);
-		elog(ERROR, "cannot read backup mode file \"%s\": %s",
-			 file->path, strerror(errno_tmp));
-	}
+			file->write_size += read_len;
+			file->read_size += read_len;
+		}
 
-	/* copy odd part. */
-	if (read_len > 0)
-	{
-		if (fwrite(buf, 1, read_len, out) != read_len)
+		if (read_len < 0)
 		{
 			errno_tmp = errno;
-			/* oops */
-			fclose(in);
+			close(in);
 			fclose(out);
-			elog(ERROR, "cannot write to \"%s\": %s", to_path,
-				 strerror(errno_tmp));
+			elog(ERROR, "cannot read backup mode file \"%s\": %s",
+				 file->path, strerror(errno_tmp));
 		}
-		/* update CRC */
-		COMP_CRC32C(crc, buf, read_len);
 
-		file->write_size += read_len;
-		file->read_size += read_len;
+		/* the file ends here, maybe truncated while being copied */
+		if (offset < extent_end)
+			break;
+	}
+	free(buf);
+
+	/* a hole at the end of the file */
+	if (fstat(in, &st) == -1)
+		elog(ERROR, "cannot stat \"%s\": %s", file->path, strerror(errno));
+	if (st.st_size > (off_t) file->write_size)
+	{
+		comp_crc32c_zeroes(&crc, st.st_size - file->write_size);
+		file->write_size = st.st_size;
+		if (fflush(out) != 0 ||
+			ftruncate(fileno(out), st.st_size) != 0)
+			elog(ERROR, "cannot extend \"%s\": %s", to_path,
+				 strerror(errno));
 	}
 
 	/* finish CRC calculation and store into pgFile */
@@ -666,13 +2136,13 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 	if (chmod(to_path, st.st_mode) == -1)
 	{
 		errno_tmp = errno;
-		fclose(in);
+		close(in);
 		fclose(out);
 		elog(ERROR, "cannot change mode of \"%s\": %s", to_path,
 			 strerror(errno_tmp));
 	}
 
-	fclose(in);
+	close(in);
 	fclose(out);
 
 	if (check)
@@ -684,12 +2154,13 @@ copy_file(const char *from_root, const char *to_root, pgFile *file)
 bool
 calc_file(pgFile *file)
 {
-	FILE	   *in;
-	size_t		read_len = 0;
+	int			in;
+	ssize_t		read_len = 0;
+	off_t		offset = 0;
 	int			errno_tmp;
-	char		buf[8192];
-	struct stat	st;
+	char	   *buf;
 	pg_crc32	crc;
+	ReadMode	mode;
 
 	INIT_CRC32C(crc);
 
@@ -698,8 +2169,8 @@ calc_file(pgFile *file)
 	file->write_size = 0;
 
 	/* open backup mode file for read */
-	in = fopen(file->path, "r");
-	if (in == NULL)
+	in = open_source_file(file->path, &mode);
+	if (in < 0)
 	{
 		FIN_CRC32C(crc);
 		file->crc = crc;
@@ -712,41 +2183,35 @@ calc_file(pgFile *file)
 			 strerror(errno));
 	}
 
-	/* stat source file to change mode of destination file */
-	if (fstat(fileno(in), &st) == -1)
-	{
-		fclose(in);
-		elog(ERROR, "cannot stat \"%s\": %s", file->path,
-			 strerror(errno));
-	}
+	buf = alloc_read_buffer(COPY_BUFFER_SIZE);
 
-	for (;;)
+	while ((read_len = read_source(in, buf, COPY_BUFFER_SIZE)) > 0)
 	{
-		read_len = fread(buf, 1, sizeof(buf), in);
-
-		if(read_len == 0)
-			break;
+		throttle_read(read_len);
 
 		/* update CRC */
 		COMP_CRC32C(crc, buf, read_len);
+		release_source_pages(in, mode, offset, read_len);
+		offset += read_len;
 
 		file->write_size += read_len;
 		file->read_size += read_len;
 	}
 
-	errno_tmp = errno;
-	if (!feof(in))
+	if (read_len < 0)
 	{
-		fclose(in);
+		errno_tmp = errno;
+		close(in);
 		elog(ERROR, "cannot read backup mode file \"%s\": %s",
 			 file->path, strerror(errno_tmp));
 	}
+	free(buf);
 
 	/* finish CRC calculation and store into pgFile */
 	FIN_CRC32C(crc);
 	file->crc = crc;
 
-	fclose(in);
+	close(in);
 
 	return true;
 }
@@ -70,7 +70,8 @@ found_backup:
 		if (backup->backup_mode >= BACKUP_MODE_FULL)
 			break;
 		if ((backup->status == BACKUP_STATUS_OK || backup->status == BACKUP_STATUS_CORRUPT) &&
-			(backup->backup_mode == BACKUP_MODE_DIFF_PAGE || backup->backup_mode == BACKUP_MODE_DIFF_PTRACK)
+			(backup->backup_mode == BACKUP_MODE_DIFF_PAGE || backup->backup_mode == BACKUP_MODE_DIFF_PTRACK ||
+			 backup->backup_mode == BACKUP_MODE_DIFF_DELTA)
 		)
 			pgBackupDeleteFiles(backup);
 	}
@@ -192,6 +193,13 @@ int do_deletewal(time_t backup_id, bool strict)
 					if (verbose)
 						elog(LOG, "removed WAL segment \"%s\"", wal_file);
 
+					/* summary of the segment is useless without it */
+					snprintf(wal_file, MAXPGPATH, "%s/%s/%s",
+							 arclog_path, WAL_SUMMARY_DIR, arcde->d_name);
+					if (unlink(wal_file) != 0 && errno != ENOENT)
+						elog(WARNING, "could not remove file \"%s\": %s",
+							 wal_file, strerror(errno));
+
 					if (max_wal_file[0] == '\0' ||
 						strcmp(max_wal_file + 8, arcde->d_name + 8) < 0)
 					{
@@ -9,7 +9,9 @@
 
 #include "pg_probackup.h"
 
+#include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -34,6 +36,8 @@ const char *pgdata_exclude[] =
 
 pgFile *pgFileNew(const char *path, bool omit_symlink);
 static int BlackListCompare(const void *str1, const void *str2);
+static void dir_list_tree(parray *files, const char *root, const char *exclude[],
+						  bool omit_symlink, bool add_root, bool dirs_only);
 
 /* create directory, also create parent directories if necessary */
 int
@@ -61,6 +65,80 @@ dir_create_dir(const char *dir, mode_t mode)
 	return 0;
 }
 
+/*
+ * Allocate a pgFile with room for a path of path_len bytes.  In a phase
+ * with a file arena the path is stored right after the entry.
+ */
+pgFile *
+pgFileAlloc(size_t path_len)
+{
+	pgFile		   *file;
+
+	if (file_arena)
+	{
+		file = (pgFile *) arena_alloc(file_arena,
+									  MAXALIGN(sizeof(pgFile)) + path_len + 1);
+		file->path = (char *) file + MAXALIGN(sizeof(pgFile));
+		file->in_arena = true;
+	}
+	else
+	{
+		file = (pgFile *) pgut_malloc(sizeof(pgFile));
+		file->path = pgut_malloc(path_len + 1);
+		file->in_arena = false;
+	}
+
+	file->mtime = 0;
+	file->mtime_nsec = 0;
+	file->size = 0;
+	file->read_size = 0;
+	file->write_size = 0;
+	file->mode = 0;
+	file->crc = 0;
+	file->chunks = NULL;
+	file->nchunks = 0;
+	file->nparts = 0;
+	file->is_datafile = false;
+	file->is_whole = false;
+	file->linked = NULL;
+	file->pagemap.bitmap = NULL;
+	file->pagemap.bitmapsize = 0;
+	file->ptrack_path = NULL;
+	file->segno = 0;
+	file->tblspcOid = InvalidOid;
+	file->dbOid = InvalidOid;
+	file->relOid = InvalidOid;
+	file->forkNum = InvalidForkNumber;
+	file->path[0] = '\0';
+
+	return file;
+}
+
+/* copy str into the storage of file */
+char *
+pgFileStrdup(pgFile *file, const char *str)
+{
+	char	   *copy;
+
+	if (!file->in_arena)
+		return pgut_strdup(str);
+
+	copy = arena_alloc(file_arena, strlen(str) + 1);
+	strcpy(copy, str);
+	return copy;
+}
+
+/* replace the path of file */
+void
+pgFileSetPath(pgFile *file, const char *path)
+{
+	char	   *old = file->path;
+
+	file->path = pgFileStrdup(file, path);
+	if (!file->in_arena)
+		free(old);
+}
+
 pgFile *
 pgFileNew(const char *path, bool omit_symlink)
 {
@@ -77,21 +155,12 @@ pgFileNew(const char *path, bool omit_symlink)
 			strerror(errno));
 	}
 
-	file = (pgFile *) pgut_malloc(sizeof(pgFile));
+	file = pgFileAlloc(strlen(path));
 
 	file->mtime = st.st_mtime;
+	file->mtime_nsec = st.st_mtim.tv_nsec;
 	file->size = st.st_size;
-	file->read_size = 0;
-	file->write_size = 0;
 	file->mode = st.st_mode;
-	file->crc = 0;
-	file->is_datafile = false;
-	file->linked = NULL;
-	file->pagemap.bitmap = NULL;
-	file->pagemap.bitmapsize = 0;
-	file->ptrack_path = NULL;
-	file->segno = 0;
-	file->path = pgut_malloc(strlen(path) + 1);
 	strcpy(file->path, path);		/* enough buffer size guaranteed */
 
 	return file;
@@ -170,10 +239,16 @@ pgFileFree(void *file)
 {
 	if (file == NULL)
 		return;
-	free(((pgFile *)file)->linked);
-	free(((pgFile *)file)->path);
 	if (((pgFile *)file)->ptrack_path != NULL)
 		free(((pgFile *)file)->ptrack_path);
+	free(((pgFile *)file)->chunks);
+
+	/* the rest is released with the arena */
+	if (((pgFile *)file)->in_arena)
+		return;
+
+	free(((pgFile *)file)->linked);
+	free(((pgFile *)file)->path);
 	free(file);
 }
 
@@ -194,6 +269,52 @@ pgFileComparePathDesc(const void *f1, const void *f2)
 	return -pgFileComparePath(f1, f2);
 }
 
+/* Hash of the path of a pgFile, to index a list by pgFileComparePath. */
+uint32
+pgFileHashPath(const void *f)
+{
+	return parray_hash_string(((const pgFile *) f)->path);
+}
+
+/*
+ * Hash of the relation identity and segment number of a data file, to index
+ * a list by pgFileCompareRelation.
+ */
+uint32
+pgFileHashRelation(const void *f)
+{
+	const pgFile *file = (const pgFile *) f;
+	uint32		key[5];
+
+	key[0] = file->tblspcOid;
+	key[1] = file->dbOid;
+	key[2] = file->relOid;
+	key[3] = (uint32) file->forkNum;
+	key[4] = (uint32) file->segno;
+
+	return parray_hash_bytes(key, sizeof(key));
+}
+
+/* Compare two pgFile with their relation identity and segment number. */
+int
+pgFileCompareRelation(const void *f1, const void *f2)
+{
+	pgFile *f1p = *(pgFile **)f1;
+	pgFile *f2p = *(pgFile **)f2;
+
+	if (f1p->tblspcOid != f2p->tblspcOid)
+		return f1p->tblspcOid < f2p->tblspcOid ? -1 : 1;
+	if (f1p->dbOid != f2p->dbOid)
+		return f1p->dbOid < f2p->dbOid ? -1 : 1;
+	if (f1p->relOid != f2p->relOid)
+		return f1p->relOid < f2p->relOid ? -1 : 1;
+	if (f1p->forkNum != f2p->forkNum)
+		return f1p->forkNum < f2p->forkNum ? -1 : 1;
+	if (f1p->segno != f2p->segno)
+		return f1p->segno < f2p->segno ? -1 : 1;
+	return 0;
+}
+
 /* Compare two pgFile with their size */
 int
 pgFileCompareSize(const void *f1, const void *f2)
@@ -209,6 +330,24 @@ pgFileCompareSize(const void *f1, const void *f2)
 		return 0;
 }
 
+/*
+ * Compare two pgFile with the size of their backup copy in descending order,
+ * used to hand out the largest files first.
+ */
+int
+pgFileCompareWriteSizeDesc(const void *f1, const void *f2)
+{
+	pgFile *f1p = *(pgFile **)f1;
+	pgFile *f2p = *(pgFile **)f2;
+
+	if (f1p->write_size > f2p->write_size)
+		return -1;
+	else if (f1p->write_size < f2p->write_size)
+		return 1;
+	else
+		return 0;
+}
+
 /* Compare two pgFile with their modify timestamp. */
 int
 pgFileCompareMtime(const void *f1, const void *f2)
@@ -238,73 +377,76 @@ BlackListCompare(const void *str1, const void *str2)
 }
 
 /*
- * List files, symbolic links and directories in the directory "root" and add
- * pgFile objects to "files".  We add "root" to "files" if add_root is true.
- *
- * If the sub-directory name is in "exclude" list, the sub-directory itself is
- * listed but the contents of the sub-directory is ignored.
- *
- * When omit_symlink is true, symbolic link is ignored and only file or
- * directory llnked to will be listed.
+ * State of a directory walk shared by the listing threads.  Directories found
+ * are queued and taken by whichever thread is idle; the walk is over when
+ * the queue is empty and no thread is listing a directory.
  */
-void
-dir_list_file(parray *files, const char *root, const char *exclude[], bool omit_symlink, bool add_root)
+typedef struct
 {
-	char path[MAXPGPATH];
-	char buf[MAXPGPATH * 2];
-	char black_item[MAXPGPATH * 2];
-	parray *black_list = NULL;
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;
+	parray	   *queue;			/* absolute paths of directories to list */
+	int			busy;			/* threads listing a directory */
+	parray	   *files;			/* result */
+	const char **exclude;
+	bool		omit_symlink;
+	bool		dirs_only;		/* skip regular files without stat */
+	parray	   *black_list;
+} DirWalk;
 
-	join_path_components(path, backup_path, PG_BLACK_LIST);
-	if (root && pgdata && strcmp(root, pgdata) == 0 &&
-	    fileExists(path))
+/*
+ * Is the directory excluded?  If the item in the exclude list starts with
+ * '/', compare to the absolute path of the directory. Otherwise compare to
+ * the directory name portion.
+ */
+static bool
+dir_is_excluded(const char *path, const char *exclude[])
+{
+	const char *dirname;
+	int			i;
+
+	dirname = strrchr(path, '/');
+	if (dirname == NULL)
+		dirname = path;
+	else
+		dirname++;
+
+	for (i = 0; exclude && exclude[i]; i++)
 	{
-		FILE *black_list_file = NULL;
-		black_list = parray_new();
-		black_list_file = fopen(path, "r");
-		if (black_list_file == NULL)
-			elog(ERROR, "cannot open black_list: %s",
-				strerror(errno));
-		while (fgets(buf, lengthof(buf), black_list_file) != NULL)
+		if (exclude[i][0] == '/')
 		{
-			join_path_components(black_item, pgdata, buf);
-			if (black_item[strlen(black_item) - 1] == '\n')
-				black_item[strlen(black_item) - 1] = '\0';
-			if (black_item[0] == '#' || black_item[0] == '\0')
-				continue;
-			parray_append(black_list, black_item);
+			if (strcmp(path, exclude[i]) == 0)
+				return true;
+		}
+		else
+		{
+			if (strcmp(dirname, exclude[i]) == 0)
+				return true;
 		}
-		fclose(black_list_file);
-		parray_qsort(black_list, BlackListCompare);
-		dir_list_file_internal(files, root, exclude, omit_symlink, add_root, black_list);
-		parray_qsort(files, pgFileComparePath);
-	}
-	else
-	{
-		dir_list_file_internal(files, root, exclude, omit_symlink, add_root, NULL);
-		parray_qsort(files, pgFileComparePath);
 	}
+	return false;
 }
 
-void
-dir_list_file_internal(parray *files, const char *root, const char *exclude[],
-			bool omit_symlink, bool add_root, parray *black_list)
+/*
+ * Add a stat'ed entry to out, following its symbolic link chain, and queue
+ * it for listing if it is a directory.  The entry itself is added only if
+ * add is true.
+ */
+static void
+dir_walk_add(DirWalk *walk, pgFile *file, bool add, parray *out)
 {
-	pgFile *file;
-
-	file = pgFileNew(root, omit_symlink);
-	if (file == NULL)
-		return;
+	pgFile	   *entry = file;
 
 	/* skip if the file is in black_list defined by user */
-	if (black_list && parray_bsearch(black_list, root, BlackListCompare))
+	if (walk->black_list &&
+		parray_bsearch(walk->black_list, file->path, BlackListCompare))
 	{
-		/* found in black_list. skip this item */
+		pgFileFree(file);
 		return;
 	}
 
-	if (add_root)
-		parray_append(files, file);
+	if (add)
+		parray_append(out, file);
 
 	/* chase symbolic link chain and find regular file or directory */
 	while (S_ISLNK(file->mode))
@@ -321,7 +463,7 @@ dir_list_file_internal(parray *files, const char *root, const char *exclude[],
 				 file->path);
 
 		linked[len] = '\0';
-		file->linked = pgut_strdup(linked);
+		file->linked = pgFileStrdup(file, linked);
 
 		/* make absolute path to read linked file */
 		if (linked[0] != '/')
@@ -331,101 +473,274 @@ dir_list_file_internal(parray *files, const char *root, const char *exclude[],
 
 			strncpy(dname, file->path, lengthof(dname));
 			join_path_components(absolute, dname, linked);
-			file = pgFileNew(absolute, omit_symlink);
+			file = pgFileNew(absolute, walk->omit_symlink);
 		}
 		else
-			file = pgFileNew(file->linked, omit_symlink);
+			file = pgFileNew(file->linked, walk->omit_symlink);
 
 		/* linked file is not found, stop following link chain */
 		if (file == NULL)
-			return;
+			break;
 
-		parray_append(files, file);
+		parray_append(out, file);
 	}
 
 	/*
-	 * If the entry was a directory, add it to the list and add call this
-	 * function recursivelly.
-	 * If the directory name is in the exclude list, do not list the contents.
+	 * If the entry is a directory, queue it for listing unless its name is
+	 * in the exclude list.
 	 */
-	while (S_ISDIR(file->mode))
+	if (file && S_ISDIR(file->mode) &&
+		!dir_is_excluded(file->path, walk->exclude))
 	{
-		int				i;
-		bool			skip = false;
-		DIR			    *dir;
-		struct dirent   *dent;
-		char		    *dirname;
-
-		/* skip entry which matches exclude list */
-	   	dirname = strrchr(file->path, '/');
-		if (dirname == NULL)
-			dirname = file->path;
-		else
-			dirname++;
-
-		/*
-		 * If the item in the exclude list starts with '/', compare to the
-		 * absolute path of the directory. Otherwise compare to the directory
-		 * name portion.
-		 */
-		for (i = 0; exclude && exclude[i]; i++)
-		{
-			if (exclude[i][0] == '/')
-			{
-				if (strcmp(file->path, exclude[i]) == 0)
-				{
-					skip = true;
-					break;
-				}
-			}
-			else
-			{
-				if (strcmp(dirname, exclude[i]) == 0)
-				{
-					skip = true;
-					break;
-				}
-			}
-		}
-		if (skip)
-			break;
+		char	   *path = pgut_strdup(file->path);
+
+		pthread_mutex_lock(&walk->lock);
+		parray_append(walk->queue, path);
+		pthread_cond_signal(&walk->cond);
+		pthread_mutex_unlock(&walk->lock);
+	}
+
+	if (!add)
+		pgFileFree(entry);
+}
+
+/*
+ * List the contents of one directory.  Entries are stat'ed relative to the
+ * directory, once each; with dirs_only the type in the directory entry is
+ * enough to skip regular files.
+ */
+static void
+dir_walk_list(DirWalk *walk, const char *path)
+{
+	DIR		   *dir;
+	struct dirent *dent;
+	parray	   *out;
+	int			dir_fd;
+	int			flags = walk->omit_symlink ? 0 : AT_SYMLINK_NOFOLLOW;
+
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		/* maybe the direcotry was removed */
+		if (errno == ENOENT)
+			return;
+		elog(ERROR, "cannot open directory \"%s\": %s",
+			path, strerror(errno));
+	}
+	dir_fd = dirfd(dir);
+
+	out = parray_new();
+	errno = 0;
+	while ((dent = readdir(dir)))
+	{
+		struct stat	st;
+		pgFile	   *file;
+		size_t		path_len;
+
+		/* skip entries point current dir or parent dir */
+		if (strcmp(dent->d_name, ".") == 0 ||
+			strcmp(dent->d_name, "..") == 0)
+			continue;
 
-		/* open directory and list contents */
-		dir = opendir(file->path);
-		if (dir == NULL)
+#ifdef _DIRENT_HAVE_D_TYPE
+		if (walk->dirs_only && dent->d_type == DT_REG)
+			continue;
+#endif
+
+		if (fstatat(dir_fd, dent->d_name, &st, flags) == -1)
 		{
+			/* file not found is not an error case */
 			if (errno == ENOENT)
 			{
-				/* maybe the direcotry was removed */
-				return;
+				errno = 0;
+				continue;
 			}
-			elog(ERROR, "cannot open directory \"%s\": %s",
-				file->path, strerror(errno));
+			elog(ERROR, "cannot stat file \"%s/%s\": %s", path, dent->d_name,
+				strerror(errno));
 		}
 
+		if (walk->dirs_only && S_ISREG(st.st_mode))
+			continue;
+
+		path_len = strlen(path) + 1 + strlen(dent->d_name);
+		if (path_len >= MAXPGPATH)
+			elog(ERROR, "path \"%s/%s\" is too long", path, dent->d_name);
+
+		file = pgFileAlloc(path_len);
+		file->mtime = st.st_mtime;
+		file->mtime_nsec = st.st_mtim.tv_nsec;
+		file->size = st.st_size;
+		file->mode = st.st_mode;
+		sprintf(file->path, "%s/%s", path, dent->d_name);
+
+		dir_walk_add(walk, file, true, out);
 		errno = 0;
-		while ((dent = readdir(dir)))
-		{
-			char child[MAXPGPATH];
+	}
+	if (errno && errno != ENOENT)
+	{
+		int errno_tmp = errno;
+		closedir(dir);
+		elog(ERROR, "cannot read directory \"%s\": %s",
+			path, strerror(errno_tmp));
+	}
+	closedir(dir);
 
-			/* skip entries point current dir or parent dir */
-			if (strcmp(dent->d_name, ".") == 0 ||
-				strcmp(dent->d_name, "..") == 0)
-				continue;
+	pthread_mutex_lock(&walk->lock);
+	parray_concat(walk->files, out);
+	pthread_mutex_unlock(&walk->lock);
+	parray_free(out);
+}
 
-			join_path_components(child, file->path, dent->d_name);
-			dir_list_file_internal(files, child, exclude, omit_symlink, true, black_list);
+static void
+dir_walk_worker(void *arg)
+{
+	DirWalk	   *walk = (DirWalk *) arg;
+
+	pthread_mutex_lock(&walk->lock);
+	while (true)
+	{
+		char	   *path;
+
+		if (parray_num(walk->queue) == 0)
+		{
+			if (walk->busy == 0)
+				break;
+			pthread_cond_wait(&walk->cond, &walk->lock);
+			continue;
 		}
-		if (errno && errno != ENOENT)
+
+		path = (char *) parray_remove(walk->queue, parray_num(walk->queue) - 1);
+		walk->busy++;
+		pthread_mutex_unlock(&walk->lock);
+
+		dir_walk_list(walk, path);
+		free(path);
+
+		pthread_mutex_lock(&walk->lock);
+		walk->busy--;
+	}
+	/* wake up the threads waiting for more directories */
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+}
+
+/*
+ * Walk the tree under root with num_threads threads, each listing whole
+ * directories and queueing the subdirectories it finds.
+ */
+static void
+dir_walk(parray *files, const char *root, const char *exclude[],
+		 bool omit_symlink, bool add_root, bool dirs_only, parray *black_list)
+{
+	DirWalk		walk;
+	pgFile	   *file;
+	int			nthreads = Max(num_threads, 1);
+
+	file = pgFileNew(root, omit_symlink);
+	if (file == NULL)
+		return;
+
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+	walk.queue = parray_new();
+	walk.busy = 0;
+	walk.files = files;
+	walk.exclude = exclude;
+	walk.omit_symlink = omit_symlink;
+	walk.dirs_only = dirs_only;
+	walk.black_list = black_list;
+
+	dir_walk_add(&walk, file, add_root, files);
+
+	if (nthreads == 1)
+		dir_walk_worker(&walk);
+	else
+	{
+		pthread_t  *threads;
+		int			i;
+
+		threads = (pthread_t *) pg_malloc(sizeof(pthread_t) * nthreads);
+		for (i = 0; i < nthreads; i++)
+			pthread_create(&threads[i], NULL,
+						   (void *(*)(void *)) dir_walk_worker, &walk);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		pg_free(threads);
+	}
+
+	parray_free(walk.queue);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+}
+
+/*
+ * List files, symbolic links and directories in the directory "root" and add
+ * pgFile objects to "files", sorted by path.  We add "root" to "files" if
+ * add_root is true.  The stat of each entry is taken once, later phases use
+ * the mode, size and mtime recorded in the list.
+ *
+ * If the sub-directory name is in "exclude" list, the sub-directory itself is
+ * listed but the contents of the sub-directory is ignored.
+ *
+ * When omit_symlink is true, symbolic link is ignored and only file or
+ * directory llnked to will be listed.
+ */
+void
+dir_list_file(parray *files, const char *root, const char *exclude[], bool omit_symlink, bool add_root)
+{
+	dir_list_tree(files, root, exclude, omit_symlink, add_root, false);
+}
+
+/*
+ * List only the directories and symbolic links under root, the layout of the
+ * tree, without taking the stat of regular files.
+ */
+void
+dir_list_dirs(parray *files, const char *root)
+{
+	dir_list_tree(files, root, NULL, false, false, true);
+}
+
+static void
+dir_list_tree(parray *files, const char *root, const char *exclude[],
+			  bool omit_symlink, bool add_root, bool dirs_only)
+{
+	char path[MAXPGPATH];
+	char buf[MAXPGPATH * 2];
+	char black_item[MAXPGPATH * 2];
+	parray *black_list = NULL;
+
+	join_path_components(path, backup_path, PG_BLACK_LIST);
+	if (root && pgdata && strcmp(root, pgdata) == 0 &&
+	    fileExists(path))
+	{
+		FILE *black_list_file = NULL;
+		black_list = parray_new();
+		black_list_file = fopen(path, "r");
+		if (black_list_file == NULL)
+			elog(ERROR, "cannot open black_list: %s",
+				strerror(errno));
+		while (fgets(buf, lengthof(buf), black_list_file) != NULL)
 		{
-			int errno_tmp = errno;
-			closedir(dir);
-			elog(ERROR, "cannot read directory \"%s\": %s",
-				file->path, strerror(errno_tmp));
+			join_path_components(black_item, pgdata, buf);
+			if (black_item[strlen(black_item) - 1] == '\n')
+				black_item[strlen(black_item) - 1] = '\0';
+			if (black_item[0] == '#' || black_item[0] == '\0')
+				continue;
+			parray_append(black_list, pgut_strdup(black_item));
 		}
-		closedir(dir);
+		fclose(black_list_file);
+		parray_qsort(black_list, BlackListCompare);
+	}
+
+	dir_walk(files, root, exclude, omit_symlink, add_root, dirs_only,
+			 black_list);
+	parray_qsort(files, pgFileComparePath);
 
-		break;	/* pseudo loop */
+	if (black_list)
+	{
+		parray_walk(black_list, free);
+		parray_free(black_list);
 	}
 }
 
@@ -465,6 +780,191 @@ dir_print_mkdirs_sh(FILE *out, const parray *files, const char *root)
 	}
 }
 
+/*
+ * Paths in the file lists are separated by spaces, so a space, tab, newline
+ * or backslash in them is written as a backslash and three octal digits,
+ * as in /proc/mounts.
+ */
+static void
+fprint_list_path(FILE *out, const char *path)
+{
+	const char *p;
+
+	for (p = path; *p; p++)
+	{
+		if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\\')
+			fprintf(out, "\\%03o", (unsigned char) *p);
+		else
+			fputc(*p, out);
+	}
+}
+
+/*
+ * Copy the path escaped by fprint_list_path() at the start of str into path,
+ * a buffer of MAXPGPATH bytes, up to the first space or, if to_eol, up to the
+ * end of the line.  Link targets are read to the end of the line as lists of
+ * older versions don't escape them.  Returns the number of characters read,
+ * or -1 if the path is too long.
+ */
+static int
+read_list_path(const char *str, char *path, bool to_eol)
+{
+	const char *p = str;
+	int			len = 0;
+
+	while (*p != '\0' && *p != '\n' && (to_eol || *p != ' '))
+	{
+		if (len >= MAXPGPATH - 1)
+			return -1;
+		if (p[0] == '\\' && p[1] >= '0' && p[1] <= '3' &&
+			p[2] >= '0' && p[2] <= '7' && p[3] >= '0' && p[3] <= '7')
+		{
+			path[len++] = (char) ((p[1] - '0') * 64 + (p[2] - '0') * 8 + (p[3] - '0'));
+			p += 4;
+		}
+		else
+			path[len++] = *p++;
+	}
+	path[len] = '\0';
+
+	return p - str;
+}
+
+/*
+ * Print the directories and symbolic links of files, a listing of root made
+ * without following links, in the format of the file list.  Entries below
+ * root are relative to it, the directories of tablespaces are absolute.
+ */
+void
+dir_print_layout(FILE *out, const parray *files, const char *root)
+{
+	size_t	root_len = strlen(root);
+	int		i;
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(files, i);
+		const char *path = file->path;
+
+		if (!S_ISDIR(file->mode) && !S_ISLNK(file->mode))
+			continue;
+
+		if (strncmp(path, root, root_len) == 0 && path[root_len] == '/')
+			path += root_len + 1;
+
+		fprint_list_path(out, path);
+		if (S_ISLNK(file->mode))
+		{
+			fprintf(out, " l 0 0 0%o ",
+				file->mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+			fprint_list_path(out, file->linked);
+			fprintf(out, "\n");
+		}
+		else
+		{
+			char timestamp[20];
+			time2iso(timestamp, 20, file->mtime);
+			fprintf(out, " d 0 0 0%o %s\n",
+				file->mode & (S_IRWXU | S_IRWXG | S_IRWXO), timestamp);
+		}
+	}
+}
+
+typedef struct
+{
+	const char *root;
+	int			root_fd;		/* descriptor of root for relative paths */
+} create_layout_args;
+
+/*
+ * Create a directory of the layout, called by run_tasks().  The directories
+ * are sorted by path so that parents usually exist already, but they may
+ * still be in the works in another thread.
+ */
+static void
+create_layout_dir(void *task, int index, void *arg)
+{
+	pgFile *file = (pgFile *) task;
+	create_layout_args *args = (create_layout_args *) arg;
+	char	path[MAXPGPATH];
+
+	if (interrupted)
+		elog(ERROR, "interrupted during restore database");
+
+	if (mkdirat(args->root_fd, file->path, DIR_PERMISSION) == 0 ||
+		errno == EEXIST)
+		return;
+	if (errno != ENOENT)
+		elog(ERROR, "cannot create directory \"%s\": %s", file->path,
+			strerror(errno));
+
+	/* create the parents too */
+	if (file->path[0] == '/')
+		strncpy(path, file->path, MAXPGPATH);
+	else
+		join_path_components(path, args->root, file->path);
+	dir_create_dir(path, DIR_PERMISSION);
+}
+
+/*
+ * Create a symbolic link of the layout, called by run_tasks().
+ */
+static void
+create_layout_link(void *task, int index, void *arg)
+{
+	pgFile *file = (pgFile *) task;
+	create_layout_args *args = (create_layout_args *) arg;
+
+	if (unlinkat(args->root_fd, file->path, 0) == -1 && errno != ENOENT)
+		elog(ERROR, "cannot remove \"%s\": %s", file->path,
+			strerror(errno));
+	if (symlinkat(file->linked, args->root_fd, file->path) == -1)
+		elog(ERROR, "cannot create symbolic link \"%s\": %s", file->path,
+			strerror(errno));
+}
+
+/*
+ * Create the directories and symbolic links listed in layout_txt under
+ * root, in parallel.  Directories come first, as symbolic links of
+ * tablespaces are made in pg_tblspc.
+ */
+void
+dir_create_layout(const char *root, const char *layout_txt)
+{
+	parray *layout;
+	parray *dirs = parray_new();
+	parray *links = parray_new();
+	create_layout_args args;
+	int		i;
+
+	layout = dir_read_file_list(NULL, layout_txt);
+	for (i = 0; i < parray_num(layout); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(layout, i);
+
+		if (S_ISLNK(file->mode))
+			parray_append(links, file);
+		else if (S_ISDIR(file->mode))
+			parray_append(dirs, file);
+	}
+
+	dir_create_dir(root, DIR_PERMISSION);
+	args.root = root;
+	args.root_fd = open(root, O_RDONLY | O_DIRECTORY);
+	if (args.root_fd == -1)
+		elog(ERROR, "cannot open directory \"%s\": %s", root,
+			strerror(errno));
+
+	run_tasks(dirs, num_threads, create_layout_dir, &args);
+	run_tasks(links, num_threads, create_layout_link, &args);
+
+	close(args.root_fd);
+	parray_free(dirs);
+	parray_free(links);
+	parray_walk(layout, pgFileFree);
+	parray_free(layout);
+}
+
 /* print file list */
 void
 dir_print_file_list(FILE *out, const parray *files, const char *root, const char *prefix)
@@ -509,12 +1009,17 @@ dir_print_file_list(FILE *out, const parray *files, const char *root, const char
 		else
 			type = '?';
 
-		fprintf(out, "%s %c %lu %u 0%o", path, type,
+		fprint_list_path(out, path);
+		fprintf(out, " %c %lu %u 0%o", type,
 			(unsigned long) file->write_size,
 			file->crc, file->mode & (S_IRWXU | S_IRWXG | S_IRWXO));
 
 		if (S_ISLNK(file->mode))
-			fprintf(out, " %s\n", file->linked);
+		{
+			fprintf(out, " ");
+			fprint_list_path(out, file->linked);
+			fprintf(out, "\n");
+		}
 		else
 		{
 			char timestamp[20];
@@ -533,7 +1038,7 @@ dir_read_file_list(const char *root, const char *file_txt)
 {
 	FILE   *fp;
 	parray *files;
-	char	buf[MAXPGPATH * 2];
+	char	buf[MAXPGPATH * 8];	/* escaped path and link target */
 
 	fp = fopen(file_txt, "rt");
 	if (fp == NULL)
@@ -551,12 +1056,31 @@ dir_read_file_list(const char *root, const char *file_txt)
 		unsigned int	mode;	/* bit length of mode_t depends on platforms */
 		struct tm		tm;
 		pgFile			*file;
+		int				len;
+		char			linked[MAXPGPATH];
+		int				path_len;
 
 		memset(&tm, 0, sizeof(tm));
-		if (sscanf(buf, "%s %c %lu %u %o %d-%d-%d %d:%d:%d",
-			path, &type, &write_size, &crc, &mode,
+		path_len = read_list_path(buf, path, false);
+		if (path_len <= 0 ||
+			sscanf(buf + path_len, " %c %lu %u %o %n",
+			&type, &write_size, &crc, &mode, &len) != 4)
+		{
+			elog(ERROR, "invalid format found in \"%s\"",
+				file_txt);
+		}
+		len += path_len;
+
+		/* a symbolic link ends with its target, other entries with mtime */
+		if (type == 'l')
+		{
+			if (read_list_path(buf + len, linked, true) < 0)
+				elog(ERROR, "invalid format found in \"%s\"",
+					file_txt);
+		}
+		else if (sscanf(buf + len, "%d-%d-%d %d:%d:%d",
 			&tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-			&tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 11)
+			&tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
 		{
 			elog(ERROR, "invalid format found in \"%s\"",
 				file_txt);
@@ -568,12 +1092,7 @@ dir_read_file_list(const char *root, const char *file_txt)
 		}
 		tm.tm_isdst = -1;
 
-		file = (pgFile *) pgut_malloc(sizeof(pgFile));
-		file->path = pgut_malloc((root ? strlen(root) + 1 : 0) + strlen(path) + 1);
-		file->ptrack_path = NULL;
-		file->segno = 0;
-		file->pagemap.bitmap = NULL;
-		file->pagemap.bitmapsize = 0;
+		file = pgFileAlloc((root ? strlen(root) + 1 : 0) + strlen(path));
 
 		tm.tm_year -= 1900;
 		tm.tm_mon -= 1;
@@ -581,12 +1100,12 @@ dir_read_file_list(const char *root, const char *file_txt)
 		file->mode = mode |
 			((type == 'f' || type == 'F') ? S_IFREG :
 			 type == 'd' ? S_IFDIR : type == 'l' ? S_IFLNK : 0);
-		file->size = 0;
+		file->size = BYTES_INVALID;	/* not in the text list */
 		file->read_size = 0;
 		file->write_size = write_size;
 		file->crc = crc;
 		file->is_datafile = (type == 'F' ? true : false);
-		file->linked = NULL;
+		file->linked = (type == 'l') ? pgFileStrdup(file, linked) : NULL;
 		if (root)
 			sprintf(file->path, "%s/%s", root, path);
 		else
@@ -0,0 +1,450 @@
+/*-------------------------------------------------------------------------
+ *
+ * ioring.c: batched page I/O through Linux io_uring
+ *
+ * A ring owns a set of page buffers.  The caller queues one read or write
+ * per buffer, then io_ring_wait() submits all of them with a single system
+ * call and waits until they are complete.  The buffers are registered with
+ * the kernel when the memlock limit allows it, so that it doesn't have to
+ * map them for every request.
+ *
+ * Each thread keeps its rings, taken with io_ring_get(), for all the files
+ * it copies and frees them once it has no more tasks.
+ *
+ * The rings are driven through the raw system calls so that no library
+ * is needed.  When the kernel or the build lacks io_uring, io_ring_create()
+ * returns NULL and callers use plain system calls.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+/* I/O engine used for data files */
+IOEngine	io_engine = IO_ENGINE_SYNC;
+
+/* set once io_uring was found unavailable, to warn and try only once */
+static volatile uint32 io_ring_unavailable = 0;
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+struct pgIORing
+{
+	int			fd;
+	int			nbuffers;
+	size_t		buffer_size;
+	char	   *buffers;
+	bool		registered;		/* buffers are registered with the kernel */
+	int			queued;			/* requests prepared but not submitted */
+	ssize_t    *results;		/* result of the last request of each buffer */
+
+	/* submission queue */
+	void	   *sq_ring;
+	size_t		sq_ring_size;
+	unsigned   *sq_head;
+	unsigned   *sq_tail;
+	unsigned   *sq_mask;
+	unsigned   *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t		sqes_size;
+
+	/* completion queue */
+	void	   *cq_ring;
+	size_t		cq_ring_size;
+	unsigned   *cq_head;
+	unsigned   *cq_tail;
+	unsigned   *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/*
+ * Rings of each thread, one per shape of ring in use, so that a thread sets
+ * up its rings once rather than for every file.
+ */
+#define THREAD_RINGS	2
+
+static __thread pgIORing *thread_rings[THREAD_RINGS];
+
+static void io_ring_disable(const char *reason, int errno_val);
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+				   unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+						 flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Create a ring with nbuffers buffers of buffer_size bytes each.  Returns
+ * NULL if io_uring can't be used, the caller should fall back to
+ * synchronous I/O then.
+ */
+pgIORing *
+io_ring_create(int nbuffers, size_t buffer_size)
+{
+	pgIORing   *ring;
+	struct io_uring_params p;
+	struct iovec *iov;
+	int			i;
+
+	if (io_ring_unavailable)
+		return NULL;
+
+	ring = pg_malloc0(sizeof(pgIORing));
+	ring->nbuffers = nbuffers;
+	ring->buffer_size = buffer_size;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(nbuffers, &p);
+	if (ring->fd < 0)
+	{
+		io_ring_disable("cannot set up io_uring", errno);
+		pg_free(ring);
+		return NULL;
+	}
+
+	/* map the rings and the submission entries */
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, ring->fd,
+						 IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, ring->fd,
+						 IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+		ring->sqes == MAP_FAILED)
+	{
+		int			errno_tmp = errno;
+
+		if (ring->sq_ring != MAP_FAILED)
+			munmap(ring->sq_ring, ring->sq_ring_size);
+		if (ring->cq_ring != MAP_FAILED)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		if (ring->sqes != MAP_FAILED)
+			munmap(ring->sqes, ring->sqes_size);
+		close(ring->fd);
+		pg_free(ring);
+		io_ring_disable("cannot map io_uring", errno_tmp);
+		return NULL;
+	}
+
+	ring->sq_head = (unsigned *) ((char *) ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) ((char *) ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned *) ((char *) ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + p.cq_off.cqes);
+
+	/* page aligned buffers, usable for O_DIRECT too */
+	if (posix_memalign((void **) &ring->buffers, 4096,
+					   (size_t) nbuffers * buffer_size) != 0)
+		elog(ERROR, "out of memory");
+	ring->results = pg_malloc0(sizeof(ssize_t) * nbuffers);
+
+	/*
+	 * Registration counts against RLIMIT_MEMLOCK on older kernels; the
+	 * buffers are then used through ordinary requests.
+	 */
+	iov = pg_malloc(sizeof(struct iovec) * nbuffers);
+	for (i = 0; i < nbuffers; i++)
+	{
+		iov[i].iov_base = io_ring_buffer(ring, i);
+		iov[i].iov_len = buffer_size;
+	}
+	ring->registered = (sys_io_uring_register(ring->fd,
+											  IORING_REGISTER_BUFFERS,
+											  iov, nbuffers) == 0);
+	pg_free(iov);
+
+	return ring;
+}
+
+/*
+ * Release the ring and its buffers.
+ */
+void
+io_ring_free(pgIORing *ring)
+{
+	if (ring == NULL)
+		return;
+
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring->buffers);
+	pg_free(ring->results);
+	pg_free(ring);
+}
+
+/*
+ * Return a ring of the current thread with nbuffers buffers of buffer_size
+ * bytes, creating it on first use.  The ring is kept for the next files
+ * the thread copies, until io_ring_free_thread().  Returns NULL if io_uring
+ * can't be used.
+ */
+pgIORing *
+io_ring_get(int nbuffers, size_t buffer_size)
+{
+	int			i;
+
+	for (i = 0; i < THREAD_RINGS; i++)
+	{
+		pgIORing   *ring = thread_rings[i];
+
+		if (ring == NULL)
+		{
+			thread_rings[i] = io_ring_create(nbuffers, buffer_size);
+			return thread_rings[i];
+		}
+		if (ring->nbuffers == nbuffers && ring->buffer_size == buffer_size)
+			return ring;
+	}
+
+	/* no free slot, the caller uses synchronous I/O */
+	return NULL;
+}
+
+/*
+ * Release the rings of the current thread, called when it has no more
+ * tasks.
+ */
+void
+io_ring_free_thread(void)
+{
+	int			i;
+
+	for (i = 0; i < THREAD_RINGS; i++)
+	{
+		io_ring_free(thread_rings[i]);
+		thread_rings[i] = NULL;
+	}
+}
+
+char *
+io_ring_buffer(pgIORing *ring, int slot)
+{
+	return ring->buffers + (size_t) slot * ring->buffer_size;
+}
+
+/*
+ * Queue a request on buffer slot.  Each slot may have one request queued at
+ * a time.
+ */
+static void
+io_ring_prep(pgIORing *ring, int slot, bool write, int fd, off_t offset,
+			 size_t len)
+{
+	unsigned	tail = *ring->sq_tail;
+	unsigned	index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	Assert(len <= ring->buffer_size);
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (ring->registered)
+	{
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = slot;
+	}
+	else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long) io_ring_buffer(ring, slot);
+	sqe->len = len;
+	sqe->user_data = slot;
+
+	ring->sq_array[index] = index;
+	/* make the entry visible to the kernel before the new tail */
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+void
+io_ring_read(pgIORing *ring, int slot, int fd, off_t offset, size_t len)
+{
+	io_ring_prep(ring, slot, false, fd, offset, len);
+}
+
+void
+io_ring_write(pgIORing *ring, int slot, int fd, off_t offset, size_t len)
+{
+	io_ring_prep(ring, slot, true, fd, offset, len);
+}
+
+/*
+ * Submit all queued requests and wait for their completion.  The result of
+ * each request, the number of bytes transferred or -errno, is then returned
+ * by io_ring_result().
+ */
+void
+io_ring_wait(pgIORing *ring)
+{
+	int			to_submit = ring->queued;
+	int			completed = 0;
+
+	while (completed < ring->queued)
+	{
+		unsigned	head = *ring->cq_head;
+		unsigned	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+		{
+			int			ret;
+
+			ret = sys_io_uring_enter(ring->fd, to_submit,
+									 ring->queued - completed,
+									 IORING_ENTER_GETEVENTS);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				elog(ERROR, "cannot submit io_uring requests: %s",
+					 strerror(errno));
+			}
+			to_submit -= ret;
+			continue;
+		}
+
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+			ring->results[cqe->user_data] = cqe->res;
+			completed++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	ring->queued = 0;
+}
+
+ssize_t
+io_ring_result(pgIORing *ring, int slot)
+{
+	return ring->results[slot];
+}
+
+#else							/* !HAVE_LINUX_IO_URING_H */
+
+static void io_ring_disable(const char *reason, int errno_val);
+
+pgIORing *
+io_ring_create(int nbuffers, size_t buffer_size)
+{
+	if (!io_ring_unavailable)
+		io_ring_disable("io_uring is not supported by this build", 0);
+	return NULL;
+}
+
+void
+io_ring_free(pgIORing *ring)
+{
+}
+
+pgIORing *
+io_ring_get(int nbuffers, size_t buffer_size)
+{
+	return io_ring_create(nbuffers, buffer_size);
+}
+
+void
+io_ring_free_thread(void)
+{
+}
+
+char *
+io_ring_buffer(pgIORing *ring, int slot)
+{
+	return NULL;
+}
+
+void
+io_ring_read(pgIORing *ring, int slot, int fd, off_t offset, size_t len)
+{
+}
+
+void
+io_ring_write(pgIORing *ring, int slot, int fd, off_t offset, size_t len)
+{
+}
+
+void
+io_ring_wait(pgIORing *ring)
+{
+}
+
+ssize_t
+io_ring_result(pgIORing *ring, int slot)
+{
+	return -1;
+}
+
+#endif							/* HAVE_LINUX_IO_URING_H */
+
+/*
+ * Remember that io_uring can't be used and warn about it once.
+ */
+static void
+io_ring_disable(const char *reason, int errno_val)
+{
+	if (__sync_lock_test_and_set(&io_ring_unavailable, 1) != 0)
+		return;
+
+	if (errno_val != 0)
+		elog(WARNING, "%s: %s, using synchronous I/O", reason,
+			 strerror(errno_val));
+	else
+		elog(WARNING, "%s, using synchronous I/O", reason);
+}
+
+IOEngine
+parse_io_engine(const char *value)
+{
+	const char *v = value;
+	size_t		len;
+
+	/* Skip all spaces detected */
+	while (IsSpace(*v))
+		v++;
+	len = strlen(v);
+
+	if (len > 0 && pg_strncasecmp("sync", v, strlen("sync")) == 0)
+		return IO_ENGINE_SYNC;
+	else if (len > 0 && pg_strncasecmp("io_uring", v, strlen("io_uring")) == 0)
+		return IO_ENGINE_IO_URING;
+
+	/* I/O engine is invalid, so leave with an error */
+	elog(ERROR, "invalid io-engine \"%s\"", value);
+	return IO_ENGINE_SYNC;
+}
@@ -0,0 +1,406 @@
+/*-------------------------------------------------------------------------
+ *
+ * manifest.c: binary file list of a backup
+ *
+ * The file list of a backup is written twice: as file_database.txt, kept
+ * as a readable export and for older versions, and as file_database.bin,
+ * which is mapped into memory and used without parsing.
+ *
+ * The binary manifest is a header, an array of fixed-width records sorted
+ * by path, which is also the index searched by manifest_find(), and a table
+ * of NUL-terminated strings holding the paths and link targets.  Paths are
+ * relative to the database directory of the backup.  A table of chunk
+ * hashes lies between the records and the strings, each data file record
+ * points to the run of its chunks.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MANIFEST_MAGIC			0x4D425050	/* "PPBM" */
+#define MANIFEST_VERSION		1
+
+/* hash functions of the chunk table */
+#define MANIFEST_CHUNK_HASH_CRC32C	1
+
+/* flags of a record */
+#define MANIFEST_DATAFILE		0x01
+#define MANIFEST_WHOLE			0x02	/* data file copied with all its pages */
+
+typedef struct pgManifestHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		record_size;	/* sizeof(pgManifestRecord) */
+	uint32		nrecords;
+	uint64		strings_offset;	/* offset of the string table in the file */
+	uint64		strings_size;
+	uint32		chunk_hash;		/* MANIFEST_CHUNK_HASH_xxx */
+	uint32		chunk_blocks;	/* CHUNK_HASH_BLOCKS */
+	uint64		chunks_offset;	/* offset of the chunk table in the file */
+	uint64		nchunks;
+} pgManifestHeader;
+
+typedef struct pgManifestRecord
+{
+	int64		write_size;		/* BYTES_INVALID if not backed up */
+	int64		mtime;
+	uint32		path;			/* offset in the string table */
+	uint32		linked;			/* offset in the string table, 0 if none */
+	uint32		crc;
+	uint32		mode;
+	Oid			tblspcOid;
+	Oid			dbOid;
+	Oid			relOid;
+	int32		forkNum;
+	int32		segno;
+	uint32		flags;
+	int64		size;			/* size of the source file */
+	int64		mtime_nsec;
+	uint64		first_chunk;	/* index in the chunk table */
+	uint64		nchunks;
+	uint32		nparts;			/* part files of a split data file */
+} pgManifestRecord;
+
+struct pgManifest
+{
+	char	   *map;
+	size_t		map_size;
+	const pgManifestHeader *header;
+	const pgManifestRecord *records;
+	const pgChunkHash *chunks;	/* NULL if the chunk table can't be used */
+	const char *strings;
+};
+
+/* entry of manifest_write() being sorted, path is relative */
+typedef struct
+{
+	pgFile	   *file;
+	const char *path;
+} ManifestSortItem;
+
+static int
+manifest_sort_compare(const void *a, const void *b)
+{
+	return strcmp(((const ManifestSortItem *) a)->path,
+				  ((const ManifestSortItem *) b)->path);
+}
+
+static void
+manifest_fwrite(const void *data, size_t size, FILE *fp, const char *path)
+{
+	if (fwrite(data, 1, size, fp) != size)
+		elog(ERROR, "cannot write manifest \"%s\": %s", path,
+			 strerror(errno));
+}
+
+/*
+ * Write the binary manifest of files to path.  Paths of files under root are
+ * stored relative to it.
+ */
+void
+manifest_write(const char *path, const parray *files, const char *root)
+{
+	size_t		nfiles = parray_num(files);
+	ManifestSortItem *items;
+	pgManifestHeader header;
+	uint32		string_pos;
+	uint64		chunk_pos;
+	uint64		nchunks = 0;
+	FILE	   *fp;
+	size_t		i;
+
+	items = pgut_malloc(sizeof(ManifestSortItem) * Max(nfiles, 1));
+	for (i = 0; i < nfiles; i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		const char *ptr = file->path;
+
+		/* omit root directory portion */
+		if (root && strstr(ptr, root) == ptr)
+			ptr = JoinPathEnd(ptr, root);
+
+		items[i].file = file;
+		items[i].path = ptr;
+		nchunks += file->nchunks;
+	}
+	qsort(items, nfiles, sizeof(ManifestSortItem), manifest_sort_compare);
+
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+		elog(ERROR, "cannot open manifest \"%s\": %s", path, strerror(errno));
+
+	/* records, the string table starts with an empty string */
+	memset(&header, 0, sizeof(header));
+	header.magic = MANIFEST_MAGIC;
+	header.version = MANIFEST_VERSION;
+	header.record_size = sizeof(pgManifestRecord);
+	header.nrecords = nfiles;
+	header.chunk_hash = MANIFEST_CHUNK_HASH_CRC32C;
+	header.chunk_blocks = CHUNK_HASH_BLOCKS;
+	header.chunks_offset = sizeof(header) + nfiles * sizeof(pgManifestRecord);
+	header.nchunks = nchunks;
+	header.strings_offset = header.chunks_offset + nchunks * sizeof(pgChunkHash);
+	manifest_fwrite(&header, sizeof(header), fp, path);
+
+	string_pos = 1;
+	chunk_pos = 0;
+	for (i = 0; i < nfiles; i++)
+	{
+		pgFile	   *file = items[i].file;
+		pgManifestRecord rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.write_size = (file->write_size == BYTES_INVALID) ?
+			BYTES_INVALID : (int64) file->write_size;
+		rec.mtime = file->mtime;
+		rec.path = string_pos;
+		string_pos += strlen(items[i].path) + 1;
+		if (file->linked)
+		{
+			rec.linked = string_pos;
+			string_pos += strlen(file->linked) + 1;
+		}
+		rec.crc = file->crc;
+		rec.mode = file->mode;
+		rec.tblspcOid = file->tblspcOid;
+		rec.dbOid = file->dbOid;
+		rec.relOid = file->relOid;
+		rec.forkNum = file->forkNum;
+		rec.segno = file->segno;
+		rec.flags = (file->is_datafile ? MANIFEST_DATAFILE : 0) |
+			(file->is_whole ? MANIFEST_WHOLE : 0);
+		rec.size = file->size;
+		rec.mtime_nsec = file->mtime_nsec;
+		rec.first_chunk = chunk_pos;
+		rec.nchunks = file->nchunks;
+		rec.nparts = file->nparts;
+		chunk_pos += file->nchunks;
+		manifest_fwrite(&rec, sizeof(rec), fp, path);
+	}
+
+	/* chunk table, in the order of the records */
+	for (i = 0; i < nfiles; i++)
+	{
+		if (items[i].file->nchunks > 0)
+			manifest_fwrite(items[i].file->chunks,
+							sizeof(pgChunkHash) * items[i].file->nchunks,
+							fp, path);
+	}
+
+	/* string table */
+	manifest_fwrite("", 1, fp, path);
+	for (i = 0; i < nfiles; i++)
+	{
+		manifest_fwrite(items[i].path, strlen(items[i].path) + 1, fp, path);
+		if (items[i].file->linked)
+			manifest_fwrite(items[i].file->linked,
+							strlen(items[i].file->linked) + 1, fp, path);
+	}
+
+	/* now the size of the string table is known */
+	header.strings_size = string_pos;
+	if (fseek(fp, 0, SEEK_SET) != 0)
+		elog(ERROR, "cannot seek manifest \"%s\": %s", path, strerror(errno));
+	manifest_fwrite(&header, sizeof(header), fp, path);
+
+	if (fclose(fp) != 0)
+		elog(ERROR, "cannot write manifest \"%s\": %s", path, strerror(errno));
+	pg_free(items);
+}
+
+/*
+ * Map the binary manifest at path.  Returns NULL if there is none, as in
+ * backups taken by older versions.
+ */
+pgManifest *
+manifest_open(const char *path)
+{
+	pgManifest *manifest;
+	struct stat	st;
+	int			fd;
+	const pgManifestHeader *header;
+	uint64		records_end;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		if (errno == ENOENT)
+			return NULL;
+		elog(ERROR, "cannot open manifest \"%s\": %s", path, strerror(errno));
+	}
+	if (fstat(fd, &st) == -1)
+		elog(ERROR, "cannot stat manifest \"%s\": %s", path, strerror(errno));
+	if (st.st_size < sizeof(pgManifestHeader))
+		elog(ERROR, "manifest \"%s\" is broken", path);
+
+	manifest = pgut_new(pgManifest);
+	manifest->map_size = st.st_size;
+	manifest->map = mmap(NULL, manifest->map_size, PROT_READ, MAP_SHARED,
+						 fd, 0);
+	if (manifest->map == MAP_FAILED)
+		elog(ERROR, "cannot map manifest \"%s\": %s", path, strerror(errno));
+	close(fd);
+
+	header = (const pgManifestHeader *) manifest->map;
+	if (header->magic != MANIFEST_MAGIC)
+		elog(ERROR, "\"%s\" is not a manifest", path);
+	if (header->version != MANIFEST_VERSION ||
+		header->record_size != sizeof(pgManifestRecord))
+		elog(ERROR, "manifest \"%s\" has unsupported version %u", path,
+			 header->version);
+
+	records_end = sizeof(pgManifestHeader) +
+		(uint64) header->nrecords * sizeof(pgManifestRecord);
+	if (records_end > manifest->map_size ||
+		header->chunks_offset != records_end ||
+		header->nchunks > (manifest->map_size - records_end) / sizeof(pgChunkHash))
+		elog(ERROR, "manifest \"%s\" is broken", path);
+	records_end += header->nchunks * sizeof(pgChunkHash);
+	if (header->strings_offset != records_end ||
+		header->strings_size == 0 ||
+		header->strings_offset + header->strings_size != manifest->map_size ||
+		manifest->map[manifest->map_size - 1] != '\0')
+		elog(ERROR, "manifest \"%s\" is broken", path);
+
+	manifest->header = header;
+	manifest->records = (const pgManifestRecord *)
+		(manifest->map + sizeof(pgManifestHeader));
+	manifest->strings = manifest->map + header->strings_offset;
+
+	/* chunk hashes made another way are not used */
+	manifest->chunks = NULL;
+	if (header->chunk_hash == MANIFEST_CHUNK_HASH_CRC32C &&
+		header->chunk_blocks == CHUNK_HASH_BLOCKS)
+		manifest->chunks = (const pgChunkHash *)
+			(manifest->map + header->chunks_offset);
+	else
+		elog(LOG, "chunk hashes of manifest \"%s\" are not supported", path);
+
+	return manifest;
+}
+
+void
+manifest_close(pgManifest *manifest)
+{
+	if (manifest == NULL)
+		return;
+
+	munmap(manifest->map, manifest->map_size);
+	pg_free(manifest);
+}
+
+int
+manifest_count(const pgManifest *manifest)
+{
+	return manifest->header->nrecords;
+}
+
+/*
+ * Return the index of the file with relative path rel_path, or -1 if the
+ * manifest doesn't have it.
+ */
+int
+manifest_find(const pgManifest *manifest, const char *rel_path)
+{
+	int			low = 0;
+	int			high = manifest->header->nrecords - 1;
+
+	while (low <= high)
+	{
+		int			mid = low + (high - low) / 2;
+		int			cmp;
+
+		cmp = strcmp(manifest->strings + manifest->records[mid].path,
+					 rel_path);
+		if (cmp == 0)
+			return mid;
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return -1;
+}
+
+/*
+ * Make a pgFile of the entry at index, with its path under root.
+ */
+pgFile *
+manifest_get_file(const pgManifest *manifest, int index, const char *root)
+{
+	const pgManifestRecord *rec = &manifest->records[index];
+	const char *path = manifest->strings + rec->path;
+	pgFile	   *file;
+
+	file = pgFileAlloc((root ? strlen(root) + 1 : 0) + strlen(path));
+	if (root)
+		sprintf(file->path, "%s/%s", root, path);
+	else
+		strcpy(file->path, path);
+
+	file->mtime = (time_t) rec->mtime;
+	file->mode = rec->mode;
+	file->write_size = (rec->write_size == BYTES_INVALID) ?
+		BYTES_INVALID : (size_t) rec->write_size;
+	file->crc = rec->crc;
+	file->linked = rec->linked ? pgFileStrdup(file, manifest->strings + rec->linked) : NULL;
+	file->is_datafile = (rec->flags & MANIFEST_DATAFILE) != 0;
+	file->is_whole = (rec->flags & MANIFEST_WHOLE) != 0;
+	file->segno = rec->segno;
+	file->tblspcOid = rec->tblspcOid;
+	file->dbOid = rec->dbOid;
+	file->relOid = rec->relOid;
+	file->forkNum = rec->forkNum;
+	file->size = (size_t) rec->size;
+	file->mtime_nsec = (long) rec->mtime_nsec;
+	file->nparts = (int) rec->nparts;
+
+	if (manifest->chunks != NULL && rec->nchunks > 0)
+	{
+		if (rec->first_chunk > manifest->header->nchunks ||
+			rec->nchunks > manifest->header->nchunks - rec->first_chunk)
+			elog(ERROR, "manifest entry of \"%s\" is broken", path);
+		file->nchunks = (int) rec->nchunks;
+		file->chunks = pgut_newarray(pgChunkHash, file->nchunks);
+		memcpy(file->chunks, manifest->chunks + rec->first_chunk,
+			   sizeof(pgChunkHash) * file->nchunks);
+	}
+
+	return file;
+}
+
+/*
+ * Return the file list of backup, sorted by path, with paths under root.
+ * The binary manifest is used if the backup has one.
+ */
+parray *
+read_backup_file_list(pgBackup *backup, const char *root)
+{
+	char		path[MAXPGPATH];
+	pgManifest *manifest;
+	parray	   *files;
+	int			i;
+
+	pgBackupGetPath(backup, path, lengthof(path), DATABASE_FILE_MANIFEST);
+	manifest = manifest_open(path);
+	if (manifest == NULL)
+	{
+		pgBackupGetPath(backup, path, lengthof(path), DATABASE_FILE_LIST);
+		return dir_read_file_list(root, path);
+	}
+
+	files = parray_new();
+	for (i = 0; i < manifest_count(manifest); i++)
+		parray_append(files, manifest_get_file(manifest, i, root));
+	manifest_close(manifest);
+
+	return files;
+}
@@ -0,0 +1,351 @@
+/*-------------------------------------------------------------------------
+ *
+ * pagecheck.c: zero page detection and page checksums
+ *
+ * Backup checks every page it reads, and restore computes the checksum of
+ * every page it writes.  These kernels do the same work as the byte loop
+ * and pg_checksum_page(), with SSE2 or AVX2 on x86-64 chosen at run time
+ * and the scalar code elsewhere.
+ *
+ * The checksum of PostgreSQL already runs N_SUMS independent lanes over
+ * each row of a page, the vector kernels compute the lanes in registers.
+ * They read pd_checksum as zero instead of clearing it, so pages are not
+ * modified.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include "storage/bufpage.h"
+#include "storage/checksum_impl.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+typedef bool (*page_is_zero_func) (const char *page);
+typedef void (*checksum_pages_func) (const char *pages, int npages,
+									 BlockNumber blkno, uint16 *checksums);
+
+static bool page_is_zero_scalar(const char *page);
+static void checksum_pages_scalar(const char *pages, int npages,
+								  BlockNumber blkno, uint16 *checksums);
+
+/*
+ * The kernels in use, chosen by pagecheck_init() before any thread starts,
+ * and never changed while threads run.
+ */
+static page_is_zero_func page_is_zero_impl = page_is_zero_scalar;
+static checksum_pages_func checksum_pages_impl = checksum_pages_scalar;
+static const char *kernel_name = "scalar";
+
+static bool
+page_is_zero_scalar(const char *page)
+{
+	const uint64 *words = (const uint64 *) page;
+	uint64		acc = 0;
+	int			i;
+
+	for (i = 0; i < BLCKSZ / sizeof(uint64); i++)
+		acc |= words[i];
+	return acc == 0;
+}
+
+static void
+checksum_pages_scalar(const char *pages, int npages, BlockNumber blkno,
+					  uint16 *checksums)
+{
+	int			i;
+
+	/* pg_checksum_page() clears pd_checksum while it runs, and restores it */
+	for (i = 0; i < npages; i++)
+		checksums[i] = pg_checksum_page((char *) pages + (size_t) i * BLCKSZ,
+										blkno + i);
+}
+
+#ifdef USE_X86_KERNELS
+
+/* the checksum of the block folded into the value stored in a page */
+#define CHECKSUM_FINISH(sum, blkno)	((uint16) ((((sum) ^ (blkno)) % 65535) + 1))
+
+/*
+ * Lane mask of the first row of a page, hiding pd_checksum, which is the low
+ * half of the third 32-bit word on little-endian x86.
+ */
+#define PD_CHECKSUM_WORD	(offsetof(PageHeaderData, pd_checksum) / sizeof(uint32))
+
+static bool
+page_is_zero_sse2(const char *page)
+{
+	__m128i		acc = _mm_setzero_si128();
+	int			i;
+
+	for (i = 0; i < BLCKSZ; i += 64)
+	{
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (page + i)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (page + i + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (page + i + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (page + i + 48)));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+}
+
+/* 32-bit multiplication keeping the low halves, which SSE2 lacks */
+static inline __m128i
+mullo_epi32_sse2(__m128i a, __m128i b)
+{
+	__m128i		even = _mm_mul_epu32(a, b);
+	__m128i		odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+							  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+#define SSE2_VECTORS	(N_SUMS / 4)
+
+static inline void
+checksum_comp_sse2(__m128i *sums, const __m128i *values, __m128i prime)
+{
+	int			k;
+
+	for (k = 0; k < SSE2_VECTORS; k++)
+	{
+		__m128i		tmp = _mm_xor_si128(sums[k], values[k]);
+
+		sums[k] = _mm_xor_si128(mullo_epi32_sse2(tmp, prime),
+								_mm_srli_epi32(tmp, 17));
+	}
+}
+
+static void
+checksum_pages_sse2(const char *pages, int npages, BlockNumber blkno,
+					uint16 *checksums)
+{
+	const __m128i prime = _mm_set1_epi32(FNV_PRIME);
+	uint32		mask_words[4] = {~0U, ~0U, ~0U, ~0U};
+	__m128i		mask;
+	int			p;
+
+	mask_words[PD_CHECKSUM_WORD] = 0xFFFF0000;
+	mask = _mm_loadu_si128((const __m128i *) mask_words);
+
+	for (p = 0; p < npages; p++)
+	{
+		const char *page = pages + (size_t) p * BLCKSZ;
+		__m128i		sums[SSE2_VECTORS];
+		__m128i		values[SSE2_VECTORS];
+		uint32		lanes[4];
+		uint32		result;
+		int			i, k;
+
+		for (k = 0; k < SSE2_VECTORS; k++)
+			sums[k] = _mm_loadu_si128((const __m128i *) &checksumBaseOffsets[k * 4]);
+
+		for (i = 0; i < BLCKSZ / (sizeof(uint32) * N_SUMS); i++)
+		{
+			const __m128i *row = (const __m128i *) (page + i * sizeof(uint32) * N_SUMS);
+
+			for (k = 0; k < SSE2_VECTORS; k++)
+				values[k] = _mm_loadu_si128(row + k);
+			if (i == 0)
+				values[0] = _mm_and_si128(values[0], mask);
+			checksum_comp_sse2(sums, values, prime);
+		}
+
+		/* finally add in two rounds of zeroes for additional mixing */
+		for (k = 0; k < SSE2_VECTORS; k++)
+			values[k] = _mm_setzero_si128();
+		checksum_comp_sse2(sums, values, prime);
+		checksum_comp_sse2(sums, values, prime);
+
+		for (k = 1; k < SSE2_VECTORS; k++)
+			sums[0] = _mm_xor_si128(sums[0], sums[k]);
+		_mm_storeu_si128((__m128i *) lanes, sums[0]);
+		result = lanes[0] ^ lanes[1] ^ lanes[2] ^ lanes[3];
+
+		checksums[p] = CHECKSUM_FINISH(result, blkno + p);
+	}
+}
+
+__attribute__((target("avx2")))
+static bool
+page_is_zero_avx2(const char *page)
+{
+	__m256i		acc = _mm256_setzero_si256();
+	int			i;
+
+	for (i = 0; i < BLCKSZ; i += 128)
+	{
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *) (page + i)));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *) (page + i + 32)));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *) (page + i + 64)));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *) (page + i + 96)));
+	}
+	return _mm256_testz_si256(acc, acc) != 0;
+}
+
+#define AVX2_VECTORS	(N_SUMS / 8)
+
+/*
+ * The lanes of one page fill only four ymm registers, whose multiplications
+ * depend on each other row after row.  Two pages are checksummed together
+ * to keep more multiplications in flight.
+ */
+#define AVX2_PAGES		2
+
+__attribute__((target("avx2")))
+static inline void
+checksum_comp_avx2(__m256i *sums, const __m256i *values, __m256i prime)
+{
+	int			k;
+
+	for (k = 0; k < AVX2_VECTORS * AVX2_PAGES; k++)
+	{
+		__m256i		tmp = _mm256_xor_si256(sums[k], values[k]);
+
+		sums[k] = _mm256_xor_si256(_mm256_mullo_epi32(tmp, prime),
+								   _mm256_srli_epi32(tmp, 17));
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+checksum_pages_avx2(const char *pages, int npages, BlockNumber blkno,
+					uint16 *checksums)
+{
+	const __m256i prime = _mm256_set1_epi32(FNV_PRIME);
+	uint32		mask_words[8] = {~0U, ~0U, ~0U, ~0U, ~0U, ~0U, ~0U, ~0U};
+	__m256i		mask;
+	int			p;
+
+	mask_words[PD_CHECKSUM_WORD] = 0xFFFF0000;
+	mask = _mm256_loadu_si256((const __m256i *) mask_words);
+
+	for (p = 0; p < npages; p += AVX2_PAGES)
+	{
+		const char *page[AVX2_PAGES];
+		__m256i		sums[AVX2_VECTORS * AVX2_PAGES];
+		__m256i		values[AVX2_VECTORS * AVX2_PAGES];
+		uint32		lanes[8];
+		int			i, j, k;
+
+		/* the last page of an odd run is checksummed twice */
+		for (j = 0; j < AVX2_PAGES; j++)
+			page[j] = pages + (size_t) Min(p + j, npages - 1) * BLCKSZ;
+
+		for (k = 0; k < AVX2_VECTORS * AVX2_PAGES; k++)
+			sums[k] = _mm256_loadu_si256((const __m256i *)
+										 &checksumBaseOffsets[(k % AVX2_VECTORS) * 8]);
+
+		for (i = 0; i < BLCKSZ / (sizeof(uint32) * N_SUMS); i++)
+		{
+			for (j = 0; j < AVX2_PAGES; j++)
+			{
+				const __m256i *row = (const __m256i *)
+					(page[j] + i * sizeof(uint32) * N_SUMS);
+
+				for (k = 0; k < AVX2_VECTORS; k++)
+					values[j * AVX2_VECTORS + k] = _mm256_loadu_si256(row + k);
+				if (i == 0)
+					values[j * AVX2_VECTORS] =
+						_mm256_and_si256(values[j * AVX2_VECTORS], mask);
+			}
+			checksum_comp_avx2(sums, values, prime);
+		}
+
+		/* finally add in two rounds of zeroes for additional mixing */
+		for (k = 0; k < AVX2_VECTORS * AVX2_PAGES; k++)
+			values[k] = _mm256_setzero_si256();
+		checksum_comp_avx2(sums, values, prime);
+		checksum_comp_avx2(sums, values, prime);
+
+		for (j = 0; j < AVX2_PAGES && p + j < npages; j++)
+		{
+			__m256i		acc = sums[j * AVX2_VECTORS];
+			uint32		result = 0;
+
+			for (k = 1; k < AVX2_VECTORS; k++)
+				acc = _mm256_xor_si256(acc, sums[j * AVX2_VECTORS + k]);
+			_mm256_storeu_si256((__m256i *) lanes, acc);
+			for (k = 0; k < 8; k++)
+				result ^= lanes[k];
+
+			checksums[p + j] = CHECKSUM_FINISH(result, blkno + p + j);
+		}
+	}
+}
+
+#endif   /* USE_X86_KERNELS */
+
+/*
+ * Use the kernels of the given name, "scalar", "sse2" or "avx2".  Returns
+ * false if they are not available on this machine.  Not to be called while
+ * other threads may check pages.
+ */
+bool
+pagecheck_use_kernel(const char *name)
+{
+	if (strcmp(name, "scalar") == 0)
+	{
+		page_is_zero_impl = page_is_zero_scalar;
+		checksum_pages_impl = checksum_pages_scalar;
+	}
+#ifdef USE_X86_KERNELS
+	else if (strcmp(name, "sse2") == 0)
+	{
+		page_is_zero_impl = page_is_zero_sse2;
+		checksum_pages_impl = checksum_pages_sse2;
+	}
+	else if (strcmp(name, "avx2") == 0)
+	{
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2"))
+			return false;
+		page_is_zero_impl = page_is_zero_avx2;
+		checksum_pages_impl = checksum_pages_avx2;
+	}
+#endif
+	else
+		return false;
+
+	kernel_name = name;
+	return true;
+}
+
+/*
+ * Choose the best kernels of this machine.  Called once from main(), before
+ * any thread starts.
+ */
+void
+pagecheck_init(void)
+{
+	if (!pagecheck_use_kernel("avx2") && !pagecheck_use_kernel("sse2"))
+		pagecheck_use_kernel("scalar");
+}
+
+const char *
+pagecheck_kernel_name(void)
+{
+	return kernel_name;
+}
+
+/* Is the page all zeroes? */
+bool
+page_is_zero(const char *page)
+{
+	return page_is_zero_impl(page);
+}
+
+/*
+ * Compute the checksums of npages contiguous pages, as pg_checksum_page()
+ * does.  blkno is the block number of the first page in its relation, which
+ * counts the blocks of the previous segments.
+ */
+void
+pg_checksum_pages(const char *pages, int npages, BlockNumber blkno,
+				  uint16 *checksums)
+{
+	checksum_pages_impl(pages, npages, blkno, checksums);
+}
@@ -0,0 +1,118 @@
+/*-------------------------------------------------------------------------
+ *
+ * pagecheck_bench.c: microbenchmark of the kernels of pagecheck.c
+ *
+ * Usage: pagecheck_bench [npages [rounds]]
+ *
+ * Checksums npages random pages and checks npages zero pages rounds times
+ * with each kernel available on this machine, after verifying that the
+ * kernels agree with the scalar code.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <time.h>
+
+static const char *kernels[] = {"scalar", "sse2", "avx2"};
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	int			npages = (argc > 1) ? atoi(argv[1]) : 4096;
+	int			rounds = (argc > 2) ? atoi(argv[2]) : 10;
+	char	   *pages;
+	char	   *zeroes;
+	uint16	   *expected;
+	uint16	   *checksums;
+	size_t		nbytes;
+	size_t		j;
+	int			k;
+	int			i;
+
+	if (npages <= 0 || rounds <= 0)
+	{
+		fprintf(stderr, "usage: %s [npages [rounds]]\n", argv[0]);
+		return 1;
+	}
+
+	nbytes = (size_t) npages * BLCKSZ;
+	pages = malloc(nbytes);
+	zeroes = calloc(npages, BLCKSZ);
+	expected = malloc(sizeof(uint16) * npages);
+	checksums = malloc(sizeof(uint16) * npages);
+	if (pages == NULL || zeroes == NULL || expected == NULL || checksums == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	srandom(42);
+	for (j = 0; j < nbytes; j++)
+		pages[j] = (char) random();
+
+	pagecheck_init();
+	printf("%d pages, %d rounds, default kernel %s\n",
+		   npages, rounds, pagecheck_kernel_name());
+
+	pagecheck_use_kernel("scalar");
+	pg_checksum_pages(pages, npages, 0, expected);
+
+	for (k = 0; k < lengthof(kernels); k++)
+	{
+		struct timespec start;
+		double		checksum_secs;
+		double		zero_secs;
+		int			nzero = 0;
+		int			r;
+
+		if (!pagecheck_use_kernel(kernels[k]))
+		{
+			printf("%-8s not available\n", kernels[k]);
+			continue;
+		}
+
+		pg_checksum_pages(pages, npages, 0, checksums);
+		if (memcmp(checksums, expected, sizeof(uint16) * npages) != 0)
+		{
+			fprintf(stderr, "%s: checksums differ from scalar code\n", kernels[k]);
+			return 1;
+		}
+		if (page_is_zero(pages) || !page_is_zero(zeroes))
+		{
+			fprintf(stderr, "%s: wrong zero page detection\n", kernels[k]);
+			return 1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (r = 0; r < rounds; r++)
+			pg_checksum_pages(pages, npages, (BlockNumber) r, checksums);
+		checksum_secs = elapsed(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (r = 0; r < rounds; r++)
+			for (i = 0; i < npages; i++)
+				nzero += page_is_zero(zeroes + (size_t) i * BLCKSZ);
+		zero_secs = elapsed(&start);
+
+		printf("%-8s checksum %8.1f MB/s, zero check %8.1f MB/s\n", kernels[k],
+			   (double) npages * rounds * BLCKSZ / checksum_secs / (1024 * 1024),
+			   (double) nzero * BLCKSZ / zero_secs / (1024 * 1024));
+	}
+
+	free(pages);
+	free(zeroes);
+	free(expected);
+	free(checksums);
+	return 0;
+}
@@ -194,3 +194,155 @@ parray_bsearch(parray *array, const void *key, int(*compare)(const void *, const
 {
 	return bsearch(&key, array->data, array->used, sizeof(void *), compare);
 }
+
+struct parray_index
+{
+	void	  **slots;		/* element pointers, NULL if empty */
+	size_t		mask;		/* number of slots minus one */
+	size_t		used;		/* slots holding an element or a tombstone */
+	uint32	  (*hash)(const void *);
+	int		  (*compare)(const void *, const void *);
+};
+
+/* marks a slot whose element was removed, probing goes on past it */
+static char parray_index_tombstone;
+#define INDEX_TOMBSTONE		((void *) &parray_index_tombstone)
+
+static void
+parray_index_resize(parray_index *index, size_t nslots)
+{
+	void	  **old_slots = index->slots;
+	size_t		old_nslots = old_slots ? index->mask + 1 : 0;
+	size_t		i;
+
+	index->slots = pgut_malloc(sizeof(void *) * nslots);
+	memset(index->slots, 0, sizeof(void *) * nslots);
+	index->mask = nslots - 1;
+	index->used = 0;
+
+	for (i = 0; i < old_nslots; i++)
+	{
+		if (old_slots[i] != NULL && old_slots[i] != INDEX_TOMBSTONE)
+			parray_index_add(index, old_slots[i]);
+	}
+	free(old_slots);
+}
+
+/*
+ * Create a hash index of the elements of array.  Elements appended to the
+ * array later are found only once they are given to parray_index_add().
+ * Never returns NULL.
+ */
+parray_index *
+parray_index_new(parray *array, uint32 (*hash)(const void *),
+				 int(*compare)(const void *, const void *))
+{
+	parray_index *index = pgut_new(parray_index);
+	size_t		nslots = 16;
+	size_t		i;
+
+	/* keep the load under one half */
+	while (nslots < array->used * 2)
+		nslots <<= 1;
+
+	index->slots = NULL;
+	index->hash = hash;
+	index->compare = compare;
+	parray_index_resize(index, nslots);
+
+	for (i = 0; i < array->used; i++)
+		parray_index_add(index, array->data[i]);
+
+	return index;
+}
+
+void
+parray_index_free(parray_index *index)
+{
+	if (index == NULL)
+		return;
+	free(index->slots);
+	free(index);
+}
+
+void
+parray_index_add(parray_index *index, void *elem)
+{
+	size_t		slot;
+
+	if ((index->used + 1) * 2 > index->mask + 1)
+		parray_index_resize(index, (index->mask + 1) * 2);
+
+	slot = index->hash(elem) & index->mask;
+	while (index->slots[slot] != NULL)
+		slot = (slot + 1) & index->mask;
+
+	index->slots[slot] = elem;
+	index->used++;
+}
+
+/*
+ * Remove elem itself, not an equal element, from the index.  Returns false
+ * if it isn't indexed.
+ */
+bool
+parray_index_remove(parray_index *index, const void *elem)
+{
+	size_t		slot = index->hash(elem) & index->mask;
+
+	while (index->slots[slot] != NULL)
+	{
+		if (index->slots[slot] == elem)
+		{
+			index->slots[slot] = INDEX_TOMBSTONE;
+			return true;
+		}
+		slot = (slot + 1) & index->mask;
+	}
+	return false;
+}
+
+/*
+ * Return an element equal to key, or NULL if there is none.
+ */
+void *
+parray_index_find(const parray_index *index, const void *key)
+{
+	size_t		slot = index->hash(key) & index->mask;
+
+	while (index->slots[slot] != NULL)
+	{
+		void	   *elem = index->slots[slot];
+
+		if (elem != INDEX_TOMBSTONE && index->compare(&key, &elem) == 0)
+			return elem;
+		slot = (slot + 1) & index->mask;
+	}
+	return NULL;
+}
+
+/* FNV-1a with a final avalanche, keys often differ in a few low bits only */
+uint32
+parray_hash_bytes(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	uint32		h = 2166136261u;
+	size_t		i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619u;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+uint32
+parray_hash_string(const char *str)
+{
+	return parray_hash_bytes(str, strlen(str));
+}
@@ -31,5 +31,22 @@ extern void parray_qsort(parray *array, int(*compare)(const void *, const void *
 extern void *parray_bsearch(parray *array, const void *key, int(*compare)(const void *, const void *));
 extern void parray_walk(parray *array, void (*action)(void *));
 
+/*
+ * "parray_index" is an open addressing hash index over the elements of a
+ * parray.  It holds the element pointers themselves, so the array may be
+ * sorted while indexed, but elements removed from the array must be removed
+ * from the index too.  compare() takes pointers to elements as with
+ * parray_bsearch(), hash() takes the element itself.
+ */
+typedef struct parray_index parray_index;
+
+extern parray_index *parray_index_new(parray *array, uint32 (*hash)(const void *), int(*compare)(const void *, const void *));
+extern void parray_index_free(parray_index *index);
+extern void parray_index_add(parray_index *index, void *elem);
+extern bool parray_index_remove(parray_index *index, const void *elem);
+extern void *parray_index_find(const parray_index *index, const void *key);
+extern uint32 parray_hash_bytes(const void *data, size_t len);
+extern uint32 parray_hash_string(const char *str);
+
 #endif /* PARRAY_H */
 
@@ -14,6 +14,11 @@
 #include "pg_probackup.h"
 
 #include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "commands/dbcommands_xlog.h"
 #include "catalog/storage_xlog.h"
@@ -33,42 +38,394 @@ static const char *RmgrNames[RM_MAX_ID + 1] = {
 static void extractPageInfo(XLogReaderState *record);
 static bool getRecordTimestamp(XLogReaderState *record, TimestampTz *recordXtime);
 
-static int	xlogreadfd = -1;
-static XLogSegNo xlogreadsegno = -1;
-static char xlogfpath[MAXPGPATH];
+/* A block of a main fork modified by WAL */
+typedef struct WalBlockRef
+{
+	Oid			spcNode;
+	Oid			dbNode;
+	Oid			relNode;
+	BlockNumber	blkno;
+} WalBlockRef;
+
+typedef struct WalBlockRefs
+{
+	WalBlockRef *refs;
+	size_t		num;
+	size_t		size;
+} WalBlockRefs;
 
+/*
+ * State of a WAL reader.  Each reader keeps its own open segment, so that
+ * several of them can scan the archive concurrently.  The whole segment is
+ * mapped, or read if it cannot be mapped, at once, and pages are copied out
+ * of it without a system call per page.
+ */
 typedef struct XLogPageReadPrivate
 {
 	const char *archivedir;
 	TimeLineID	tli;
+	char	   *xlogbuf;		/* contents of the open segment or NULL */
+	size_t		xlogbufsize;
+	bool		xlogbuf_mapped;	/* xlogbuf is mmap'ed, not malloc'ed */
+	XLogSegNo	xlogreadsegno;
+	char		xlogfpath[MAXPGPATH];
+	datapagemap_t *pagemaps;	/* page maps of backup_files_list, used by
+								 * extractPageMap() only */
+	WalBlockRefs *blockrefs;	/* if set, collect the modified blocks here
+								 * instead of page maps */
 } XLogPageReadPrivate;
 
+/* Range of WAL scanned by one extractPageMap() thread */
+typedef struct
+{
+	XLogPageReadPrivate private;
+	XLogRecPtr	startpoint;		/* start of the range */
+	bool		exact_start;	/* is startpoint a record boundary? */
+	XLogRecPtr	endpoint;		/* records starting after it belong to the
+								 * next range */
+} xlog_thread_arg;
+
 static int SimpleXLogPageRead(XLogReaderState *xlogreader,
 				   XLogRecPtr targetPagePtr,
 				   int reqLen, XLogRecPtr targetRecPtr, char *readBuf,
 				   TimeLineID *pageTLI);
 
+static void
+InitXLogPageRead(XLogPageReadPrivate *private, const char *archivedir,
+				 TimeLineID tli)
+{
+	private->archivedir = archivedir;
+	private->tli = tli;
+	private->xlogbuf = NULL;
+	private->xlogbufsize = 0;
+	private->xlogbuf_mapped = false;
+	private->xlogreadsegno = 0;
+	private->xlogfpath[0] = '\0';
+	private->pagemaps = NULL;
+	private->blockrefs = NULL;
+}
+
+static void
+CleanupXLogPageRead(XLogPageReadPrivate *private)
+{
+	if (private->xlogbuf == NULL)
+		return;
+
+	if (private->xlogbuf_mapped)
+		munmap(private->xlogbuf, private->xlogbufsize);
+	else
+		pg_free(private->xlogbuf);
+	private->xlogbuf = NULL;
+	private->xlogbufsize = 0;
+}
+
 /*
- * Read WAL from the archive directory, starting from 'startpoint' on the
- * given timeline, until 'endpoint'. Make note of the data blocks touched
- * by the WAL records, and return them in a page map.
+ * Load the segment private->xlogreadsegno into private->xlogbuf.  Returns
+ * false if the segment cannot be opened or read.
  */
-void
-extractPageMap(const char *archivedir, XLogRecPtr startpoint, TimeLineID tli,
-			   XLogRecPtr endpoint)
+static bool
+OpenXLogSegment(XLogPageReadPrivate *private)
+{
+	char		xlogfname[MAXFNAMELEN];
+	struct stat	st;
+	int			fd;
+
+	XLogFileName(xlogfname, private->tli, private->xlogreadsegno);
+	snprintf(private->xlogfpath, MAXPGPATH, "%s/%s", private->archivedir,
+			 xlogfname);
+	elog(LOG, "opening WAL segment \"%s\"", private->xlogfpath);
+
+	fd = open(private->xlogfpath, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+	{
+		elog(INFO, "could not open WAL segment \"%s\": %s",
+			 private->xlogfpath, strerror(errno));
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0)
+	{
+		elog(WARNING, "could not stat file \"%s\": %s",
+			 private->xlogfpath, strerror(errno));
+		close(fd);
+		return false;
+	}
+	if (st.st_size < XLOG_BLCKSZ)
+	{
+		elog(WARNING, "WAL segment \"%s\" is too short", private->xlogfpath);
+		close(fd);
+		return false;
+	}
+	private->xlogbufsize = Min((size_t) st.st_size, XLogSegSize);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	(void) posix_fadvise(fd, 0, private->xlogbufsize, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	private->xlogbuf = mmap(NULL, private->xlogbufsize, PROT_READ, MAP_PRIVATE,
+							fd, 0);
+	if (private->xlogbuf != MAP_FAILED)
+	{
+		private->xlogbuf_mapped = true;
+#ifdef MADV_SEQUENTIAL
+		(void) madvise(private->xlogbuf, private->xlogbufsize, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+		(void) madvise(private->xlogbuf, private->xlogbufsize, MADV_WILLNEED);
+#endif
+	}
+	else
+	{
+		/* fall back to reading the whole segment with large reads */
+		size_t		done = 0;
+
+		private->xlogbuf_mapped = false;
+		private->xlogbuf = pg_malloc(private->xlogbufsize);
+		while (done < private->xlogbufsize)
+		{
+			ssize_t		rc = read(fd, private->xlogbuf + done,
+								  private->xlogbufsize - done);
+
+			if (rc <= 0)
+			{
+				elog(WARNING, "could not read from file \"%s\": %s",
+					 private->xlogfpath, rc < 0 ? strerror(errno) : "unexpected EOF");
+				close(fd);
+				CleanupXLogPageRead(private);
+				return false;
+			}
+			done += rc;
+		}
+	}
+
+	close(fd);
+	return true;
+}
+
+/*
+ * OR the blocks of src into dst.
+ */
+static void
+datapagemap_merge(datapagemap_t *dst, const datapagemap_t *src)
+{
+	int			i;
+
+	if (src->bitmapsize > dst->bitmapsize)
+	{
+		dst->bitmap = pg_realloc(dst->bitmap, src->bitmapsize);
+		memset(dst->bitmap + dst->bitmapsize, 0,
+			   src->bitmapsize - dst->bitmapsize);
+		dst->bitmapsize = src->bitmapsize;
+	}
+
+	for (i = 0; i < src->bitmapsize; i++)
+		dst->bitmap[i] |= src->bitmap[i];
+}
+
+/*
+ * WAL summaries
+ *
+ * A summary lists the blocks of main forks modified by the records starting
+ * in one archived WAL segment.  It is kept under the summaries directory of
+ * the WAL archive, named after the segment, and lets extractPageMap() skip
+ * decoding of the segment.  The file consists of a WalSummaryHeader and
+ * sorted unique WalBlockRef entries.
+ */
+#define WAL_SUMMARY_MAGIC		0x50425753	/* "PBWS" */
+#define WAL_SUMMARY_VERSION		1
+
+typedef struct WalSummaryHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		nblocks;		/* number of WalBlockRef entries */
+	pg_crc32	crc;			/* CRC of the entries */
+} WalSummaryHeader;
+
+static void
+wal_summary_path(char *path, const char *archivedir, TimeLineID tli,
+				 XLogSegNo segno)
+{
+	char		xlogfname[MAXFNAMELEN];
+
+	XLogFileName(xlogfname, tli, segno);
+	snprintf(path, MAXPGPATH, "%s/%s/%s", archivedir, WAL_SUMMARY_DIR,
+			 xlogfname);
+}
+
+static bool
+wal_summary_exists(const char *archivedir, TimeLineID tli, XLogSegNo segno)
+{
+	char		path[MAXPGPATH];
+
+	wal_summary_path(path, archivedir, tli, segno);
+	return access(path, F_OK) == 0;
+}
+
+/*
+ * Note the blocks listed in the summary of the segment in the page maps of
+ * the reader.  Returns false if there is no usable summary.
+ */
+static bool
+apply_wal_summary(XLogPageReadPrivate *private, XLogSegNo segno)
+{
+	char		path[MAXPGPATH];
+	FILE	   *fp;
+	WalSummaryHeader header;
+	WalBlockRef *refs;
+	pg_crc32	crc;
+	uint32		i;
+
+	wal_summary_path(path, private->archivedir, private->tli, segno);
+	fp = fopen(path, PG_BINARY_R);
+	if (fp == NULL)
+	{
+		if (errno != ENOENT)
+			elog(WARNING, "could not open WAL summary \"%s\": %s",
+				 path, strerror(errno));
+		return false;
+	}
+
+	if (fread(&header, 1, sizeof(header), fp) != sizeof(header) ||
+		header.magic != WAL_SUMMARY_MAGIC ||
+		header.version != WAL_SUMMARY_VERSION)
+	{
+		elog(WARNING, "invalid WAL summary \"%s\", decoding WAL", path);
+		fclose(fp);
+		return false;
+	}
+
+	refs = (WalBlockRef *) pg_malloc(sizeof(WalBlockRef) * (header.nblocks + 1));
+	if (fread(refs, sizeof(WalBlockRef), header.nblocks, fp) != header.nblocks)
+	{
+		elog(WARNING, "could not read WAL summary \"%s\", decoding WAL", path);
+		pg_free(refs);
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, refs, sizeof(WalBlockRef) * header.nblocks);
+	FIN_CRC32C(crc);
+	if (!EQ_CRC32C(crc, header.crc))
+	{
+		elog(WARNING, "WAL summary \"%s\" is corrupted, decoding WAL", path);
+		pg_free(refs);
+		return false;
+	}
+
+	elog(LOG, "using WAL summary \"%s\"", path);
+	for (i = 0; i < header.nblocks; i++)
+	{
+		RelFileNode rnode;
+
+		rnode.spcNode = refs[i].spcNode;
+		rnode.dbNode = refs[i].dbNode;
+		rnode.relNode = refs[i].relNode;
+		process_block_change(MAIN_FORKNUM, rnode, refs[i].blkno,
+							 private->pagemaps);
+	}
+
+	pg_free(refs);
+	return true;
+}
+
+static int
+WalBlockRefCompare(const void *a, const void *b)
 {
+	const WalBlockRef *ref1 = (const WalBlockRef *) a;
+	const WalBlockRef *ref2 = (const WalBlockRef *) b;
+
+	if (ref1->spcNode != ref2->spcNode)
+		return ref1->spcNode < ref2->spcNode ? -1 : 1;
+	if (ref1->dbNode != ref2->dbNode)
+		return ref1->dbNode < ref2->dbNode ? -1 : 1;
+	if (ref1->relNode != ref2->relNode)
+		return ref1->relNode < ref2->relNode ? -1 : 1;
+	if (ref1->blkno != ref2->blkno)
+		return ref1->blkno < ref2->blkno ? -1 : 1;
+	return 0;
+}
+
+static void
+write_wal_summary(const char *archivedir, TimeLineID tli, XLogSegNo segno,
+				  WalBlockRefs *blockrefs)
+{
+	char		path[MAXPGPATH];
+	char		tmp_path[MAXPGPATH];
+	FILE	   *fp;
+	WalSummaryHeader header;
+	size_t		i;
+	size_t		n = 0;
+
+	/* sort and remove duplicates */
+	if (blockrefs->num > 0)
+	{
+		qsort(blockrefs->refs, blockrefs->num, sizeof(WalBlockRef),
+			  WalBlockRefCompare);
+		for (i = 1, n = 1; i < blockrefs->num; i++)
+		{
+			if (WalBlockRefCompare(&blockrefs->refs[n - 1],
+								   &blockrefs->refs[i]) != 0)
+				blockrefs->refs[n++] = blockrefs->refs[i];
+		}
+	}
+
+	header.magic = WAL_SUMMARY_MAGIC;
+	header.version = WAL_SUMMARY_VERSION;
+	header.nblocks = (uint32) n;
+	INIT_CRC32C(header.crc);
+	COMP_CRC32C(header.crc, blockrefs->refs, sizeof(WalBlockRef) * n);
+	FIN_CRC32C(header.crc);
+
+	/* write into a temporary file to never leave a partial summary */
+	wal_summary_path(path, archivedir, tli, segno);
+	snprintf(tmp_path, MAXPGPATH, "%s.tmp", path);
+	fp = fopen(tmp_path, PG_BINARY_W);
+	if (fp == NULL)
+		elog(ERROR, "could not create WAL summary \"%s\": %s",
+			 tmp_path, strerror(errno));
+	if (fwrite(&header, 1, sizeof(header), fp) != sizeof(header) ||
+		fwrite(blockrefs->refs, sizeof(WalBlockRef), n, fp) != n ||
+		fclose(fp) != 0)
+		elog(ERROR, "could not write WAL summary \"%s\": %s",
+			 tmp_path, strerror(errno));
+	if (rename(tmp_path, path) < 0)
+		elog(ERROR, "could not rename \"%s\" to \"%s\": %s",
+			 tmp_path, path, strerror(errno));
+
+	elog(LOG, "WAL summary \"%s\": %lu blocks", path, (unsigned long) n);
+}
+
+/*
+ * Scan the records starting between startpoint and endpoint and note the
+ * blocks they touch.  A record crossing endpoint is read completely; a
+ * scan of the following range skips it with XLogFindNextRecord(), which is
+ * used unless startpoint is known to be a record boundary.
+ */
+static void
+scan_wal_range(XLogPageReadPrivate *private, XLogRecPtr startpoint,
+			   bool exact_start, XLogRecPtr endpoint)
+{
+	XLogRecPtr	first = startpoint;
 	XLogRecord *record;
 	XLogReaderState *xlogreader;
 	char	   *errormsg;
-	XLogPageReadPrivate private;
 
-	private.archivedir = archivedir;
-	private.tli = tli;
-	xlogreader = XLogReaderAllocate(&SimpleXLogPageRead, &private);
+	xlogreader = XLogReaderAllocate(&SimpleXLogPageRead, private);
 	if (xlogreader == NULL)
 		elog(ERROR, "out of memory");
 
-	do
+	if (!exact_start)
+	{
+		startpoint = XLogFindNextRecord(xlogreader, startpoint);
+		if (XLogRecPtrIsInvalid(startpoint))
+			elog(ERROR, "could not find a valid record after %X/%X",
+				 (uint32) (first >> 32), (uint32) (first));
+	}
+
+	while (true)
 	{
 		record = XLogReadRecord(xlogreader, startpoint, &errormsg);
 		if (record == NULL)
@@ -83,22 +440,172 @@ extractPageMap(const char *archivedir, XLogRecPtr startpoint, TimeLineID tli,
 						 errormsg);
 			else
 				elog(ERROR, "could not read WAL record at %X/%X",
-						 (uint32) (startpoint >> 32),
-						 (uint32) (startpoint));
+						 (uint32) (errptr >> 32), (uint32) (errptr));
 		}
 
+		/* the record belongs to the next range */
+		if (xlogreader->ReadRecPtr > endpoint)
+			break;
+
 		extractPageInfo(xlogreader);
 
-		startpoint = InvalidXLogRecPtr; /* continue reading at next record */
+		if (xlogreader->ReadRecPtr == endpoint)
+			break;
 
-	} while (xlogreader->ReadRecPtr != endpoint);
+		startpoint = InvalidXLogRecPtr; /* continue reading at next record */
+	}
 
 	XLogReaderFree(xlogreader);
-	if (xlogreadfd != -1)
+}
+
+/*
+ * Note the blocks touched by the WAL of one extractPageMap() range in the
+ * thread's own page maps.  Segments having a summary are taken from it,
+ * runs of segments without one are decoded.
+ */
+static void
+doExtractPageMap(void *arg)
+{
+	xlog_thread_arg *extract_arg = (xlog_thread_arg *) arg;
+	XLogPageReadPrivate *private = &extract_arg->private;
+	XLogSegNo	firstSegNo;
+	XLogSegNo	endSegNo;
+	XLogSegNo	segno;
+
+	XLByteToSeg(extract_arg->startpoint, firstSegNo);
+	XLByteToSeg(extract_arg->endpoint, endSegNo);
+
+	segno = firstSegNo;
+	while (segno <= endSegNo)
+	{
+		XLogSegNo	lastSegNo = segno;
+		XLogRecPtr	startpoint;
+		XLogRecPtr	endpoint;
+		bool		exact_start = false;
+
+		if (apply_wal_summary(private, segno))
+		{
+			segno++;
+			continue;
+		}
+
+		while (lastSegNo < endSegNo &&
+			   !wal_summary_exists(private->archivedir, private->tli,
+								   lastSegNo + 1))
+			lastSegNo++;
+
+		if (segno == firstSegNo)
+		{
+			startpoint = extract_arg->startpoint;
+			exact_start = extract_arg->exact_start;
+		}
+		else
+			XLogSegNoOffsetToRecPtr(segno, 0, startpoint);
+
+		if (lastSegNo == endSegNo)
+			endpoint = extract_arg->endpoint;
+		else
+		{
+			XLogSegNoOffsetToRecPtr(lastSegNo + 1, 0, endpoint);
+			endpoint--;
+		}
+
+		scan_wal_range(private, startpoint, exact_start, endpoint);
+		segno = lastSegNo + 1;
+	}
+
+	CleanupXLogPageRead(private);
+}
+
+/*
+ * Read WAL from the archive directory, starting from 'startpoint' on the
+ * given timeline, until 'endpoint'. Make note of the data blocks touched
+ * by the WAL records in the page maps of backup_files_list.
+ *
+ * The segments are divided into num_threads ranges scanned in parallel,
+ * each thread filling its own page maps, which are merged at the end.
+ */
+void
+extractPageMap(const char *archivedir, XLogRecPtr startpoint, TimeLineID tli,
+			   XLogRecPtr endpoint)
+{
+	XLogSegNo	startSegNo;
+	XLogSegNo	endSegNo;
+	XLogSegNo	nsegs;
+	size_t		nfiles = parray_num(backup_files_list);
+	int			nthreads = num_threads;
+	pthread_t  *threads;
+	xlog_thread_arg *thread_args;
+	int			i;
+	int			j;
+
+	XLByteToSeg(startpoint, startSegNo);
+	XLByteToSeg(endpoint, endSegNo);
+	nsegs = endSegNo - startSegNo + 1;
+	if (nsegs < (XLogSegNo) nthreads)
+		nthreads = (int) nsegs;
+
+	threads = (pthread_t *) pg_malloc(sizeof(pthread_t) * nthreads);
+	thread_args = (xlog_thread_arg *) pg_malloc(sizeof(xlog_thread_arg) * nthreads);
+
+	for (i = 0; i < nthreads; i++)
 	{
-		close(xlogreadfd);
-		xlogreadfd = -1;
+		xlog_thread_arg *arg = &thread_args[i];
+		XLogSegNo	segno = startSegNo + nsegs * i / nthreads;
+		XLogSegNo	next_segno = startSegNo + nsegs * (i + 1) / nthreads;
+
+		InitXLogPageRead(&arg->private, archivedir, tli);
+		arg->private.pagemaps = (datapagemap_t *)
+			pg_malloc0(sizeof(datapagemap_t) * nfiles);
+
+		if (i == 0)
+		{
+			arg->startpoint = startpoint;
+			arg->exact_start = true;
+		}
+		else
+		{
+			XLogSegNoOffsetToRecPtr(segno, 0, arg->startpoint);
+			arg->exact_start = false;
+		}
+
+		if (i == nthreads - 1)
+			arg->endpoint = endpoint;
+		else
+		{
+			XLogSegNoOffsetToRecPtr(next_segno, 0, arg->endpoint);
+			arg->endpoint--;
+		}
+
+		elog(LOG, "scan WAL range %X/%X - %X/%X",
+			 (uint32) (arg->startpoint >> 32), (uint32) arg->startpoint,
+			 (uint32) (arg->endpoint >> 32), (uint32) arg->endpoint);
+		pthread_create(&threads[i], NULL,
+					   (void *(*)(void *)) doExtractPageMap, arg);
 	}
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* merge page maps of all threads into the files */
+	for (i = 0; i < nthreads; i++)
+	{
+		datapagemap_t *pagemaps = thread_args[i].private.pagemaps;
+
+		for (j = 0; j < nfiles; j++)
+		{
+			pgFile	   *file = (pgFile *) parray_get(backup_files_list, j);
+
+			if (pagemaps[j].bitmapsize == 0)
+				continue;
+			datapagemap_merge(&file->pagemap, &pagemaps[j]);
+			pg_free(pagemaps[j].bitmap);
+		}
+		pg_free(pagemaps);
+	}
+
+	pg_free(threads);
+	pg_free(thread_args);
 }
 
 void
@@ -117,8 +624,7 @@ validate_wal(pgBackup *backup,
 	TimestampTz last_time = 0;
 	char	timestamp[100];
 
-	private.archivedir = archivedir;
-	private.tli = tli;
+	InitXLogPageRead(&private, archivedir, tli);
 	xlogreader = XLogReaderAllocate(&SimpleXLogPageRead, &private);
 	if (xlogreader == NULL)
 		elog(ERROR, "out of memory");
@@ -174,11 +680,177 @@ validate_wal(pgBackup *backup,
 
 	/* clean */
 	XLogReaderFree(xlogreader);
-	if (xlogreadfd != -1)
+	CleanupXLogPageRead(&private);
+}
+
+/* Segment to be summarized by do_summarize_wal() */
+typedef struct
+{
+	TimeLineID	tli;
+	XLogSegNo	segno;
+} summarize_segment;
+
+typedef struct
+{
+	parray	   *segments;
+	volatile uint32 *next;		/* index of the next segment to take */
+} summarize_wal_arg;
+
+static void
+doSummarizeWal(void *arg)
+{
+	summarize_wal_arg *summarize_arg = (summarize_wal_arg *) arg;
+	WalBlockRefs blockrefs;
+
+	blockrefs.refs = NULL;
+	blockrefs.size = 0;
+
+	while (true)
 	{
-		close(xlogreadfd);
-		xlogreadfd = -1;
+		uint32		i = __sync_fetch_and_add(summarize_arg->next, 1);
+		summarize_segment *segment;
+		XLogPageReadPrivate private;
+		XLogRecPtr	startpoint;
+		XLogRecPtr	endpoint;
+
+		if (i >= parray_num(summarize_arg->segments))
+			break;
+
+		if (interrupted)
+			elog(ERROR, "interrupted during WAL summarizing");
+
+		segment = (summarize_segment *) parray_get(summarize_arg->segments, i);
+		InitXLogPageRead(&private, arclog_path, segment->tli);
+		blockrefs.num = 0;
+		private.blockrefs = &blockrefs;
+
+		XLogSegNoOffsetToRecPtr(segment->segno, 0, startpoint);
+		XLogSegNoOffsetToRecPtr(segment->segno + 1, 0, endpoint);
+		endpoint--;
+
+		scan_wal_range(&private, startpoint, false, endpoint);
+		CleanupXLogPageRead(&private);
+
+		write_wal_summary(arclog_path, segment->tli, segment->segno,
+						  &blockrefs);
 	}
+
+	pg_free(blockrefs.refs);
+}
+
+/*
+ * Remove the temporary files of summaries that an interrupted run left in
+ * summary_dir.  They are never read, as a summary is used under its final
+ * name only.
+ */
+static void
+remove_stale_wal_summaries(const char *summary_dir)
+{
+	DIR		   *dir;
+	struct dirent *de;
+
+	dir = opendir(summary_dir);
+	if (dir == NULL)
+		elog(ERROR, "could not open directory \"%s\": %s",
+			 summary_dir, strerror(errno));
+
+	while (errno = 0, (de = readdir(dir)) != NULL)
+	{
+		size_t		len = strlen(de->d_name);
+		char		path[MAXPGPATH];
+
+		if (len <= 4 || strcmp(de->d_name + len - 4, ".tmp") != 0)
+			continue;
+
+		join_path_components(path, summary_dir, de->d_name);
+		elog(LOG, "removing stale WAL summary \"%s\"", path);
+		if (unlink(path) < 0 && errno != ENOENT)
+			elog(ERROR, "could not remove \"%s\": %s", path, strerror(errno));
+		errno = 0;
+	}
+	if (errno)
+		elog(ERROR, "could not read directory \"%s\": %s",
+			 summary_dir, strerror(errno));
+	closedir(dir);
+}
+
+/*
+ * Write summaries of the archived WAL segments which don't have one yet.
+ * A segment is summarized only when the following segment of the same
+ * timeline is archived too, as its last record may continue there.
+ */
+int
+do_summarize_wal(void)
+{
+	char		summary_dir[MAXPGPATH];
+	DIR		   *arcdir;
+	struct dirent *arcde;
+	parray	   *segments = parray_new();
+	volatile uint32 next = 0;
+	pthread_t  *threads;
+	summarize_wal_arg arg;
+	int			i;
+
+	join_path_components(summary_dir, arclog_path, WAL_SUMMARY_DIR);
+	dir_create_dir(summary_dir, DIR_PERMISSION);
+	remove_stale_wal_summaries(summary_dir);
+
+	arcdir = opendir(arclog_path);
+	if (arcdir == NULL)
+		elog(ERROR, "could not open archive location \"%s\": %s",
+			 arclog_path, strerror(errno));
+
+	while (errno = 0, (arcde = readdir(arcdir)) != NULL)
+	{
+		summarize_segment *segment;
+		TimeLineID	tli;
+		XLogSegNo	segno;
+		char		next_fname[MAXFNAMELEN];
+		char		next_path[MAXPGPATH];
+
+		if (!IsXLogFileName(arcde->d_name))
+			continue;
+
+		XLogFromFileName(arcde->d_name, &tli, &segno);
+		if (wal_summary_exists(arclog_path, tli, segno))
+			continue;
+
+		XLogFileName(next_fname, tli, segno + 1);
+		join_path_components(next_path, arclog_path, next_fname);
+		if (!fileExists(next_path))
+		{
+			elog(LOG, "WAL segment \"%s\" is not archived yet, skip \"%s\"",
+				 next_fname, arcde->d_name);
+			continue;
+		}
+
+		segment = pgut_new(summarize_segment);
+		segment->tli = tli;
+		segment->segno = segno;
+		parray_append(segments, segment);
+	}
+	if (errno)
+		elog(ERROR, "could not read archive location \"%s\": %s",
+			 arclog_path, strerror(errno));
+	closedir(arcdir);
+
+	arg.segments = segments;
+	arg.next = &next;
+	threads = (pthread_t *) pg_malloc(sizeof(pthread_t) * num_threads);
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&threads[i], NULL,
+					   (void *(*)(void *)) doSummarizeWal, &arg);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	elog(INFO, "summarized %lu WAL segments",
+		 (unsigned long) parray_num(segments));
+
+	parray_walk(segments, pg_free);
+	parray_free(segments);
+	pg_free(threads);
+
+	return 0;
 }
 
 /* XLogreader callback function, to read a WAL page */
@@ -198,54 +870,30 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 	 * See if we need to switch to a new segment because the requested record
 	 * is not in the currently open one.
 	 */
-	if (xlogreadfd >= 0 && !XLByteInSeg(targetPagePtr, xlogreadsegno))
-	{
-		close(xlogreadfd);
-		xlogreadfd = -1;
-	}
-
-	XLByteToSeg(targetPagePtr, xlogreadsegno);
+	if (private->xlogbuf != NULL &&
+		!XLByteInSeg(targetPagePtr, private->xlogreadsegno))
+		CleanupXLogPageRead(private);
 
-	if (xlogreadfd < 0)
-	{
-		char		xlogfname[MAXFNAMELEN];
-
-		XLogFileName(xlogfname, private->tli, xlogreadsegno);
-		snprintf(xlogfpath, MAXPGPATH, "%s/%s", private->archivedir,
-				 xlogfname);
-		elog(LOG, "opening WAL segment \"%s\"", xlogfpath);
+	XLByteToSeg(targetPagePtr, private->xlogreadsegno);
 
-		xlogreadfd = open(xlogfpath, O_RDONLY | PG_BINARY, 0);
-
-		if (xlogreadfd < 0)
-		{
-			elog(INFO, "could not open WAL segment \"%s\": %s",
-				 xlogfpath, strerror(errno));
-			return -1;
-		}
-	}
+	if (private->xlogbuf == NULL && !OpenXLogSegment(private))
+		return -1;
 
 	/*
-	 * At this point, we have the right segment open.
+	 * At this point, we have the right segment loaded.
 	 */
-	Assert(xlogreadfd != -1);
-
-	/* Read the requested page */
-	if (lseek(xlogreadfd, (off_t) targetPageOff, SEEK_SET) < 0)
-	{
-		elog(WARNING, "could not seek in file \"%s\": %s", xlogfpath,
-			 strerror(errno));
-		return -1;
-	}
+	Assert(private->xlogbuf != NULL);
 
-	if (read(xlogreadfd, readBuf, XLOG_BLCKSZ) != XLOG_BLCKSZ)
+	/* Copy the requested page */
+	if (targetPageOff + XLOG_BLCKSZ > private->xlogbufsize)
 	{
-		elog(WARNING, "could not read from file \"%s\": %s",
-			 xlogfpath, strerror(errno));
+		elog(WARNING, "could not read from file \"%s\": page at offset %u is beyond end of file",
+			 private->xlogfpath, targetPageOff);
 		return -1;
 	}
+	memcpy(readBuf, private->xlogbuf + targetPageOff, XLOG_BLCKSZ);
 
-	Assert(targetSegNo == xlogreadsegno);
+	Assert(targetSegNo == private->xlogreadsegno);
 
 	*pageTLI = private->tli;
 	return XLOG_BLCKSZ;
@@ -257,6 +905,7 @@ SimpleXLogPageRead(XLogReaderState *xlogreader, XLogRecPtr targetPagePtr,
 static void
 extractPageInfo(XLogReaderState *record)
 {
+	XLogPageReadPrivate *private = (XLogPageReadPrivate *) record->private_data;
 	uint8		block_id;
 	RmgrId		rmid = XLogRecGetRmid(record);
 	uint8		info = XLogRecGetInfo(record);
@@ -319,7 +968,25 @@ extractPageInfo(XLogReaderState *record)
 		if (forknum != MAIN_FORKNUM)
 			continue;
 
-		process_block_change(forknum, rnode, blkno);
+		if (private->blockrefs != NULL)
+		{
+			WalBlockRefs *blockrefs = private->blockrefs;
+
+			if (blockrefs->num == blockrefs->size)
+			{
+				blockrefs->size = Max(blockrefs->size * 2, 1024);
+				blockrefs->refs = (WalBlockRef *)
+					pg_realloc(blockrefs->refs,
+							   sizeof(WalBlockRef) * blockrefs->size);
+			}
+			blockrefs->refs[blockrefs->num].spcNode = rnode.spcNode;
+			blockrefs->refs[blockrefs->num].dbNode = rnode.dbNode;
+			blockrefs->refs[blockrefs->num].relNode = rnode.relNode;
+			blockrefs->refs[blockrefs->num].blkno = blkno;
+			blockrefs->num++;
+		}
+		else
+			process_block_change(forknum, rnode, blkno, private->pagemaps);
 	}
 }
 
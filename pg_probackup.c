@@ -41,14 +41,21 @@ static bool		backup_logs = false;
 bool			progress = false;
 bool			delete_wal = false;
 uint64			system_identifier = 0;
+CompressAlg		compress_alg = NONE_COMPRESS;
+int				compress_level = DEFAULT_COMPRESS_LEVEL;
+ReadMode		read_mode = READ_MODE_BUFFERED;
 
 /* restore configuration */
 static char		   *target_time;
 static char		   *target_xid;
 static char		   *target_inclusive;
 static TimeLineID	target_tli;
+bool				incremental_restore = false;
 
 static void opt_backup_mode(pgut_option *opt, const char *arg);
+static void opt_compress_alg(pgut_option *opt, const char *arg);
+static void opt_io_engine(pgut_option *opt, const char *arg);
+static void opt_read_mode(pgut_option *opt, const char *arg);
 
 static pgut_option options[] =
 {
@@ -60,11 +67,17 @@ static pgut_option options[] =
 	{ 'i', 'j', "threads",				&num_threads },
 	{ 'b', 8, "stream",					&stream_wal },
 	{ 'b', 11, "progress",				&progress },
+	{ 'f', 16, "io-engine",				opt_io_engine,			SOURCE_FILE },
+	{ 'f', 17, "read-mode",				opt_read_mode,			SOURCE_FILE },
+	{ 'i', 18, "max-read-rate",			&max_read_rate,			SOURCE_FILE },
+	{ 'i', 19, "max-write-rate",		&max_write_rate,		SOURCE_FILE },
 	/* backup options */
 	{ 'b', 10, "backup-pg-log",			&backup_logs },
 	{ 'f', 'b', "backup-mode",			opt_backup_mode,		SOURCE_ENV },
 	{ 'b', 'C', "smooth-checkpoint",	&smooth_checkpoint,		SOURCE_ENV },
 	{ 's', 'S', "slot",					&replication_slot,		SOURCE_CMDLINE },
+	{ 'f', 14, "compress-algorithm",	opt_compress_alg,		SOURCE_FILE },
+	{ 'i', 15, "compress-level",		&compress_level,		SOURCE_FILE },
 	/* options with only long name (keep-xxx) */
 /*	{ 'i',  1, "keep-data-generations", &keep_data_generations, SOURCE_ENV },
 	{ 'i',  2, "keep-data-days",		&keep_data_days,		SOURCE_ENV },*/
@@ -73,6 +86,7 @@ static pgut_option options[] =
 	{ 's',  4, "xid",					&target_xid,		SOURCE_CMDLINE },
 	{ 's',  5, "inclusive",				&target_inclusive,	SOURCE_CMDLINE },
 	{ 'u',  6, "timeline",				&target_tli,		SOURCE_CMDLINE },
+	{ 'b', 20, "incremental",			&incremental_restore },
 	/* delete options */
 	{ 'b', 12, "wal",					&delete_wal },
 	/* other */
@@ -94,6 +108,9 @@ main(int argc, char *argv[])
 	/* do not buffer progress messages */
 	setvbuf(stdout, 0, _IONBF, 0);	/* TODO: remove this */
 
+	/* choose the page check kernels while there is one thread */
+	pagecheck_init();
+
 	/* initialize configuration */
 	catalog_init_config(&current);
 
@@ -184,6 +201,16 @@ main(int argc, char *argv[])
 	if (num_threads < 1)
 		num_threads = 1;
 
+	if (max_read_rate < 0 || max_write_rate < 0)
+		elog(ERROR, "--max-read-rate and --max-write-rate must not be negative");
+
+	if (compress_level < 0 || compress_level > 9)
+		elog(ERROR, "--compress-level must be in range from 0 to 9");
+#ifndef HAVE_LIBZ
+	if (compress_alg == ZLIB_COMPRESS)
+		elog(ERROR, "zlib compression is not supported by this build");
+#endif
+
 	/* do actual operation */
 	if (pg_strcasecmp(cmd, "init") == 0)
 		return do_init();
@@ -230,6 +257,8 @@ main(int argc, char *argv[])
 		return do_delete(backup_id);
 	else if (pg_strcasecmp(cmd, "delwal") == 0)
 		return do_deletewal(backup_id, true);
+	else if (pg_strcasecmp(cmd, "summarize-wal") == 0)
+		return do_summarize_wal();
 	else
 		elog(ERROR, "invalid command \"%s\"", cmd);
 
@@ -248,6 +277,7 @@ pgut_help(bool details)
 	printf(_("  %s [option...] validate backup-ID\n"), PROGRAM_NAME);
 	printf(_("  %s [option...] delete backup-ID\n"), PROGRAM_NAME);
 	printf(_("  %s [option...] delwal [backup-ID]\n"), PROGRAM_NAME);
+	printf(_("  %s [option...] summarize-wal\n"), PROGRAM_NAME);
 
 	if (!details)
 		return;
@@ -257,7 +287,7 @@ pgut_help(bool details)
 	printf(_("  -D, --pgdata=PATH         location of the database storage area\n"));
 	/*printf(_("  -c, --check               show what would have been done\n"));*/
 	printf(_("\nBackup options:\n"));
-	printf(_("  -b, --backup-mode=MODE    backup mode (full, page, ptrack)\n"));
+	printf(_("  -b, --backup-mode=MODE    backup mode (full, page, ptrack, delta)\n"));
 	printf(_("  -C, --smooth-checkpoint   do smooth checkpoint before backup\n"));
 	printf(_("      --stream              stream the transaction log and include it in the backup\n"));
 	/*printf(_("  --keep-data-generations=N keep GENERATION of full data backup\n"));
@@ -266,13 +296,21 @@ pgut_help(bool details)
 	printf(_("      --backup-pg-log       backup of pg_log directory\n"));
 	printf(_("  -j, --threads=NUM         number of parallel threads\n"));
 	printf(_("      --progress            show progress\n"));
+	printf(_("      --io-engine=ENGINE    I/O of data files (sync, io_uring)\n"));
+	printf(_("      --read-mode=MODE      read files (buffered, direct, dontneed)\n"));
+	printf(_("      --max-read-rate=MB    limit reads to MB per second\n"));
+	printf(_("      --max-write-rate=MB   limit writes to MB per second\n"));
+	printf(_("      --compress-algorithm=ALG  compress data pages (none, pglz, zlib)\n"));
+	printf(_("      --compress-level=LEVEL    compression level (0-9)\n"));
 	printf(_("\nRestore options:\n"));
 	printf(_("      --time                time stamp up to which recovery will proceed\n"));
 	printf(_("      --xid                 transaction ID up to which recovery will proceed\n"));
 	printf(_("      --inclusive           whether we stop just after the recovery target\n"));
 	printf(_("      --timeline            recovering into a particular timeline\n"));
+	printf(_("      --incremental         update the existing data directory in place\n"));
 	printf(_("  -j, --threads=NUM         number of parallel threads\n"));
 	printf(_("      --progress            show progress\n"));
+	printf(_("      --io-engine=ENGINE    I/O of data files (sync, io_uring)\n"));
 	printf(_("\nDelete options:\n"));
 	printf(_("      --wal                 remove unnecessary wal files\n"));
 }
@@ -282,3 +320,21 @@ opt_backup_mode(pgut_option *opt, const char *arg)
 {
 	current.backup_mode = parse_backup_mode(arg);
 }
+
+static void
+opt_compress_alg(pgut_option *opt, const char *arg)
+{
+	compress_alg = parse_compress_alg(arg);
+}
+
+static void
+opt_io_engine(pgut_option *opt, const char *arg)
+{
+	io_engine = parse_io_engine(arg);
+}
+
+static void
+opt_read_mode(pgut_option *opt, const char *arg)
+{
+	read_mode = parse_read_mode(arg);
+}
@@ -38,8 +38,12 @@
 #define PG_RMAN_INI_FILE		"pg_probackup.conf"
 #define MKDIRS_SH_FILE			"mkdirs.sh"
 #define DATABASE_FILE_LIST		"file_database.txt"
+#define DATABASE_FILE_MANIFEST	"file_database.bin"
+#define DATABASE_DIR_LIST		"dir_database.txt"
 #define PG_BACKUP_LABEL_FILE	"backup_label"
 #define PG_BLACK_LIST			"black_list"
+#define WAL_SUMMARY_DIR			"summaries"
+#define THROTTLE_CONTROL_FILE	"throttle.conf"
 
 /* Direcotry/File permission */
 #define DIR_PERMISSION		(0700)
@@ -50,9 +54,26 @@
 #endif
 
 /* backup mode file */
+/*
+ * The backup copy of a data file is hashed in chunks holding the pages of
+ * CHUNK_HASH_BLOCKS consecutive blocks each, so that a part of it can be
+ * checked alone.
+ */
+#define CHUNK_HASH_BLOCKS	64
+
+/* hash of one chunk of the backup copy of a data file */
+typedef struct pgChunkHash
+{
+	uint64		offset;			/* offset of its first page in the backup file */
+	uint32		chunk;			/* holds blocks chunk * CHUNK_HASH_BLOCKS .. */
+	pg_crc32	hash;			/* CRC-32C of the pages */
+} pgChunkHash;
+
 typedef struct pgFile
 {
 	time_t	mtime;			/* time of last modification */
+	long	mtime_nsec;		/* nanoseconds of mtime, 0 if the file system
+							   or the file list has seconds only */
 	mode_t	mode;			/* protection (file type and permission) */
 	size_t	size;			/* size of the file */
 	size_t	read_size;		/* size of the portion read (if only some pages are
@@ -61,13 +82,23 @@ typedef struct pgFile
 							   that the file existed but was not backed up
 							   because not modified since last backup. */
 	pg_crc32 crc;			/* CRC value of the file, regular file only */
+	pgChunkHash *chunks;	/* hashes of the chunks of a data file, in order */
+	int		nchunks;
+	int		nparts;			/* a data file split for the backup is kept in
+							   the files "<path>.partN", 0 if in one file */
 	char	*linked;			/* path of the linked file */
 	bool	is_datafile;	/* true if the file is PostgreSQL data file */
+	bool	is_whole;		/* data file copied with all its pages, so no
+							   older version is needed to restore it */
 	char	*path;			/* path of the file */
 	char	*ptrack_path;
 	int		segno;			/* Segment number for ptrack */
-	volatile uint32 lock;
+	Oid		tblspcOid;		/* relation identity of a data file, parsed */
+	Oid		dbOid;			/* from its path by add_files() */
+	Oid		relOid;
+	ForkNumber forkNum;
 	datapagemap_t pagemap;
+	bool	in_arena;		/* entry, path and linked are in file_arena */
 } pgFile;
 
 #define IsValidTime(tm)	\
@@ -100,9 +131,40 @@ typedef enum BackupMode
 	BACKUP_MODE_INVALID = 0,
 	BACKUP_MODE_DIFF_PAGE,		/* differential page backup */
 	BACKUP_MODE_DIFF_PTRACK,	/* differential page backup with ptrack system*/
+	BACKUP_MODE_DIFF_DELTA,		/* differential page backup filtered by page LSN */
 	BACKUP_MODE_FULL			/* full backup */
 } BackupMode;
 
+typedef enum CompressAlg
+{
+	NOT_DEFINED_COMPRESS = 0,	/* backup taken before compression support */
+	NONE_COMPRESS,				/* pages are stored without compression */
+	PGLZ_COMPRESS,				/* pages are compressed with pglz */
+	ZLIB_COMPRESS				/* pages are compressed with zlib */
+} CompressAlg;
+
+#define DEFAULT_COMPRESS_LEVEL	1
+
+typedef enum ReadMode
+{
+	READ_MODE_NOT_DEFINED = 0,	/* backup taken before read modes */
+	READ_MODE_BUFFERED,			/* read through the page cache */
+	READ_MODE_DIRECT,			/* read with O_DIRECT, bypassing the cache */
+	READ_MODE_DONTNEED			/* drop the pages read from the cache */
+} ReadMode;
+
+typedef enum IOEngine
+{
+	IO_ENGINE_SYNC,				/* one system call per request */
+	IO_ENGINE_IO_URING			/* batched requests through io_uring */
+} IOEngine;
+
+/* io_uring ring with its page buffers, see ioring.c */
+typedef struct pgIORing pgIORing;
+
+/* backup copy of a data file opened for read, see data.c */
+typedef struct pgBackupCopy pgBackupCopy;
+
 /*
  * pg_probackup takes backup into the directroy $BACKUP_PATH/<date>/<time>.
  *
@@ -139,6 +201,18 @@ typedef struct pgBackup
 	uint32			checksum_version;
 	bool			stream;
 	time_t			parent_backup;
+
+	/* page compression used for data files */
+	CompressAlg		compress_alg;
+	int				compress_level;
+
+	/* how the files of the cluster were read */
+	ReadMode		read_mode;
+
+	/* average bandwidth in bytes per second and seconds spent throttled */
+	uint64			read_rate;
+	uint64			write_rate;
+	uint32			throttled_time;
 } pgBackup;
 
 typedef struct pgBackupOption
@@ -174,6 +248,17 @@ typedef union DataPage
 	char			data[BLCKSZ];
 } DataPage;
 
+/* version of a file in one backup of the chain being restored */
+typedef struct pgFileVersion
+{
+	pgBackup   *backup;
+	const char *root;			/* database directory of the backup */
+	pgFile	   *file;			/* entry in the file list of the backup */
+} pgFileVersion;
+
+/* callback of run_tasks(), called once for each task */
+typedef void (*pgTaskFunc) (void *task, int index, void *arg);
+
 /*
  * return pointer that exceeds the length of prefix from character string.
  * ex. str="/xxx/yyy/zzz", prefix="/xxx/yyy", return="zzz".
@@ -207,18 +292,26 @@ extern parray *backup_files_list;
 
 extern int num_threads;
 extern bool stream_wal;
+extern bool incremental_restore;
 extern bool from_replica;
 extern bool progress;
 extern bool delete_wal;
 extern uint64 system_identifier;
+extern CompressAlg compress_alg;
+extern int compress_level;
+extern IOEngine io_engine;
+extern ReadMode read_mode;
+extern int max_read_rate;
+extern int max_write_rate;
 
 /* in backup.c */
 extern int do_backup(pgBackupOption bkupopt);
 extern BackupMode parse_backup_mode(const char *value);
 extern void check_server_version(void);
+extern bool lsn_is_inserted(XLogRecPtr lsn);
 extern bool fileExists(const char *path);
 extern void process_block_change(ForkNumber forknum, RelFileNode rnode,
-								 BlockNumber blkno);
+								 BlockNumber blkno, datapagemap_t *pagemaps);
 
 /* in restore.c */
 extern int do_restore(time_t backup_id,
@@ -285,18 +378,26 @@ extern int pgBackupCreateDir(pgBackup *backup);
 extern void pgBackupFree(void *backup);
 extern int pgBackupCompareId(const void *f1, const void *f2);
 extern int pgBackupCompareIdDesc(const void *f1, const void *f2);
+extern CompressAlg parse_compress_alg(const char *value);
+extern const char *deparse_compress_alg(CompressAlg alg);
+extern ReadMode parse_read_mode(const char *value);
+extern const char *deparse_read_mode(ReadMode mode);
 
 /* in dir.c */
 extern void dir_list_file(parray *files, const char *root, const char *exclude[], bool omit_symlink, bool add_root);
-extern void dir_list_file_internal(parray *files, const char *root, const char *exclude[],
-					bool omit_symlink, bool add_root, parray *black_list);
+extern void dir_list_dirs(parray *files, const char *root);
 extern void dir_print_mkdirs_sh(FILE *out, const parray *files, const char *root);
+extern void dir_print_layout(FILE *out, const parray *files, const char *root);
+extern void dir_create_layout(const char *root, const char *layout_txt);
 extern void dir_print_file_list(FILE *out, const parray *files, const char *root, const char *prefix);
 extern parray *dir_read_file_list(const char *root, const char *file_txt);
 
 extern int dir_create_dir(const char *path, mode_t mode);
 extern void dir_copy_files(const char *from_root, const char *to_root);
 
+extern pgFile *pgFileAlloc(size_t path_len);
+extern char *pgFileStrdup(pgFile *file, const char *str);
+extern void pgFileSetPath(pgFile *file, const char *path);
 extern pgFile *pgFileNew(const char *path, bool omit_symlink);
 extern void pgFileDelete(pgFile *file);
 extern void pgFileFree(void *file);
@@ -304,18 +405,45 @@ extern pg_crc32 pgFileGetCRC(pgFile *file);
 extern int pgFileComparePath(const void *f1, const void *f2);
 extern int pgFileComparePathDesc(const void *f1, const void *f2);
 extern int pgFileCompareSize(const void *f1, const void *f2);
+extern int pgFileCompareWriteSizeDesc(const void *f1, const void *f2);
 extern int pgFileCompareMtime(const void *f1, const void *f2);
 extern int pgFileCompareMtimeDesc(const void *f1, const void *f2);
+extern uint32 pgFileHashPath(const void *f);
+extern uint32 pgFileHashRelation(const void *f);
+extern int pgFileCompareRelation(const void *f1, const void *f2);
 
 /* in data.c */
 extern bool backup_data_file(const char *from_root, const char *to_root,
 							 pgFile *file, const XLogRecPtr *lsn);
-extern void restore_data_file(const char *from_root, const char *to_root,
-							  pgFile *file, pgBackup *backup);
+extern bool backup_data_file_part(const char *from_root, const char *to_root,
+								  pgFile *file, const XLogRecPtr *lsn,
+								  BlockNumber start_blk, BlockNumber end_blk,
+								  int part, size_t *read_size,
+								  size_t *write_size, pg_crc32 *crc,
+								  pgChunkHash **chunks, int *nchunks);
+extern bool backup_data_file_join(const char *from_root, const char *to_root,
+								  pgFile *file, int nparts, size_t *part_sizes,
+								  pg_crc32 *part_crcs, pgChunkHash **part_chunks,
+								  int *part_nchunks, bool discard);
+extern pgBackupCopy *backup_copy_open(const pgFile *file);
+extern void backup_copy_close(pgBackupCopy *copy);
+extern uint64 backup_copy_size(const pgBackupCopy *copy);
+extern size_t backup_copy_pread(pgBackupCopy *copy, char *buf, size_t len,
+								uint64 offset);
+extern size_t backup_copy_read(pgBackupCopy *copy, void *buf, size_t len);
+extern void backup_copy_skip(pgBackupCopy *copy, size_t len);
+extern pg_crc32 backup_copy_crc(pgBackupCopy *copy);
+extern bool check_backup_chunk(pgBackupCopy *copy, const pgFile *file,
+							   int index);
+extern int check_backup_chunks(pgBackupCopy *copy, const pgFile *file,
+							   const char *rel_path);
+extern void restore_data_file(const char *to_root, pgFileVersion *versions,
+							  int nversions);
 extern bool copy_file(const char *from_root, const char *to_root,
 					  pgFile *file);
 
 extern bool calc_file(pgFile *file);
+extern ReadMode effective_read_mode(void);
 
 /* parsexlog.c */
 extern void extractPageMap(const char *datadir,
@@ -328,6 +456,7 @@ extern void validate_wal(pgBackup *backup,
 						 time_t target_time,
 						 TransactionId recovery_target_xid,
 						 TimeLineID tli);
+extern int do_summarize_wal(void);
 
 /* in util.c */
 extern TimeLineID get_current_timeline(bool safe);
@@ -346,6 +475,56 @@ extern pg_time_t timestamptz_to_time_t(TimestampTz t);
 /* in status.c */
 extern bool is_pg_running(void);
 
+/* in ioring.c */
+extern IOEngine parse_io_engine(const char *value);
+extern pgIORing *io_ring_create(int nbuffers, size_t buffer_size);
+extern void io_ring_free(pgIORing *ring);
+extern pgIORing *io_ring_get(int nbuffers, size_t buffer_size);
+extern void io_ring_free_thread(void);
+extern char *io_ring_buffer(pgIORing *ring, int slot);
+extern void io_ring_read(pgIORing *ring, int slot, int fd, off_t offset,
+						 size_t len);
+extern void io_ring_write(pgIORing *ring, int slot, int fd, off_t offset,
+						  size_t len);
+extern void io_ring_wait(pgIORing *ring);
+extern ssize_t io_ring_result(pgIORing *ring, int slot);
+
+/* in throttle.c */
+extern void throttle_start(void);
+extern void throttle_read(size_t bytes);
+extern void throttle_write(size_t bytes);
+extern void throttle_report(pgBackup *backup);
+
+/* in arena.c */
+typedef struct pgArena pgArena;
+extern pgArena *file_arena;
+extern void *arena_alloc(pgArena *arena, size_t size);
+extern pgArena *file_arena_begin(void);
+extern void file_arena_end(pgArena *outer);
+
+/* in manifest.c */
+typedef struct pgManifest pgManifest;
+extern void manifest_write(const char *path, const parray *files,
+						   const char *root);
+extern pgManifest *manifest_open(const char *path);
+extern void manifest_close(pgManifest *manifest);
+extern int manifest_count(const pgManifest *manifest);
+extern int manifest_find(const pgManifest *manifest, const char *rel_path);
+extern pgFile *manifest_get_file(const pgManifest *manifest, int index,
+								 const char *root);
+extern parray *read_backup_file_list(pgBackup *backup, const char *root);
+
+/* in pagecheck.c */
+extern bool page_is_zero(const char *page);
+extern void pg_checksum_pages(const char *pages, int npages, BlockNumber blkno,
+							  uint16 *checksums);
+extern void pagecheck_init(void);
+extern bool pagecheck_use_kernel(const char *name);
+extern const char *pagecheck_kernel_name(void);
+
+/* in taskqueue.c */
+extern void run_tasks(parray *tasks, int nthreads, pgTaskFunc func, void *arg);
+
 /* some from access/xact.h */
 /*
  * XLOG allows to store some information in high 4 bits of log record xl_info
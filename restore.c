@@ -13,17 +13,36 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <pthread.h>
 
 #include "catalog/pg_control.h"
 
+/* a file to restore with its versions in the chain, newest first */
 typedef struct
 {
-	parray *files;
-	pgBackup *backup;
+	pgFile	   *file;			/* entry in the list of the last backup */
+	size_t		size;			/* bytes to read from all versions */
+	int			nversions;
+	pgFileVersion *versions;
+} restore_task;
+
+typedef struct
+{
+	parray *tasks;
+	const char *root;			/* database directory of the last backup */
 } restore_files_args;
 
-static void restore_database(pgBackup *backup);
+/* file list of a backup of the chain */
+typedef struct
+{
+	char		root[MAXPGPATH];	/* database directory of the backup */
+	pgManifest *manifest;		/* binary manifest, searched in place */
+	parray	   *files;			/* sorted file list if there is no manifest */
+} chain_file_list;
+
+static void clear_incremental_destination(void);
+static void restore_chain(parray *chain);
+static restore_task *plan_restore_file(pgFile *file, parray *chain,
+									   chain_file_list *lists, parray *made);
 static void create_recovery_conf(time_t backup_id,
 								 const char *target_time,
 								 const char *target_xid,
@@ -33,7 +52,7 @@ static void print_backup_lsn(const pgBackup *backup);
 static void search_next_wal(const char *path,
 							XLogRecPtr *need_lsn,
 							parray *timelines);
-static void restore_files(void *arg);
+static void restore_files(void *task, int index, void *arg);
 
 
 bool existsTimeLineHistory(TimeLineID probeTLI);
@@ -54,6 +73,7 @@ do_restore(time_t backup_id,
 	TimeLineID	backup_tli;
 	TimeLineID	newest_tli;
 	parray *backups;
+	parray *chain;
 
 	parray *files;
 	parray *timelines;
@@ -156,38 +176,13 @@ base_backup_found:
 	base_index = i;
 
 	/*
-	 * Clear restore destination, but don't remove $PGDATA.
-	 * To remove symbolic link, get file list with "omit_symlink = false".
+	 * Collect the chain of backups to restore: the base backup and the
+	 * following differential backups.
 	 */
-	if (!check)
-	{
-		elog(LOG, "----------------------------------------");
-		elog(LOG, "clearing restore destination");
-
-		files = parray_new();
-		dir_list_file(files, pgdata, NULL, false, false);
-		parray_qsort(files, pgFileComparePathDesc);	/* delete from leaf */
-
-		for (i = 0; i < parray_num(files); i++)
-		{
-			pgFile *file = (pgFile *) parray_get(files, i);
-			pgFileDelete(file);
-		}
-		parray_walk(files, pgFileFree);
-		parray_free(files);
-	}
-
-	print_backup_lsn(base_backup);
-
-	if (backup_id != 0)
-		stream_wal = base_backup->stream;
-
-	/* restore base backup */
-	restore_database(base_backup);
-
+	chain = parray_new();
+	parray_append(chain, base_backup);
 	last_restored_index = base_index;
 
-	/* restore following differential backup */
 	elog(LOG, "searching differential backup...");
 
 	for (i = base_index - 1; i >= 0; i--)
@@ -207,7 +202,8 @@ base_backup_found:
 
 		/* use database backup only */
 		if (backup->backup_mode != BACKUP_MODE_DIFF_PAGE &&
-			backup->backup_mode != BACKUP_MODE_DIFF_PTRACK)
+			backup->backup_mode != BACKUP_MODE_DIFF_PTRACK &&
+			backup->backup_mode != BACKUP_MODE_DIFF_DELTA)
 			continue;
 
 		/* is the backup is necessary for restore to target timeline ? */
@@ -215,14 +211,69 @@ base_backup_found:
 			!satisfy_recovery_target(backup, rt))
 			continue;
 
-		if (backup_id != 0)
-			stream_wal = backup->stream;
+		parray_append(chain, backup);
+		last_restored_index = i;
+	}
+
+	/*
+	 * Validate backup files with its size, because load of CRC calculation is
+	 * not right.  The whole chain is checked before the destination is
+	 * cleared.
+	 */
+	for (i = 0; i < parray_num(chain); i++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(chain, i);
+
+		/* confirm block size compatibility */
+		if (backup->block_size != BLCKSZ)
+			elog(ERROR,
+				"BLCKSZ(%d) is not compatible(%d expected)",
+				backup->block_size, BLCKSZ);
+		if (backup->wal_block_size != XLOG_BLCKSZ)
+			elog(ERROR,
+				"XLOG_BLCKSZ(%d) is not compatible(%d expected)",
+				backup->wal_block_size, XLOG_BLCKSZ);
+
+		pgBackupValidate(backup, true, false);
+	}
+
+	/*
+	 * Clear restore destination, but don't remove $PGDATA.
+	 * To remove symbolic link, get file list with "omit_symlink = false".
+	 */
+	if (!check && incremental_restore)
+		clear_incremental_destination();
+	else if (!check)
+	{
+		elog(LOG, "----------------------------------------");
+		elog(LOG, "clearing restore destination");
+
+		files = parray_new();
+		dir_list_file(files, pgdata, NULL, false, false);
+		parray_qsort(files, pgFileComparePathDesc);	/* delete from leaf */
+
+		for (i = 0; i < parray_num(files); i++)
+		{
+			pgFile *file = (pgFile *) parray_get(files, i);
+			pgFileDelete(file);
+		}
+		parray_walk(files, pgFileFree);
+		parray_free(files);
+	}
+
+	for (i = 0; i < parray_num(chain); i++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(chain, i);
 
 		print_backup_lsn(backup);
-		restore_database(backup);
-		last_restored_index = i;
+		if (backup_id != 0)
+			stream_wal = backup->stream;
 	}
 
+	/* restore the chain in one pass */
+	restore_chain(chain);
+	parray_free(chain);
+
 	if (!stream_wal || target_time != NULL || target_xid != NULL)
 		for (i = last_restored_index; i >= 0; i--)
 		{
@@ -257,49 +308,183 @@ base_backup_found:
 }
 
 /*
- * Validate and restore backup.
+ * Prepare an existing data directory for incremental restore.  Files are
+ * kept to be compared with the backup, and those not in the backup are
+ * deleted after the restore, but WAL segments and recovery.conf of the old
+ * cluster are excluded from that and must not survive.
  */
-void
-restore_database(pgBackup *backup)
+static void
+clear_incremental_destination(void)
 {
+	char	path[MAXPGPATH];
+	parray *files;
+	int		i;
+
+	elog(LOG, "----------------------------------------");
+	elog(LOG, "clearing WAL of restore destination");
+
+	join_path_components(path, pgdata, "pg_xlog");
+	files = parray_new();
+	dir_list_file(files, path, NULL, true, false);
+
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(files, i);
+
+		if (S_ISREG(file->mode))
+			pgFileDelete(file);
+	}
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+
+	join_path_components(path, pgdata, "recovery.conf");
+	if (remove(path) == -1 && errno != ENOENT)
+		elog(ERROR, "cannot remove recovery.conf: %s", strerror(errno));
+}
+
+/*
+ * Find the entry of rel_path in the file list of a backup.  Entries made
+ * from the manifest are appended to made, to be freed by the caller.
+ */
+static pgFile *
+find_file_version(chain_file_list *list, const char *rel_path, parray *made)
+{
+	char		path[MAXPGPATH];
+	pgFile		key;
+	void	   *found;
+
+	if (list->manifest)
+	{
+		int			index = manifest_find(list->manifest, rel_path);
+		pgFile	   *file;
+
+		if (index < 0)
+			return NULL;
+		file = manifest_get_file(list->manifest, index, list->root);
+		parray_append(made, file);
+		return file;
+	}
+
+	join_path_components(path, list->root, rel_path);
+	key.path = path;
+	found = parray_bsearch(list->files, &key, pgFileComparePath);
+
+	return found ? *(pgFile **) found : NULL;
+}
+
+/*
+ * Work out the versions of file, an entry in the list of the last backup of
+ * the chain, that hold its contents, newest first.  Walking back, a version
+ * copied whole ends the search, as does a backup in which the file didn't
+ * exist: its older contents were deleted.
+ */
+static restore_task *
+plan_restore_file(pgFile *file, parray *chain, chain_file_list *lists,
+				  parray *made)
+{
+	int			last = parray_num(chain) - 1;
+	const char *rel_path = file->path + strlen(lists[last].root) + 1;
+	restore_task *task;
+	int			i;
+
+	task = pgut_new(restore_task);
+	task->file = file;
+	task->size = 0;
+	task->nversions = 0;
+	task->versions = pgut_malloc(sizeof(pgFileVersion) * (last + 1));
+
+	for (i = last; i >= 0; i--)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(chain, i);
+		pgFile	   *version;
+
+		version = (i == last) ? file :
+			find_file_version(&lists[i], rel_path, made);
+		if (version == NULL)
+			break;
+
+		/* not backed up, unchanged since the previous backup */
+		if (version->write_size == BYTES_INVALID)
+			continue;
+
+		/* a whole copy can't be merged with newer pages */
+		if (!version->is_datafile && task->nversions > 0)
+			break;
+
+		task->versions[task->nversions].backup = backup;
+		task->versions[task->nversions].root = lists[i].root;
+		task->versions[task->nversions].file = version;
+		task->nversions++;
+		task->size += version->write_size;
+
+		if (!version->is_datafile || version->is_whole ||
+			backup->backup_mode == BACKUP_MODE_FULL)
+			break;
+	}
+
+	return task;
+}
+
+static int
+restore_task_compare_size_desc(const void *a, const void *b)
+{
+	restore_task *ta = *(restore_task **) a;
+	restore_task *tb = *(restore_task **) b;
+
+	if (ta->size > tb->size)
+		return -1;
+	else if (ta->size < tb->size)
+		return 1;
+	return 0;
+}
+
+/*
+ * Restore a chain of backups, a full backup followed by its differential
+ * backups.  The file lists of the whole chain are read first and every file
+ * of the last backup is restored once, each of its pages from the newest
+ * backup holding it.
+ */
+static void
+restore_chain(parray *chain)
+{
+	int		nbackups = parray_num(chain);
+	pgBackup *dest_backup = (pgBackup *) parray_get(chain, nbackups - 1);
 	char	timestamp[100];
 	char	path[MAXPGPATH];
 	char	list_path[MAXPGPATH];
 	int		ret;
+	chain_file_list *lists;
+	pgArena *outer_arena;
+	parray *made;
+	parray *tasks;
 	parray *files;
 	int		i;
-	pthread_t	restore_threads[num_threads];
-	restore_files_args *restore_threads_args[num_threads];
-
-	/* confirm block size compatibility */
-	if (backup->block_size != BLCKSZ)
-		elog(ERROR,
-			"BLCKSZ(%d) is not compatible(%d expected)",
-			backup->block_size, BLCKSZ);
-	if (backup->wal_block_size != XLOG_BLCKSZ)
-		elog(ERROR,
-			"XLOG_BLCKSZ(%d) is not compatible(%d expected)",
-			backup->wal_block_size, XLOG_BLCKSZ);
+	restore_files_args restore_args;
 
-	time2iso(timestamp, lengthof(timestamp), backup->start_time);
 	if (!check)
 	{
 		elog(LOG, "----------------------------------------");
-		elog(LOG, "restoring database from backup %s", timestamp);
+		for (i = 0; i < nbackups; i++)
+		{
+			time2iso(timestamp, lengthof(timestamp),
+					 ((pgBackup *) parray_get(chain, i))->start_time);
+			elog(LOG, "restoring database from backup %s", timestamp);
+		}
 	}
 
 	/*
-	 * Validate backup files with its size, because load of CRC calculation is
-	 * not right.
+	 * Make direcotries and symbolic links of the last backup.  Backups taken
+	 * by older versions have only mkdirs.sh.
 	 */
-	pgBackupValidate(backup, true, false);
-
-	/* make direcotries and symbolic links */
-	pgBackupGetPath(backup, path, lengthof(path), MKDIRS_SH_FILE);
-	if (!check)
+	pgBackupGetPath(dest_backup, path, lengthof(path), DATABASE_DIR_LIST);
+	if (!check && fileExists(path))
+		dir_create_layout(pgdata, path);
+	else if (!check)
 	{
 		char pwd[MAXPGPATH];
 
+		pgBackupGetPath(dest_backup, path, lengthof(path), MKDIRS_SH_FILE);
+
 		/* keep orginal directory */
 		if (getcwd(pwd, sizeof(pwd)) == NULL)
 			elog(ERROR, "cannot get current working directory: %s",
@@ -325,60 +510,79 @@ restore_database(pgBackup *backup)
 				strerror(errno));
 	}
 
+	/* the file lists of the chain are released all at once at the end */
+	outer_arena = file_arena_begin();
+
 	/*
-	 * get list of files which need to be restored.
+	 * Open the file lists of the chain.  The older backups are only searched
+	 * for the files of the last one, through their binary manifests if they
+	 * have them.
 	 */
-	pgBackupGetPath(backup, path, lengthof(path), DATABASE_DIR);
-	pgBackupGetPath(backup, list_path, lengthof(list_path), DATABASE_FILE_LIST);
-	files = dir_read_file_list(path, list_path);
-	for (i = parray_num(files) - 1; i >= 0; i--)
+	lists = pgut_malloc(sizeof(chain_file_list) * nbackups);
+	for (i = 0; i < nbackups; i++)
 	{
-		pgFile *file = (pgFile *) parray_get(files, i);
-
-		/* remove files which are not backed up */
-		if (file->write_size == BYTES_INVALID)
-			pgFileFree(parray_remove(files, i));
+		pgBackup *backup = (pgBackup *) parray_get(chain, i);
+
+		pgBackupGetPath(backup, lists[i].root, MAXPGPATH, DATABASE_DIR);
+		pgBackupGetPath(backup, list_path, lengthof(list_path),
+						DATABASE_FILE_MANIFEST);
+		lists[i].manifest = (i < nbackups - 1) ? manifest_open(list_path) : NULL;
+		lists[i].files = lists[i].manifest ? NULL :
+			read_backup_file_list(backup, lists[i].root);
 	}
 
+	/* get list of files which need to be restored */
+	files = lists[nbackups - 1].files;
+	made = parray_new();
+	tasks = parray_new();
 	for (i = 0; i < parray_num(files); i++)
 	{
 		pgFile *file = (pgFile *) parray_get(files, i);
+		restore_task *task;
+
+		/* directories are created with the directory list */
+		if (S_ISDIR(file->mode))
+			continue;
 
-		__sync_lock_release(&file->lock);
+		task = plan_restore_file(file, chain, lists, made);
+		if (task->nversions == 0)
+		{
+			pg_free(task->versions);
+			pg_free(task);
+			continue;
+		}
+		parray_append(tasks, task);
 	}
 
-	/* restore files into $PGDATA */
-	for (i = 0; i < num_threads; i++)
-	{
-		restore_files_args *arg = pg_malloc(sizeof(restore_files_args));
-		arg->files = files;
-		arg->backup = backup;
+	/* restore files into $PGDATA, largest first */
+	parray_qsort(tasks, restore_task_compare_size_desc);
 
-		if (verbose)
-			elog(WARNING, "Start thread for num:%li", parray_num(files));
+	restore_args.tasks = tasks;
+	restore_args.root = lists[nbackups - 1].root;
 
-		restore_threads_args[i] = arg;
-		pthread_create(&restore_threads[i], NULL, (void *(*)(void *)) restore_files, arg);
-	}
+	if (verbose)
+		elog(LOG, "Start %d threads for %lu files", num_threads,
+			 (unsigned long) parray_num(tasks));
+	run_tasks(tasks, num_threads, restore_files, &restore_args);
 
-	/* Wait theads */
-	for (i = 0; i < num_threads; i++)
+	for (i = 0; i < parray_num(tasks); i++)
 	{
-		pthread_join(restore_threads[i], NULL);
-		pg_free(restore_threads_args[i]);
+		restore_task *task = (restore_task *) parray_get(tasks, i);
+
+		pg_free(task->versions);
+		pg_free(task);
 	}
+	parray_free(tasks);
 
 	/* Delete files which are not in file list. */
 	if (!check)
 	{
 		parray *files_now;
-
-		parray_walk(files, pgFileFree);
-		parray_free(files);
+		parray_index *files_index;
 
 		/* re-read file list to change base path to $PGDATA */
-		files = dir_read_file_list(pgdata, list_path);
-		parray_qsort(files, pgFileComparePathDesc);
+		files = read_backup_file_list(dest_backup, pgdata);
+		files_index = parray_index_new(files, pgFileHashPath, pgFileComparePath);
 
 		/* get list of files restored to pgdata */
 		files_now = parray_new();
@@ -391,7 +595,7 @@ restore_database(pgBackup *backup)
 			pgFile *file = (pgFile *) parray_get(files_now, i);
 
 			/* If the file is not in the file list, delete it */
-			if (parray_bsearch(files, file, pgFileComparePathDesc) == NULL)
+			if (parray_index_find(files_index, file) == NULL)
 			{
 				elog(LOG, "deleted %s", file->path + strlen(pgdata) + 1);
 				pgFileDelete(file);
@@ -400,6 +604,9 @@ restore_database(pgBackup *backup)
 
 		parray_walk(files_now, pgFileFree);
 		parray_free(files_now);
+		parray_index_free(files_index);
+		parray_walk(files, pgFileFree);
+		parray_free(files);
 	}
 
 	/* remove postmaster.pid */
@@ -409,64 +616,51 @@ restore_database(pgBackup *backup)
 			strerror(errno));
 
 	/* cleanup */
-	parray_walk(files, pgFileFree);
-	parray_free(files);
+	for (i = 0; i < nbackups; i++)
+	{
+		manifest_close(lists[i].manifest);
+		if (lists[i].files)
+		{
+			parray_walk(lists[i].files, pgFileFree);
+			parray_free(lists[i].files);
+		}
+	}
+	pg_free(lists);
+	parray_walk(made, pgFileFree);
+	parray_free(made);
+	file_arena_end(outer_arena);
 
 	if (!check)
 		elog(LOG, "restore backup completed");
 }
 
-
+/*
+ * Restore one file of the chain, called by run_tasks().
+ */
 static void
-restore_files(void *arg)
+restore_files(void *task, int index, void *arg)
 {
-	int i;
-
+	restore_task *rtask = (restore_task *) task;
 	restore_files_args *arguments = (restore_files_args *)arg;
 
-	/* restore files into $PGDATA */
-	for (i = 0; i < parray_num(arguments->files); i++)
-	{
-		char from_root[MAXPGPATH];
-		pgFile *file = (pgFile *) parray_get(arguments->files, i);
-		if (__sync_lock_test_and_set(&file->lock, 1) != 0)
-			continue;
-
-		pgBackupGetPath(arguments->backup, from_root, lengthof(from_root), DATABASE_DIR);
+	/* check for interrupt */
+	if (interrupted)
+		elog(ERROR, "interrupted during restore database");
 
-		/* check for interrupt */
-		if (interrupted)
-			elog(ERROR, "interrupted during restore database");
-
-		/* print progress */
-		if (!check)
-			elog(LOG, "(%d/%lu) %s ", i + 1, (unsigned long) parray_num(arguments->files),
-				file->path + strlen(from_root) + 1);
-
-		/* directories are created with mkdirs.sh */
-		if (S_ISDIR(file->mode))
-		{
-			if (!check)
-				elog(LOG, "directory, skip");
-			continue;
-		}
-
-		/* not backed up */
-		if (file->write_size == BYTES_INVALID)
-		{
-			if (!check)
-				elog(LOG, "not backed up, skip");
-			continue;
-		}
+	/* print progress */
+	if (!check)
+		elog(LOG, "(%d/%lu) %s from %d backups", index + 1,
+			 (unsigned long) parray_num(arguments->tasks),
+			 rtask->file->path + strlen(arguments->root) + 1,
+			 rtask->nversions);
 
-		/* restore file */
-		if (!check)
-			restore_data_file(from_root, pgdata, file, arguments->backup);
+	/* restore file */
+	if (!check)
+		restore_data_file(pgdata, rtask->versions, rtask->nversions);
 
-		/* print size of restored file */
-		if (!check)
-			elog(LOG, "restored %lu\n", (unsigned long) file->write_size);
-	}
+	/* print size of restored file */
+	if (!check)
+		elog(LOG, "restored %lu\n", (unsigned long) rtask->size);
 }
 
 static void
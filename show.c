@@ -172,7 +172,7 @@ show_backup_list(FILE *out, parray *backup_list)
 	for (i = 0; i < parray_num(backup_list); i++)
 	{
 		pgBackup *backup;
-		const char *modes[] = { "", "PAGE", "PTRACK", "FULL", "", "PAGE+STREAM", "PTRACK+STREAM", "FULL+STREAM"};
+		const char *modes[] = { "", "PAGE", "PTRACK", "DELTA", "FULL", "", "PAGE+STREAM", "PTRACK+STREAM", "DELTA+STREAM", "FULL+STREAM"};
 		TimeLineID  parent_tli;
 		char timestamp[20];
 		char duration[20] = "----";
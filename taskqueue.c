@@ -0,0 +1,75 @@
+/*-------------------------------------------------------------------------
+ *
+ * taskqueue.c: run a list of tasks in parallel threads
+ *
+ * All threads take tasks from one shared cursor, so no thread scans the
+ * tasks taken by the others and a thread finishing early simply takes the
+ * next task.  Callers order the tasks largest first, so that the biggest
+ * units of work are started early and the small ones fill the gaps at the
+ * end.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <pthread.h>
+
+typedef struct
+{
+	parray	   *tasks;
+	volatile uint32 cursor;		/* index of the next task to take */
+	pgTaskFunc	func;
+	void	   *arg;
+} pgTaskQueue;
+
+static void
+task_queue_worker(void *arg)
+{
+	pgTaskQueue *queue = (pgTaskQueue *) arg;
+	size_t		ntasks = parray_num(queue->tasks);
+
+	while (true)
+	{
+		uint32		index = __sync_fetch_and_add(&queue->cursor, 1);
+
+		if (index >= ntasks)
+			break;
+
+		queue->func(parray_get(queue->tasks, index), (int) index, queue->arg);
+	}
+
+	/* the I/O rings of the thread were kept for its tasks */
+	io_ring_free_thread();
+}
+
+/*
+ * Call func for each element of tasks in nthreads threads and wait for all
+ * of them to finish.  func receives the task, its index in tasks and arg.
+ */
+void
+run_tasks(parray *tasks, int nthreads, pgTaskFunc func, void *arg)
+{
+	pgTaskQueue queue;
+	pthread_t  *threads;
+	int			i;
+
+	queue.tasks = tasks;
+	queue.cursor = 0;
+	queue.func = func;
+	queue.arg = arg;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > parray_num(tasks))
+		nthreads = Max(parray_num(tasks), 1);
+
+	threads = (pthread_t *) pg_malloc(sizeof(pthread_t) * nthreads);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL,
+					   (void *(*)(void *)) task_queue_worker, &queue);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pg_free(threads);
+}
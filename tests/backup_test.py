@@ -49,6 +49,14 @@ class BackupTest(ProbackupTest, unittest.TestCase):
 			self.show_pb(node, show_backup.id)[six.b("PARENT_BACKUP")].strip(six.b(" '"))
 		)
 
+		# delta backup mode
+		with open(path.join(node.logs_dir, "backup_delta.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="delta", options=["--verbose"]))
+
+		show_backup = self.show_pb(node)[0]
+		self.assertEqual(show_backup.status, six.b("OK"))
+		self.assertEqual(show_backup.mode, six.b("DELTA"))
+
 		# ptrack backup mode
 		if len(is_ptrack):
 			with open(path.join(node.logs_dir, "backup_ptrack.log"), "wb") as backup_log:
@@ -142,3 +150,49 @@ class BackupTest(ProbackupTest, unittest.TestCase):
 		self.assertEqual(self.show_pb(node)[0].status, six.b("OK"))
 
 		node.stop()
+
+	def test_read_modes_6(self):
+		"""backups reading the cluster bypassing or dropping the page cache"""
+		node = self.make_bnode('read_modes_6', base_dir="tmp_dirs/backup/read_modes_6")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+
+		with open(path.join(node.logs_dir, "backup_full.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose", "--read-mode=dontneed"]))
+
+		show_backup = self.show_pb(node)[0]
+		self.assertEqual(show_backup.status, six.b("OK"))
+		self.assertEqual(
+			self.show_pb(node, show_backup.id)[six.b("READ_MODE")].strip(),
+			six.b("dontneed")
+		)
+
+		with open(path.join(node.logs_dir, "backup_direct.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose", "--read-mode=direct"]))
+
+		# O_DIRECT falls back to dontneed on file systems without it
+		show_backup = self.show_pb(node)[0]
+		self.assertEqual(show_backup.status, six.b("OK"))
+		self.assertIn(
+			self.show_pb(node, show_backup.id)[six.b("READ_MODE")].strip(),
+			[six.b("direct"), six.b("dontneed")]
+		)
+
+		node.stop()
+
+	def test_throttle_7(self):
+		"""backup with bandwidth limits"""
+		node = self.make_bnode('throttle_7', base_dir="tmp_dirs/backup/throttle_7")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+
+		with open(path.join(node.logs_dir, "backup_full.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose", "--max-read-rate=20", "--max-write-rate=20"]))
+
+		show_backup = self.show_pb(node)[0]
+		self.assertEqual(show_backup.status, six.b("OK"))
+		backup_conf = self.show_pb(node, show_backup.id)
+		self.assertIn(six.b("THROTTLED_TIME"), backup_conf)
+		self.assertGreater(int(backup_conf[six.b("READ_RATE")]), 0)
+
+		node.stop()
@@ -57,6 +57,12 @@ class OptionTest(ProbackupTest, unittest.TestCase):
 			six.b('ERROR: invalid backup-mode "bad"\n')
 		)
 
+		# backup command failure with a compression algorithm name and more
+		self.assertEqual(
+			self.run_pb(["backup", "-b", "full", "-B", self.backup_dir(node), "--compress-algorithm=nonesuch"]),
+			six.b('ERROR: invalid compress-algorithm "nonesuch"\n')
+		)
+
 		# delete failure without ID
 		self.assertEqual(
 			self.run_pb(["delete", "-B", self.backup_dir(node)]),
@@ -3,6 +3,7 @@ from os import path, listdir
 import subprocess
 import shutil
 import six
+import time
 from testgres import get_new_node
 
 
@@ -187,6 +188,25 @@ class ProbackupTest(object):
 		# print(cmd_list)
 		return self.run_pb(options + cmd_list)
 
+	def summarize_pb(self, node, options=[]):
+		cmd_list = [
+			"-B", self.backup_dir(node),
+			"summarize-wal",
+		]
+
+		# print(cmd_list)
+		return self.run_pb(options + cmd_list)
+
+	def switch_wal_archived(self, node, timeout=60):
+		# switch to a new WAL segment and wait until the closed one is archived
+		segment = node.execute("postgres", "SELECT pg_xlogfile_name(pg_switch_xlog())")[0][0]
+		segment_path = path.join(self.backup_dir(node), "wal", segment)
+		for i in range(timeout * 10):
+			if path.isfile(segment_path):
+				return segment
+			time.sleep(0.1)
+		raise AssertionError("WAL segment %s was not archived" % segment)
+
 	def get_control_data(self, node):
 		pg_controldata = node.get_bin_path("pg_controldata")
 		out_data = {}
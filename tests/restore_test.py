@@ -1,5 +1,6 @@
 import unittest
-from os import path
+from os import path, makedirs, listdir
+from shutil import rmtree
 import six
 from .pb_lib import ProbackupTest
 from testgres import stop_all
@@ -478,3 +479,531 @@ class RestoreTest(ProbackupTest, unittest.TestCase):
 		self.assertEqual(len(node.execute("postgres", "SELECT * FROM tbl0005")), 0)
 
 		node.stop()
+
+	def test_restore_compressed_12(self):
+		"""recovery to latest from compressed full + page backups"""
+		node = self.make_bnode('restore_compressed_12', base_dir="tmp_dirs/restore/restore_compressed_12")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.pgbench_init(scale=2)
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose", "--compress-algorithm=pglz"]))
+
+		pgbench = node.pgbench(stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+		pgbench.wait()
+		pgbench.stdout.close()
+
+		with open(path.join(node.logs_dir, "backup_2.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="page", options=["--verbose", "--compress-algorithm=zlib", "--compress-level=6"]))
+
+		before = node.execute("postgres", "SELECT * FROM pgbench_branches")
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT * FROM pgbench_branches")
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_split_files_13(self):
+		"""recovery from full backup taken in threads with large files split into parts"""
+		node = self.make_bnode('restore_split_files_13', base_dir="tmp_dirs/restore/restore_split_files_13")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		# pgbench_accounts is about 320MB, more than two parts of 128MB
+		node.pgbench_init(scale=25)
+
+		before = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["-j", "4", "--verbose"]))
+
+		self.assertEqual(self.show_pb(node)[0].status, six.b("OK"))
+
+		# the parts are kept as they were written and validated in order
+		id_backup = self.show_pb(node)[0].id.decode("utf-8")
+		relpath = node.execute("postgres", "SELECT pg_relation_filepath('pgbench_accounts')")[0][0]
+		backup_file = path.join(self.backup_dir(node), "backups", id_backup, "database", relpath)
+		self.assertTrue(path.isfile(backup_file + ".part0"))
+		self.assertTrue(path.isfile(backup_file + ".part2"))
+		self.assertFalse(path.exists(backup_file))
+		self.validate_pb(node, id_backup)
+		self.assertEqual(self.show_pb(node)[0].status, six.b("OK"))
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_io_uring_14(self):
+		"""recovery from full + page backups taken and restored with io_uring"""
+		node = self.make_bnode('restore_io_uring_14', base_dir="tmp_dirs/restore/restore_io_uring_14")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.pgbench_init(scale=2)
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose", "--io-engine=io_uring"]))
+
+		pgbench = node.pgbench(stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+		pgbench.wait()
+		pgbench.stdout.close()
+
+		with open(path.join(node.logs_dir, "backup_2.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="page", options=["--verbose", "--io-engine=io_uring"]))
+
+		before = node.execute("postgres", "SELECT * FROM pgbench_branches")
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose", "--io-engine=io_uring"]))
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT * FROM pgbench_branches")
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_page_chain_15(self):
+		"""recovery from full backup followed by a chain of page backups"""
+		node = self.make_bnode('restore_page_chain_15', base_dir="tmp_dirs/restore/restore_page_chain_15")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.pgbench_init(scale=2)
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose"]))
+
+		for i in range(2, 6):
+			pgbench = node.pgbench(stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+			pgbench.wait()
+			pgbench.stdout.close()
+
+			with open(path.join(node.logs_dir, "backup_%d.log" % i), "wb") as backup_log:
+				backup_log.write(self.backup_pb(node, backup_type="page", options=["--verbose"]))
+
+		before = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_incremental_16(self):
+		"""incremental recovery into the diverged data directory"""
+		node = self.make_bnode('restore_incremental_16', base_dir="tmp_dirs/restore/restore_incremental_16")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.pgbench_init(scale=2)
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose", "--stream"]))
+
+		pgbench = node.pgbench(stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+		pgbench.wait()
+		pgbench.stdout.close()
+
+		with open(path.join(node.logs_dir, "backup_2.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="page", options=["--verbose", "--stream"]))
+
+		id = self.show_pb(node)[0].id
+		before = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+
+		# diverge from the backup
+		pgbench = node.pgbench(stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+		pgbench.wait()
+		pgbench.stdout.close()
+		node.execute("postgres", "CREATE TABLE t_diverged AS SELECT * FROM pgbench_accounts")
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, id, options=["-j", "4", "--verbose", "--incremental"]))
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+		self.assertEqual(before, after)
+		self.assertEqual(
+			node.execute("postgres", "SELECT count(*) FROM pg_class WHERE relname = 't_diverged'")[0][0],
+			0
+		)
+
+		node.stop()
+
+	def test_restore_with_tablespace_17(self):
+		"""recovery of directories and tablespace links from the directory list"""
+		node = self.make_bnode('restore_with_tablespace_17', base_dir="tmp_dirs/restore/restore_with_tablespace_17")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+
+		tblspc_path = path.join(node.base_dir, "tblspc")
+		makedirs(tblspc_path)
+		node.psql("postgres", "CREATE TABLESPACE tblspc LOCATION '%s'" % tblspc_path)
+		node.psql("postgres", "CREATE TABLE test TABLESPACE tblspc AS SELECT generate_series(0, 1000) AS id")
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose"]))
+
+		node.stop({"-m": "immediate"})
+		rmtree(tblspc_path)
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		node.start({"-t": "600"})
+
+		count = node.execute("postgres", "SELECT count(*) FROM test")
+		self.assertEqual(count[0][0], 1001)
+
+		node.stop()
+
+	def test_restore_ptrack_databases_18(self):
+		"""recovery from full + ptrack backups of changes in several databases"""
+		node = self.make_bnode('restore_ptrack_databases_18', base_dir="tmp_dirs/restore/restore_ptrack_databases_18")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		is_ptrack = node.execute("postgres", "SELECT proname FROM pg_proc WHERE proname='pg_ptrack_clear'")
+		if not is_ptrack:
+			node.stop()
+			self.skipTest("ptrack not supported")
+			return
+
+		node.append_conf("postgresql.conf", "ptrack_enable = on")
+		node.restart()
+
+		node.psql("postgres", "CREATE DATABASE db1")
+		for db in ("postgres", "db1"):
+			for i in range(3):
+				node.psql(db, "CREATE TABLE t%d AS SELECT generate_series(0, 10000) AS id" % i)
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="full", options=["--verbose"]))
+
+		for db in ("postgres", "db1"):
+			for i in range(3):
+				node.psql(db, "UPDATE t%d SET id = id + 1 WHERE id %% 100 = %d" % (i, i))
+
+		with open(path.join(node.logs_dir, "backup_2.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="ptrack", options=["--verbose"]))
+
+		before = [node.execute(db, "SELECT sum(id) FROM t0, t1, t2 WHERE t0.id = t1.id AND t1.id = t2.id")
+				  for db in ("postgres", "db1")]
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		node.start({"-t": "600"})
+
+		after = [node.execute(db, "SELECT sum(id) FROM t0, t1, t2 WHERE t0.id = t1.id AND t1.id = t2.id")
+				 for db in ("postgres", "db1")]
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_page_unchanged_truncated_19(self):
+		"""recovery from a page backup skipping unchanged relations and taking truncated ones whole"""
+		node = self.make_bnode('restore_page_unchanged_truncated_19', base_dir="tmp_dirs/restore/restore_page_unchanged_truncated_19")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.psql("postgres", "CREATE TABLE unchanged AS SELECT generate_series(0, 100000) AS id")
+		node.psql("postgres", "CREATE TABLE truncated AS SELECT generate_series(0, 100000) AS id")
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose"]))
+
+		# hint bits and a checkpoint change the files of both tables
+		node.psql("postgres", "SELECT count(*) FROM unchanged")
+		node.psql("postgres", "DELETE FROM truncated WHERE id > 1000")
+		node.psql("postgres", "VACUUM truncated")
+		node.psql("postgres", "CHECKPOINT")
+
+		with open(path.join(node.logs_dir, "backup_2.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="page", options=["--verbose"]))
+
+		before = node.execute("postgres", "SELECT (SELECT sum(id) FROM unchanged), (SELECT sum(id) FROM truncated), pg_relation_size('truncated')")
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT (SELECT sum(id) FROM unchanged), (SELECT sum(id) FROM truncated), pg_relation_size('truncated')")
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_zero_pages_20(self):
+		"""all-zero pages are stored as markers and restored as holes"""
+		node = self.make_bnode('restore_zero_pages_20', base_dir="tmp_dirs/restore/restore_zero_pages_20")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.psql("postgres", "CREATE TABLE tbl AS SELECT generate_series(0, 1000) AS id")
+		node.psql("postgres", "CHECKPOINT")
+		relpath = node.execute("postgres", "SELECT pg_relation_filepath('tbl')")[0][0]
+		node.stop()
+
+		# extend the relation with zero pages, as a preallocation would do
+		rel_file = path.join(node.data_dir, relpath)
+		with open(rel_file, "rb+") as f:
+			f.truncate(path.getsize(rel_file) + 64 * 8192)
+		size = path.getsize(rel_file)
+
+		node.start()
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose"]))
+
+		id_backup = self.show_pb(node)[0].id
+		backup_file = path.join(self.backup_dir(node), "backups", id_backup.decode("utf-8"), "database", relpath)
+		self.assertLess(path.getsize(backup_file), 64 * 8192)
+
+		before = node.execute("postgres", "SELECT sum(id) FROM tbl")
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["--verbose"]))
+
+		self.assertEqual(path.getsize(rel_file), size)
+
+		node.start({"-t": "600"})
+		after = node.execute("postgres", "SELECT sum(id) FROM tbl")
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_page_wal_summaries_21(self):
+		"""recovery from a page backup whose page map is read from WAL summaries"""
+		node = self.make_bnode('restore_page_wal_summaries_21', base_dir="tmp_dirs/restore/restore_page_wal_summaries_21")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.pgbench_init(scale=2)
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose"]))
+
+		# a segment is summarized once the following one is archived
+		pgbench = node.pgbench(stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+		pgbench.wait()
+		pgbench.stdout.close()
+		self.switch_wal_archived(node)
+		node.psql("postgres", "CHECKPOINT")
+		self.switch_wal_archived(node)
+
+		with open(path.join(node.logs_dir, "summarize_1.log"), "wb") as summarize_log:
+			summarize_log.write(self.summarize_pb(node, options=["--verbose"]))
+		summaries_dir = path.join(self.backup_dir(node), "wal", "summaries")
+		self.assertNotEqual(listdir(summaries_dir), [])
+
+		backup_log = self.backup_pb(node, backup_type="page", options=["--verbose"])
+		with open(path.join(node.logs_dir, "backup_2.log"), "wb") as f:
+			f.write(backup_log)
+		self.assertIn(six.b("using WAL summary"), backup_log)
+
+		before = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_page_broken_wal_summaries_22(self):
+		"""broken WAL summaries are ignored and their WAL is decoded"""
+		node = self.make_bnode('restore_page_broken_wal_summaries_22', base_dir="tmp_dirs/restore/restore_page_broken_wal_summaries_22")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.pgbench_init(scale=2)
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose"]))
+
+		for i in range(2):
+			pgbench = node.pgbench(stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+			pgbench.wait()
+			pgbench.stdout.close()
+			self.switch_wal_archived(node)
+		node.psql("postgres", "CHECKPOINT")
+		self.switch_wal_archived(node)
+
+		# a temporary file left by an interrupted run is removed
+		summaries_dir = path.join(self.backup_dir(node), "wal", "summaries")
+		if not path.isdir(summaries_dir):
+			makedirs(summaries_dir)
+		stale = path.join(summaries_dir, "000000010000000000000001.tmp")
+		with open(stale, "wb") as f:
+			f.write(six.b("stale"))
+
+		with open(path.join(node.logs_dir, "summarize_1.log"), "wb") as summarize_log:
+			summarize_log.write(self.summarize_pb(node, options=["--verbose"]))
+		self.assertFalse(path.exists(stale))
+
+		# truncate one summary and break the CRC in the header of the others
+		summaries = sorted(listdir(summaries_dir))
+		self.assertGreater(len(summaries), 1)
+		with open(path.join(summaries_dir, summaries[0]), "rb+") as f:
+			f.truncate(8)
+		for summary in summaries[1:]:
+			with open(path.join(summaries_dir, summary), "rb+") as f:
+				f.seek(12)
+				byte = f.read(1)
+				f.seek(12)
+				f.write(six.int2byte(six.indexbytes(byte, 0) ^ 0xFF))
+
+		backup_log = self.backup_pb(node, backup_type="page", options=["--verbose"])
+		with open(path.join(node.logs_dir, "backup_2.log"), "wb") as f:
+			f.write(backup_log)
+		self.assertNotIn(six.b("using WAL summary"), backup_log)
+		self.assertIn(six.b("decoding WAL"), backup_log)
+
+		before = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT sum(abalance), count(*) FROM pgbench_accounts")
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_full_delta_23(self):
+		"""recovery to latest from full + delta backups"""
+		node = self.make_bnode('restore_full_delta_23', base_dir="tmp_dirs/restore/full_delta_23")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.pgbench_init(scale=2)
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="full", options=["--verbose"]))
+
+		pgbench = node.pgbench(stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+		pgbench.wait()
+		pgbench.stdout.close()
+
+		with open(path.join(node.logs_dir, "backup_2.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="delta", options=["--verbose"]))
+
+		before = node.execute("postgres", "SELECT * FROM pgbench_branches")
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT * FROM pgbench_branches")
+		self.assertEqual(before, after)
+
+		bbalance = node.execute("postgres", "SELECT sum(bbalance) FROM pgbench_branches")
+		delta = node.execute("postgres", "SELECT sum(delta) FROM pgbench_history")
+		self.assertEqual(bbalance, delta)
+
+		node.stop()
+
+	def test_restore_page_visibility_map_24(self):
+		"""recovery from a page backup takes the visibility map of the page backup"""
+		node = self.make_bnode('restore_page_visibility_map_24', base_dir="tmp_dirs/restore/restore_page_visibility_map_24")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.psql("postgres", "CREATE TABLE tbl AS SELECT generate_series(0, 100000) AS id")
+		node.psql("postgres", "CREATE INDEX tbl_id ON tbl (id)")
+		node.psql("postgres", "ALTER TABLE tbl SET (autovacuum_enabled = off)")
+		node.psql("postgres", "VACUUM tbl")
+		# answer from the index alone where the visibility map allows it
+		node.psql("postgres", "ALTER DATABASE postgres SET enable_seqscan = off")
+		node.psql("postgres", "ALTER DATABASE postgres SET enable_bitmapscan = off")
+		vm_path = path.join(node.data_dir, node.execute("postgres", "SELECT pg_relation_filepath('tbl')")[0][0] + "_vm")
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose"]))
+
+		# the update clears the bits of the pages it touches
+		node.psql("postgres", "UPDATE tbl SET id = id + 1000000 WHERE id % 100 = 0")
+		node.psql("postgres", "CHECKPOINT")
+
+		with open(path.join(node.logs_dir, "backup_2.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, backup_type="page", options=["--verbose"]))
+
+		before = node.execute("postgres", "SELECT count(*) FROM tbl WHERE id < 1000000")
+		with open(vm_path, "rb") as f:
+			vm_before = f.read()
+
+		node.stop({"-m": "immediate"})
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		with open(vm_path, "rb") as f:
+			self.assertEqual(vm_before, f.read())
+
+		node.start({"-t": "600"})
+
+		after = node.execute("postgres", "SELECT count(*) FROM tbl WHERE id < 1000000")
+		self.assertEqual(before, after)
+
+		node.stop()
+
+	def test_restore_tablespace_with_space_25(self):
+		"""recovery of a tablespace whose directory has a space in its name"""
+		node = self.make_bnode('restore_tablespace_with_space_25', base_dir="tmp_dirs/restore/restore_tablespace_with_space_25")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+
+		tblspc_path = path.join(node.base_dir, "tbl spc")
+		makedirs(path.join(tblspc_path, "sub dir"))
+		tblspc_path = path.join(tblspc_path, "sub dir")
+		node.psql("postgres", "CREATE TABLESPACE tblspc LOCATION '%s'" % tblspc_path)
+		node.psql("postgres", "CREATE TABLE test TABLESPACE tblspc AS SELECT generate_series(0, 1000) AS id")
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose"]))
+
+		node.stop({"-m": "immediate"})
+		rmtree(path.join(node.base_dir, "tbl spc"))
+
+		with open(path.join(node.logs_dir, "restore_1.log"), "wb") as restore_log:
+			restore_log.write(self.restore_pb(node, options=["-j", "4", "--verbose"]))
+
+		self.assertTrue(path.isdir(tblspc_path))
+
+		node.start({"-t": "600"})
+
+		count = node.execute("postgres", "SELECT count(*) FROM test")
+		self.assertEqual(count[0][0], 1001)
+
+		node.stop()
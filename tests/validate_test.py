@@ -59,3 +59,30 @@ class ValidateTest(ProbackupTest, unittest.TestCase):
 		id_backup = self.show_pb(node)[0].id
 		res = self.validate_pb(node, id_backup, options=['--xid=%s' % target_xid])
 		self.assertIn(six.b("incorrect resource manager data checksum in record"), res)
+
+	def test_validate_corrupt_chunk_2(self):
+		"""validation reports the blocks of a corrupted chunk of a data file"""
+		node = self.make_bnode('test_validate_corrupt_chunk_2', base_dir="tmp_dirs/validate/corrupt_chunk_2")
+		node.start()
+		self.assertEqual(self.init_pb(node), six.b(""))
+		node.psql("postgres", "CREATE TABLE tbl AS SELECT generate_series(0, 100000) AS id")
+		node.psql("postgres", "CHECKPOINT")
+		relpath = node.execute("postgres", "SELECT pg_relation_filepath('tbl')")[0][0]
+
+		with open(path.join(node.logs_dir, "backup_1.log"), "wb") as backup_log:
+			backup_log.write(self.backup_pb(node, options=["--verbose"]))
+
+		node.stop()
+
+		id_backup = self.show_pb(node)[0].id
+		backup_file = path.join(self.backup_dir(node), "backups", id_backup.decode("utf-8"), "database", relpath)
+		with open(backup_file, "rb+") as f:
+			f.seek(0, 2)
+			f.seek(f.tell() // 2)
+			byte = f.read(1)
+			f.seek(-1, 1)
+			f.write(six.int2byte(six.indexbytes(byte, 0) ^ 0xFF))
+
+		res = self.validate_pb(node, id_backup)
+		self.assertIn(six.b("of backup file \"%s\" are corrupted" % relpath), res)
+		self.assertEqual(self.show_pb(node, id=id_backup)[six.b("STATUS")].strip(), six.b("CORRUPT"))
@@ -0,0 +1,216 @@
+/*-------------------------------------------------------------------------
+ *
+ * throttle.c: limit the read and write bandwidth of backup
+ *
+ * Reads and writes are each charged to a token bucket shared by all the
+ * threads, including the one streaming WAL.  A thread that takes more
+ * bytes than the bucket holds sleeps until the debt is paid back at the
+ * configured rate.
+ *
+ * The limits may be changed while a backup is running by writing
+ * max-read-rate and max-write-rate into $BACKUP_PATH/throttle.conf, which
+ * is checked once a second.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_probackup.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* limits in MB per second given by options, 0 means unlimited */
+int			max_read_rate = 0;
+int			max_write_rate = 0;
+
+/* a bucket holds at most the bytes of this many seconds */
+#define THROTTLE_BURST_SECONDS	0.1
+
+/* interval between checks of the control file */
+#define THROTTLE_RELOAD_SECONDS	1.0
+
+typedef struct TokenBucket
+{
+	double		rate;			/* bytes per second, 0 if unlimited */
+	double		tokens;			/* bytes available, negative if in debt */
+	double		last;			/* time of the last refill */
+	uint64		total_bytes;	/* bytes charged since throttle_start() */
+} TokenBucket;
+
+static pthread_mutex_t throttle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TokenBucket read_bucket;
+static TokenBucket write_bucket;
+static double throttle_start_time = 0;
+static double throttled_time = 0;		/* seconds slept, all threads */
+static double last_reload = 0;
+static struct timespec control_mtime;	/* of the control file read last */
+static off_t control_size = -1;
+
+static double
+now_seconds(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+bucket_set_rate(TokenBucket *bucket, int mb_per_sec, double now)
+{
+	double		rate = (double) mb_per_sec * 1024 * 1024;
+
+	if (rate == bucket->rate)
+		return;
+
+	bucket->rate = rate;
+	bucket->tokens = rate * THROTTLE_BURST_SECONDS;
+	bucket->last = now;
+}
+
+/*
+ * Re-read the limits from the control file if it changed.  Called with
+ * throttle_mutex held.
+ */
+static void
+reload_limits(double now)
+{
+	char		path[MAXPGPATH];
+	struct stat	st;
+	int			read_rate = max_read_rate;
+	int			write_rate = max_write_rate;
+	pgut_option options[] =
+	{
+		{ 'i', 0, "max-read-rate",	NULL, SOURCE_ENV },
+		{ 'i', 0, "max-write-rate",	NULL, SOURCE_ENV },
+		{ 0 }
+	};
+
+	last_reload = now;
+
+	join_path_components(path, backup_path, THROTTLE_CONTROL_FILE);
+	/*
+	 * Whole-second mtimes would miss a rewrite within the second of the
+	 * previous one, so compare the nanoseconds and the size as well.
+	 */
+	if (stat(path, &st) == -1 ||
+		(st.st_mtim.tv_sec == control_mtime.tv_sec &&
+		 st.st_mtim.tv_nsec == control_mtime.tv_nsec &&
+		 st.st_size == control_size))
+		return;
+	control_mtime = st.st_mtim;
+	control_size = st.st_size;
+
+	options[0].var = &read_rate;
+	options[1].var = &write_rate;
+	pgut_readopt(path, options, WARNING);
+
+	if (read_rate < 0 || write_rate < 0)
+	{
+		elog(WARNING, "negative rate in \"%s\" is ignored", path);
+		return;
+	}
+
+	if (read_rate != max_read_rate || write_rate != max_write_rate)
+		elog(INFO, "bandwidth limits changed to read %d MB/s, write %d MB/s",
+			 read_rate, write_rate);
+
+	max_read_rate = read_rate;
+	max_write_rate = write_rate;
+	bucket_set_rate(&read_bucket, max_read_rate, now);
+	bucket_set_rate(&write_bucket, max_write_rate, now);
+}
+
+/*
+ * Charge bytes to the bucket and sleep while it is in debt.
+ */
+static void
+throttle(TokenBucket *bucket, size_t bytes)
+{
+	double		now;
+	double		wait = 0;
+
+	/* only backup is throttled */
+	if (throttle_start_time == 0)
+		return;
+
+	now = now_seconds();
+	pthread_mutex_lock(&throttle_mutex);
+
+	if (now - last_reload >= THROTTLE_RELOAD_SECONDS)
+		reload_limits(now);
+
+	bucket->total_bytes += bytes;
+	if (bucket->rate > 0)
+	{
+		bucket->tokens += (now - bucket->last) * bucket->rate;
+		if (bucket->tokens > bucket->rate * THROTTLE_BURST_SECONDS)
+			bucket->tokens = bucket->rate * THROTTLE_BURST_SECONDS;
+		bucket->last = now;
+
+		bucket->tokens -= bytes;
+		if (bucket->tokens < 0)
+		{
+			wait = -bucket->tokens / bucket->rate;
+			throttled_time += wait;
+		}
+	}
+
+	pthread_mutex_unlock(&throttle_mutex);
+
+	if (wait > 0)
+		pg_usleep((long) (wait * 1000000));
+}
+
+/*
+ * Reset the buckets and counters at the start of a backup.
+ */
+void
+throttle_start(void)
+{
+	double		now = now_seconds();
+
+	pthread_mutex_lock(&throttle_mutex);
+	memset(&read_bucket, 0, sizeof(read_bucket));
+	memset(&write_bucket, 0, sizeof(write_bucket));
+	bucket_set_rate(&read_bucket, max_read_rate, now);
+	bucket_set_rate(&write_bucket, max_write_rate, now);
+	throttle_start_time = now;
+	throttled_time = 0;
+	control_size = -1;
+	reload_limits(now);
+	pthread_mutex_unlock(&throttle_mutex);
+}
+
+void
+throttle_read(size_t bytes)
+{
+	throttle(&read_bucket, bytes);
+}
+
+void
+throttle_write(size_t bytes)
+{
+	throttle(&write_bucket, bytes);
+}
+
+/*
+ * Store the average rates and the time spent throttled since
+ * throttle_start() into backup.
+ */
+void
+throttle_report(pgBackup *backup)
+{
+	double		elapsed;
+
+	pthread_mutex_lock(&throttle_mutex);
+	elapsed = now_seconds() - throttle_start_time;
+	if (elapsed <= 0)
+		elapsed = 1;
+	backup->read_rate = (uint64) (read_bucket.total_bytes / elapsed);
+	backup->write_rate = (uint64) (write_bucket.total_bytes / elapsed);
+	backup->throttled_time = (uint32) (throttled_time + 0.5);
+	pthread_mutex_unlock(&throttle_mutex);
+}
@@ -9,10 +9,11 @@
 
 #include "pg_probackup.h"
 
+#include <fcntl.h>
 #include <sys/stat.h>
-#include <pthread.h>
+#include <unistd.h>
 
-static void pgBackupValidateFiles(void *arg);
+static void pgBackupValidateFiles(void *task, int index, void *arg);
 void do_validate_last(void);
 
 typedef struct
@@ -20,7 +21,7 @@ typedef struct
 	parray *files;
 	const char *root;
 	bool size_only;
-	bool corrupted;
+	volatile bool corrupted;	/* set by the first corrupted file found */
 } validate_files_args;
 
 void do_validate_last(void)
@@ -177,7 +178,8 @@ base_backup_found:
 
 		/* use database backup only */
 		if (backup->backup_mode != BACKUP_MODE_DIFF_PAGE &&
-			backup->backup_mode != BACKUP_MODE_DIFF_PTRACK)
+			backup->backup_mode != BACKUP_MODE_DIFF_PTRACK &&
+			backup->backup_mode != BACKUP_MODE_DIFF_DELTA)
 			continue;
 
 		/* is the backup is necessary for restore to target timeline ? */
@@ -223,18 +225,16 @@ pgBackupValidate(pgBackup *backup,
 {
 	char	*backup_id_string;
 	char	base_path[MAXPGPATH];
-	char	path[MAXPGPATH];
 	parray *files;
 	bool	corrupted = false;
-	pthread_t	validate_threads[num_threads];
-	validate_files_args *validate_threads_args[num_threads];
 
 	backup_id_string = base36enc(backup->start_time);
 	if (!for_get_timeline)
 	{
 		if (backup->backup_mode == BACKUP_MODE_FULL ||
 			backup->backup_mode == BACKUP_MODE_DIFF_PAGE ||
-			backup->backup_mode == BACKUP_MODE_DIFF_PTRACK)
+			backup->backup_mode == BACKUP_MODE_DIFF_PTRACK ||
+			backup->backup_mode == BACKUP_MODE_DIFF_DELTA)
 			elog(INFO, "validate: %s backup and archive log files by %s",
 				 backup_id_string, (size_only ? "SIZE" : "CRC"));
 	}
@@ -243,45 +243,29 @@ pgBackupValidate(pgBackup *backup,
 	{
 		if (backup->backup_mode == BACKUP_MODE_FULL ||
 			backup->backup_mode == BACKUP_MODE_DIFF_PAGE ||
-			backup->backup_mode == BACKUP_MODE_DIFF_PTRACK)
+			backup->backup_mode == BACKUP_MODE_DIFF_PTRACK ||
+			backup->backup_mode == BACKUP_MODE_DIFF_DELTA)
 		{
-			int i;
+			validate_files_args args;
+			pgArena *outer_arena = file_arena_begin();
+
 			elog(LOG, "database files...");
 			pgBackupGetPath(backup, base_path, lengthof(base_path), DATABASE_DIR);
-			pgBackupGetPath(backup, path, lengthof(path),
-				DATABASE_FILE_LIST);
-			files = dir_read_file_list(base_path, path);
-
-			/* setup threads */
-			for (i = 0; i < parray_num(files); i++)
-			{
-				pgFile *file = (pgFile *) parray_get(files, i);
-				__sync_lock_release(&file->lock);
-			}
-
-			/* restore files into $PGDATA */
-			for (i = 0; i < num_threads; i++)
-			{
-				validate_files_args *arg = pg_malloc(sizeof(validate_files_args));
-				arg->files = files;
-				arg->root = base_path;
-				arg->size_only = size_only;
-				arg->corrupted = false;
-
-				validate_threads_args[i] = arg;
-				pthread_create(&validate_threads[i], NULL, (void *(*)(void *)) pgBackupValidateFiles, arg);
-			}
-
-			/* Wait theads */
-			for (i = 0; i < num_threads; i++)
-			{
-				pthread_join(validate_threads[i], NULL);
-				if (validate_threads_args[i]->corrupted)
-					corrupted = true;
-				pg_free(validate_threads_args[i]);
-			}
+			files = read_backup_file_list(backup, base_path);
+
+			/* check files in parallel, largest first */
+			parray_qsort(files, pgFileCompareWriteSizeDesc);
+
+			args.files = files;
+			args.root = base_path;
+			args.size_only = size_only;
+			args.corrupted = false;
+			run_tasks(files, num_threads, pgBackupValidateFiles, &args);
+			corrupted = args.corrupted;
+
 			parray_walk(files, pgFileFree);
 			parray_free(files);
+			file_arena_end(outer_arena);
 		}
 
 		/* update status to OK */
@@ -309,69 +293,73 @@ get_relative_path(const char *path, const char *root)
 }
 
 /*
- * Validate files in the backup with size or CRC.
+ * Validate a file in the backup with size, and CRC or chunk hashes, called
+ * by run_tasks().
+ * Once a corrupted file is found the remaining files are not checked.
  */
 static void
-pgBackupValidateFiles(void *arg)
+pgBackupValidateFiles(void *task, int index, void *arg)
 {
-	int		i;
-
+	pgBackupCopy *copy;
+	pgFile *file = (pgFile *) task;
 	validate_files_args *arguments = (validate_files_args *)arg;
 
+	if (arguments->corrupted)
+		return;
 
-	for (i = 0; i < parray_num(arguments->files); i++)
-	{
-		struct stat st;
-
-		pgFile *file = (pgFile *) parray_get(arguments->files, i);
-		if (__sync_lock_test_and_set(&file->lock, 1) != 0)
-			continue;
+	if (interrupted)
+		elog(ERROR, "interrupted during validate");
 
-		if (interrupted)
-			elog(ERROR, "interrupted during validate");
+	/* skipped backup while differential backup */
+	if (file->write_size == BYTES_INVALID || !S_ISREG(file->mode))
+		return;
 
-		/* skipped backup while differential backup */
-		if (file->write_size == BYTES_INVALID || !S_ISREG(file->mode))
-			continue;
+	/* print progress */
+	elog(LOG, "(%d/%lu) %s", index + 1, (unsigned long) parray_num(arguments->files),
+		get_relative_path(file->path, arguments->root));
 
-		/* print progress */
-		elog(LOG, "(%d/%lu) %s", i + 1, (unsigned long) parray_num(arguments->files),
-			get_relative_path(file->path, arguments->root));
+	/* always validate file size, the copy of a split file is in parts */
+	copy = backup_copy_open(file);
+	if (copy == NULL)
+	{
+		elog(WARNING, "backup file \"%s\" vanished", file->path);
+		arguments->corrupted = true;
+		return;
+	}
+	if (file->write_size != backup_copy_size(copy))
+	{
+		elog(WARNING, "size of backup file \"%s\" must be %lu but %lu",
+			get_relative_path(file->path, arguments->root),
+			(unsigned long) file->write_size,
+			(unsigned long) backup_copy_size(copy));
+		arguments->corrupted = true;
+		backup_copy_close(copy);
+		return;
+	}
 
-		/* always validate file size */
-		if (stat(file->path, &st) == -1)
-		{
-			if (errno == ENOENT)
-				elog(WARNING, "backup file \"%s\" vanished", file->path);
-			else
-				elog(ERROR, "cannot stat backup file \"%s\": %s",
-					get_relative_path(file->path, arguments->root), strerror(errno));
-			arguments->corrupted = true;
-			return;
-		}
-		if (file->write_size != st.st_size)
-		{
-			elog(WARNING, "size of backup file \"%s\" must be %lu but %lu",
-				get_relative_path(file->path, arguments->root),
-				(unsigned long) file->write_size,
-				(unsigned long) st.st_size);
+	/*
+	 * Check a data file chunk by chunk if it has chunk hashes, which report
+	 * each corrupted range of blocks.  The chunks cover the whole file.
+	 */
+	if (!arguments->size_only && file->nchunks > 0)
+	{
+		if (check_backup_chunks(copy, file,
+								get_relative_path(file->path, arguments->root)) > 0)
 			arguments->corrupted = true;
-			return;
-		}
+	}
+	/* validate CRC too */
+	else if (!arguments->size_only)
+	{
+		pg_crc32	crc;
 
-		/* validate CRC too */
-		if (!arguments->size_only)
+		crc = backup_copy_crc(copy);
+		if (crc != file->crc)
 		{
-			pg_crc32	crc;
-
-			crc = pgFileGetCRC(file);
-			if (crc != file->crc)
-			{
-				elog(WARNING, "CRC of backup file \"%s\" must be %X but %X",
-					get_relative_path(file->path, arguments->root), file->crc, crc);
-				arguments->corrupted = true;
-				return;
-			}
+			elog(WARNING, "CRC of backup file \"%s\" must be %X but %X",
+				get_relative_path(file->path, arguments->root), file->crc, crc);
+			arguments->corrupted = true;
 		}
 	}
+
+	backup_copy_close(copy);
 }